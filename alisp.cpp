@@ -1,15 +1,27 @@
 #include "alisp.h"
+#include "foreign.h"
+#include "gdbjit.h"
+#include "perfmap.h"
 
 #define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
 #include <windows.h>
+#include <intrin.h>
+#include <emmintrin.h>
 #include <algorithm>
+#include <atomic>
 #include <string>
 #include <cassert>
 #include <cctype>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
 
 Code::Code(const std::vector<uint8_t> &buf)
     : _ptr{reinterpret_cast<unsigned char *>(::VirtualAlloc(nullptr, std::size(buf), MEM_COMMIT, PAGE_READWRITE)),
-           &VFree}
+           &VFree},
+      _size{buf.size()}
 {
     std::copy(buf.cbegin(), buf.cend(), _ptr.get());
     DWORD oldProtect;
@@ -17,11 +29,51 @@ Code::Code(const std::vector<uint8_t> &buf)
     assert(protResult);
 }
 
+Code::Code(const std::vector<uint8_t> &buf, CodeArena &arena)
+    : _ptr{arena.place(buf), [](uint8_t *) {}}, _size{buf.size()}
+{
+}
+
 void Code::VFree(uint8_t *ptr)
 {
     VirtualFree(ptr, 0, MEM_RELEASE);
 }
 
+CodeArena::~CodeArena()
+{
+    for (auto &chunk : _chunks)
+    {
+        Code::VFree(chunk.base);
+    }
+}
+
+uint8_t *CodeArena::place(const std::vector<uint8_t> &bytes)
+{
+    // Functions start on a 16 byte boundary
+    constexpr size_t Alignment = 16;
+    auto fits = [&](const Chunk &chunk) {
+        return ((chunk.used + Alignment - 1) & ~(Alignment - 1)) + bytes.size() <= chunk.size;
+    };
+    if (_chunks.empty() || !fits(_chunks.back()))
+    {
+        auto size = std::max(ChunkSize, (bytes.size() + ChunkSize - 1) & ~(ChunkSize - 1));
+        auto base = reinterpret_cast<uint8_t *>(::VirtualAlloc(nullptr, size, MEM_COMMIT, PAGE_EXECUTE));
+        assert(base);
+        _chunks.push_back({base, size, 0});
+    }
+    auto &chunk = _chunks.back();
+    auto ptr = chunk.base + ((chunk.used + Alignment - 1) & ~(Alignment - 1));
+    chunk.used = ptr - chunk.base + bytes.size();
+
+    DWORD oldProtect;
+    auto protResult = VirtualProtect(ptr, bytes.size(), PAGE_READWRITE, &oldProtect);
+    assert(protResult);
+    std::copy(bytes.cbegin(), bytes.cend(), ptr);
+    protResult = VirtualProtect(ptr, bytes.size(), PAGE_EXECUTE, &oldProtect);
+    assert(protResult);
+    return ptr;
+}
+
 void Buffer::write8(uint8_t v) { _buf.push_back(v); }
 
 void Buffer::write32(uint32_t v)
@@ -55,9 +107,157 @@ size_t Buffer::size() const
 
 Code Buffer::freeze() const
 {
-    return Code{_buf};
+    Stats::Timer timer{Stats::Phase::Freeze};
+    timer.setBytes(_buf.size());
+    Code code{_buf};
+    registerCode(code);
+    return code;
+}
+
+Code Buffer::freeze(CodeArena &arena) const
+{
+    Stats::Timer timer{Stats::Phase::Freeze};
+    timer.setBytes(_buf.size());
+    Code code{_buf, arena};
+    registerCode(code);
+    return code;
+}
+
+void Buffer::registerCode(Code &code) const
+{
+    if (PerfMap::enabled())
+    {
+        PerfMap::registerCode(code, *this);
+    }
+    if (GdbJit::enabled())
+    {
+        code._debugRegistration = GdbJit::registerCode(code, *this);
+    }
 }
 
+namespace Stats
+{
+    struct AtomicPhaseStats
+    {
+        std::atomic<uint64_t> count{};
+        std::atomic<uint64_t> totalNs{};
+        std::atomic<uint64_t> maxNs{};
+        std::atomic<uint64_t> bytes{};
+        std::array<std::atomic<uint64_t>, HistogramBuckets> histogram{};
+    };
+
+    static AtomicPhaseStats phases[static_cast<int>(Phase::Count)];
+
+    uint64_t PhaseStats::quantileNs(double q) const
+    {
+        auto target = static_cast<uint64_t>(q * count);
+        uint64_t seen = 0;
+        for (int i = 0; i < HistogramBuckets; ++i)
+        {
+            seen += histogram[i];
+            if (seen > target)
+            {
+                return std::min<uint64_t>(1ULL << i, maxNs);
+            }
+        }
+        return maxNs;
+    }
+
+    const char *name(Phase phase)
+    {
+        switch (phase)
+        {
+        case Phase::Read:
+            return "read";
+        case Phase::Compile:
+            return "compile";
+        case Phase::Freeze:
+            return "freeze";
+        case Phase::Execute:
+            return "execute";
+        case Phase::Interpret:
+            return "interpret";
+        default:
+            return "?";
+        }
+    }
+
+    PhaseStats get(Phase phase)
+    {
+        auto &stats = phases[static_cast<int>(phase)];
+        PhaseStats result;
+        result.count = stats.count.load(std::memory_order_relaxed);
+        result.totalNs = stats.totalNs.load(std::memory_order_relaxed);
+        result.maxNs = stats.maxNs.load(std::memory_order_relaxed);
+        result.bytes = stats.bytes.load(std::memory_order_relaxed);
+        for (int i = 0; i < HistogramBuckets; ++i)
+        {
+            result.histogram[i] = stats.histogram[i].load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+    void record(Phase phase, uint64_t ns, uint64_t bytes)
+    {
+        auto &stats = phases[static_cast<int>(phase)];
+        stats.count.fetch_add(1, std::memory_order_relaxed);
+        stats.totalNs.fetch_add(ns, std::memory_order_relaxed);
+        stats.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        for (auto max = stats.maxNs.load(std::memory_order_relaxed);
+             ns > max && !stats.maxNs.compare_exchange_weak(max, ns, std::memory_order_relaxed);)
+        {
+        }
+        int bucket = 0;
+        for (auto v = ns; v && bucket < HistogramBuckets - 1; v >>= 1)
+        {
+            ++bucket;
+        }
+        stats.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void reset()
+    {
+        for (auto &stats : phases)
+        {
+            stats.count = 0;
+            stats.totalNs = 0;
+            stats.maxNs = 0;
+            stats.bytes = 0;
+            for (auto &bucket : stats.histogram)
+            {
+                bucket = 0;
+            }
+        }
+    }
+} // namespace Stats
+
+namespace Cpu
+{
+    bool hasAvx2()
+    {
+        static const bool avx2 = [] {
+            int info[4];
+            __cpuid(info, 0);
+            if (info[0] < 7)
+            {
+                return false;
+            }
+            // AVX and OSXSAVE, then whether the OS enabled the xmm and ymm state
+            constexpr int OsXsave = 1 << 27;
+            constexpr int Avx = 1 << 28;
+            __cpuid(info, 1);
+            if ((info[2] & (OsXsave | Avx)) != (OsXsave | Avx) || (_xgetbv(0) & 0b110) != 0b110)
+            {
+                return false;
+            }
+            constexpr int Avx2 = 1 << 5;
+            __cpuidex(info, 7, 0);
+            return (info[1] & Avx2) != 0;
+        }();
+        return avx2;
+    }
+} // namespace Cpu
+
 namespace Objects
 {
     word encodeInteger(word value)
@@ -97,8 +297,44 @@ namespace Objects
     }
 
     uword error() { return ErrorTag; }
+
+    uint32_t compress(word value)
+    {
+        return static_cast<uint32_t>(value);
+    }
+    word decompress(uint32_t value, uword base)
+    {
+        // Heap tags end in 01 or 10; integers end in 00 and the other
+        // immediates in 11, and those are sign extended
+        auto low = value & 0b11;
+        if (low == 0b01 || low == 0b10)
+        {
+            return static_cast<word>(base | value);
+        }
+        return static_cast<int32_t>(value);
+    }
+    uword compressedBase(const void *address)
+    {
+        return reinterpret_cast<uword>(address) & ~(CompressedRegionSize - 1);
+    }
 } // namespace Objects
 
+CompressedHeap::CompressedHeap(size_t size) : _size{size}
+{
+    assert(size <= Objects::CompressedRegionSize);
+    // Twice the region, so that an aligned one fits somewhere inside
+    _reservation = ::VirtualAlloc(nullptr, 2 * Objects::CompressedRegionSize, MEM_RESERVE, PAGE_NOACCESS);
+    assert(_reservation);
+    auto start = (reinterpret_cast<uword>(_reservation) + Objects::CompressedRegionSize - 1) & ~(Objects::CompressedRegionSize - 1);
+    _data = reinterpret_cast<uword *>(::VirtualAlloc(reinterpret_cast<void *>(start), size, MEM_COMMIT, PAGE_READWRITE));
+    assert(_data);
+}
+
+CompressedHeap::~CompressedHeap()
+{
+    VirtualFree(_reservation, 0, MEM_RELEASE);
+}
+
 ASTNode *ASTNode::newInteger(word value)
 {
     return reinterpret_cast<ASTNode *>(Objects::encodeInteger(value));
@@ -160,7 +396,7 @@ ASTNode *heapAlloc(uint8_t tag, uword size)
 
 static bool isHeapObject(ASTNode *node)
 {
-    return (reinterpret_cast<uintptr_t>(node) & Objects::HeapPtrMask) == Objects::HeapTagMask;
+    return node->isPair() || node->isSymbol() || node->isString();
 }
 
 void heapFree(ASTNode *node)
@@ -169,15 +405,32 @@ void heapFree(ASTNode *node)
     {
         return;
     }
-    if (node->isPair())
+    // Trees can be nested deeper than the native stack allows. Kept per
+    // thread so that freeing does not allocate.
+    static thread_local std::vector<ASTNode *> pending;
+    pending.push_back(node);
+    while (!pending.empty())
     {
-        auto pair = node->asPair();
-        heapFree(pair->car);
-        pair->car = nullptr;
-        heapFree(pair->cdr);
-        pair->cdr = nullptr;
+        node = pending.back();
+        pending.pop_back();
+        if (!isHeapObject(node))
+        {
+            continue;
+        }
+        if (node->isPair())
+        {
+            auto pair = node->asPair();
+            pending.push_back(pair->cdr);
+            pending.push_back(pair->car);
+            pair->car = nullptr;
+            pair->cdr = nullptr;
+        }
+        else if (node->isSymbol())
+        {
+            node->asSymbol()->~Symbol();
+        }
+        delete[](reinterpret_cast<uint8_t *>(Objects::address(node)));
     }
-    delete[](reinterpret_cast<uint8_t *>(Objects::address(node)));
 }
 
 ASTNode *ASTNode::newPair(ASTNode *car, ASTNode *cdr)
@@ -191,6 +444,12 @@ ASTNode *ASTNode::newPair(ASTNode *car, ASTNode *cdr)
     return node;
 }
 
+CompressedPair *ASTNode::asCompressedPair() const
+{
+    assert(isPair());
+    return (CompressedPair *)Objects::address(reinterpret_cast<const void *>(this));
+}
+
 bool ASTNode::isPair() const
 {
     return (reinterpret_cast<uword>(this) & Objects::HeapTagMask) == Objects::PairTag;
@@ -220,6 +479,89 @@ Symbol *ASTNode::asSymbol() const
     return (Symbol *)Objects::address(reinterpret_cast<const void *>(this));
 }
 
+ASTNode *ASTNode::newString(std::string_view text)
+{
+    auto size = String::allocationSize(text.size());
+    auto node = heapAlloc(Objects::StringTag, size);
+    auto string = node->asString();
+    std::fill_n(reinterpret_cast<uint8_t *>(string), size, 0);
+    string->length = Objects::encodeInteger(static_cast<word>(text.size()));
+    std::copy(text.begin(), text.end(), reinterpret_cast<char *>(string + 1));
+    return node;
+}
+bool ASTNode::isString() const
+{
+    return (reinterpret_cast<uintptr_t>(this) & Objects::HeapTagMask) == Objects::StringTag;
+}
+String *ASTNode::asString() const
+{
+    assert(isString());
+    return (String *)Objects::address(reinterpret_cast<const void *>(this));
+}
+
+namespace Strings
+{
+    static __m128i load16(const char *bytes)
+    {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes));
+    }
+
+    bool equal(ASTNode *left, ASTNode *right)
+    {
+        auto a = left->asString();
+        auto b = right->asString();
+        if (a->length != b->length)
+        {
+            return false;
+        }
+        auto size = a->size();
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16)
+        {
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(load16(a->data() + i), load16(b->data() + i))) != 0xffff)
+            {
+                return false;
+            }
+        }
+        return std::equal(a->data() + i, a->data() + size, b->data() + i);
+    }
+
+    word index(ASTNode *string, char c)
+    {
+        auto s = string->asString();
+        auto size = s->size();
+        auto needle = _mm_set1_epi8(c);
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16)
+        {
+            if (auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(load16(s->data() + i), needle)))
+            {
+                unsigned long bit;
+                _BitScanForward(&bit, static_cast<unsigned long>(mask));
+                return static_cast<word>(i + bit);
+            }
+        }
+        for (; i < size; ++i)
+        {
+            if (s->data()[i] == c)
+            {
+                return static_cast<word>(i);
+            }
+        }
+        return -1;
+    }
+} // namespace Strings
+
+bool ASTNode::isVector() const
+{
+    return (reinterpret_cast<uintptr_t>(this) & Objects::HeapTagMask) == Objects::VectorTag;
+}
+Vector *ASTNode::asVector() const
+{
+    assert(isVector());
+    return (Vector *)Objects::address(reinterpret_cast<const void *>(this));
+}
+
 ASTNode *ASTNode::newUnaryCall(const std::string_view &name, ASTNode *arg)
 {
     return newPair(newSymbol(name), newPair(arg, nil()));
@@ -237,20 +579,85 @@ bool ASTNode::isError() const
 }
 
 std::optional<word> Env::find(const std::string_view &name) const
+{
+    if (auto env = lookup(name))
+    {
+        return env->value;
+    }
+    return {};
+}
+
+const Env *Env::lookup(const std::string_view &name) const
 {
     for (auto env = this; env; env = env->prev)
     {
         if (name == env->name)
         {
-            return env->value;
+            return env;
+        }
+    }
+    return nullptr;
+}
+
+bool LabelTable::add(std::string_view name, word address)
+{
+    if (find(name))
+    {
+        return false;
+    }
+    // Keep the load factor under a half
+    if ((_names.size() + 1) * 2 > _buckets.size())
+    {
+        rehash(std::max<size_t>(16, _buckets.size() * 2));
+    }
+    auto mask = _buckets.size() - 1;
+    auto bucket = std::hash<std::string_view>{}(name) & mask;
+    while (_buckets[bucket])
+    {
+        bucket = (bucket + 1) & mask;
+    }
+    _buckets[bucket] = static_cast<uint32_t>(_names.size() + 1);
+    _names.push_back(name);
+    addresses.push_back(address);
+    return true;
+}
+
+std::optional<size_t> LabelTable::find(std::string_view name) const
+{
+    if (_buckets.empty())
+    {
+        return {};
+    }
+    auto mask = _buckets.size() - 1;
+    for (auto bucket = std::hash<std::string_view>{}(name) & mask; _buckets[bucket]; bucket = (bucket + 1) & mask)
+    {
+        auto index = _buckets[bucket] - 1;
+        if (_names[index] == name)
+        {
+            return index;
         }
     }
     return {};
 }
 
+void LabelTable::rehash(size_t capacity)
+{
+    _buckets.assign(capacity, 0);
+    for (size_t index = 0; index < _names.size(); ++index)
+    {
+        auto bucket = std::hash<std::string_view>{}(_names[index]) & (capacity - 1);
+        while (_buckets[bucket])
+        {
+            bucket = (bucket + 1) & (capacity - 1);
+        }
+        _buckets[bucket] = static_cast<uint32_t>(index + 1);
+    }
+}
+
 namespace Emit
 {
     constexpr uint8_t RexPrefix = 0x48;
+    constexpr uint8_t RexW = 0x08;
 
     enum Scale
     {
@@ -272,6 +679,12 @@ namespace Emit
         IndexRdi
     };
 
+    // REX.W, plus the bits that extend the ModRM reg and rm fields to r8-r15
+    static uint8_t rex(uint8_t reg, uint8_t rm)
+    {
+        return RexPrefix | ((reg >> 3) << 2) | (rm >> 3);
+    }
+
     uint8_t modrm(uint8_t mod, uint8_t rm, uint8_t reg)
     {
         return ((mod & 3) << 6) | ((reg & 0x7) << 3) | (rm & 0x7);
@@ -283,81 +696,236 @@ namespace Emit
 
     static uint8_t disp8(int8_t disp) { return disp >= 0 ? disp : 0x100 + disp; }
     static uint32_t disp32(int32_t disp) { return disp >= 0 ? disp : static_cast<uint32_t>(0x1'0000'0000 + disp); }
-    static void addressDisp8(Buffer &buf, Register direct, const Indirect &indirect)
+    // The mod of a displacement from `base`: none for zero, except from rbp
+    // and r13, which need one; disp8 where it fits, else disp32
+    static int dispMod(Register base, int32_t disp)
+    {
+        if (disp == 0 && (base & 7) != Rbp)
+        {
+            return 0;
+        }
+        return disp >= INT8_MIN && disp <= INT8_MAX ? 1 : 2;
+    }
+
+    static void writeDisp(Buffer &buf, int mod, int32_t disp)
+    {
+        if (mod == 1)
+        {
+            buf.write8(disp8(static_cast<int8_t>(disp)));
+        }
+        else if (mod == 2)
+        {
+            buf.write32(disp32(disp));
+        }
+    }
+
+    static void addressDisp(Buffer &buf, Register direct, const Indirect &indirect)
     {
-        if (indirect.reg == Rsp)
+        auto mod = dispMod(indirect.reg, indirect.disp);
+        if ((indirect.reg & 7) == Rsp)
         {
-            buf.write8(modrm(1, IndexNone, direct));
+            buf.write8(modrm(mod, IndexNone, direct));
             buf.write8(sib(Rsp, IndexNone, Scale1));
         }
         else
         {
-            buf.write8(modrm(1, indirect.reg, direct));
+            buf.write8(modrm(mod, indirect.reg, direct));
         }
-        buf.write8(disp8(indirect.disp));
+        writeDisp(buf, mod, indirect.disp);
     }
 
     void movRegReg(Buffer &buf, Register dst, Register src)
     {
-        buf.write8(RexPrefix);
+        buf.write8(rex(src, dst));
         buf.write8(0x89);
-        buf.write8(0xc0 | (src << 3) | dst);
+        buf.write8(modrm(3, dst, src));
+    }
+    static bool fitsImm8(int32_t value)
+    {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    // Always the 10 byte movabs, for code whose size is fixed in advance
+    void movRegImm64(Buffer &buf, Register dst, uint64_t src)
+    {
+        buf.write8(rex(0, dst));
+        buf.write8(0xb8 + (dst & 7));
+        buf.write32(static_cast<uint32_t>(src));
+        buf.write32(static_cast<uint32_t>(src >> 32));
+    }
+    // mov dst32, src: zero extends into the whole register
+    static void movRegUImm32(Buffer &buf, Register dst, uint32_t src)
+    {
+        if (dst >= R8)
+        {
+            buf.write8(rex(0, dst) & ~RexW);
+        }
+        buf.write8(0xb8 + (dst & 7));
+        buf.write32(src);
     }
+    // The shortest mov that leaves the flags alone: the 32 bit form for
+    // a non-negative value, else the sign extending one
     void movRegImm32(Buffer &buf, Register dst, int32_t src)
     {
-        buf.write8(RexPrefix);
+        if (src >= 0)
+        {
+            movRegUImm32(buf, dst, static_cast<uint32_t>(src));
+            return;
+        }
+        buf.write8(rex(0, dst));
         buf.write8(0xc7);
-        buf.write8(0xc0 | dst);
+        buf.write8(modrm(3, dst, 0));
         buf.write32(src);
     }
-    void addRegImm32(Buffer &buf, Register dst, int32_t src)
+    void xorRegReg32(Buffer &buf, Register dst, Register src)
     {
-        buf.write8(RexPrefix);
-        if (dst == Emit::Rax)
+        if (src >= R8 || dst >= R8)
+        {
+            buf.write8(rex(src, dst) & ~RexW);
+        }
+        buf.write8(0x31);
+        buf.write8(modrm(3, dst, src));
+    }
+    // Any value in the fewest bytes. Zero is a xor, which clobbers the flags.
+    void movRegImm(Buffer &buf, Register dst, word src)
+    {
+        if (src == 0)
+        {
+            xorRegReg32(buf, dst, dst);
+        }
+        else if (static_cast<uword>(src) <= UINT32_MAX)
         {
-            buf.write8(5);
+            movRegUImm32(buf, dst, static_cast<uint32_t>(src));
+        }
+        else if (src >= INT32_MIN && src < 0)
+        {
+            movRegImm32(buf, dst, static_cast<int32_t>(src));
         }
         else
         {
-            buf.write8(0x81);
-            buf.write8(0xc0 | dst);
+            movRegImm64(buf, dst, static_cast<uint64_t>(src));
         }
-        buf.write32(src);
     }
-    void subRegImm32(Buffer &buf, Register dst, int32_t src)
+    // `opcode` dst, src for the group 1 opcodes (/0 add, /5 sub, /7 cmp),
+    // with an 8 bit immediate when it fits
+    static void group1RegImm(Buffer &buf, uint8_t opcode, Register dst, int32_t src)
     {
-        buf.write8(RexPrefix);
-        if (dst == Emit::Rax)
+        buf.write8(rex(0, dst));
+        if (fitsImm8(src))
+        {
+            buf.write8(0x83);
+            buf.write8(modrm(3, dst, opcode));
+            buf.write8(static_cast<uint8_t>(src));
+            return;
+        }
+        if (dst == Rax)
         {
-            buf.write8(0x2d);
+            buf.write8(static_cast<uint8_t>((opcode << 3) | 5));
         }
         else
         {
             buf.write8(0x81);
-            buf.write8(0xe8 | dst);
+            buf.write8(modrm(3, dst, opcode));
         }
         buf.write32(src);
     }
-    void mulRegIndirect(Buffer &buf, const Indirect &src)
+    void addRegImm32(Buffer &buf, Register dst, int32_t src)
+    {
+        group1RegImm(buf, 0, dst, src);
+    }
+    void subRegImm32(Buffer &buf, Register dst, int32_t src)
+    {
+        group1RegImm(buf, 5, dst, src);
+    }
+    // imul dst, [src] (two operands: leaves rdx alone)
+    void imulRegIndirect(Buffer &buf, Register dst, const Indirect &src)
+    {
+        buf.write8(rex(dst, src.reg));
+        buf.write8(0x0f);
+        buf.write8(0xaf);
+        addressDisp(buf, dst, src);
+    }
+    // rdx:rax = rax * src, signed
+    void imulReg(Buffer &buf, Register src)
+    {
+        buf.write8(rex(0, src));
+        buf.write8(0xf7);
+        buf.write8(modrm(3, src, 5));
+    }
+    // rax = rdx:rax / src, rdx = the remainder
+    void idivReg(Buffer &buf, Register src)
+    {
+        buf.write8(rex(0, src));
+        buf.write8(0xf7);
+        buf.write8(modrm(3, src, 7));
+    }
+    // Sign extends rax into rdx
+    void cqo(Buffer &buf)
     {
         buf.write8(RexPrefix);
+        buf.write8(0x99);
+    }
+    void negReg(Buffer &buf, Register dst)
+    {
+        buf.write8(rex(0, dst));
         buf.write8(0xf7);
-        addressDisp8(buf, static_cast<Register>(4), src);
+        buf.write8(modrm(3, dst, 3));
+    }
+    void testRegReg(Buffer &buf, Register left, Register right)
+    {
+        buf.write8(rex(right, left));
+        buf.write8(0x85);
+        buf.write8(modrm(3, left, right));
+    }
+    void xorRegReg(Buffer &buf, Register dst, Register src)
+    {
+        buf.write8(rex(src, dst));
+        buf.write8(0x31);
+        buf.write8(modrm(3, dst, src));
+    }
+    // imul dst, src, imm (imm8 when it fits)
+    void imulRegRegImm32(Buffer &buf, Register dst, Register src, int32_t imm)
+    {
+        buf.write8(rex(dst, src));
+        buf.write8(fitsImm8(imm) ? 0x6b : 0x69);
+        buf.write8(modrm(3, src, dst));
+        if (fitsImm8(imm))
+        {
+            buf.write8(static_cast<uint8_t>(imm));
+        }
+        else
+        {
+            buf.write32(imm);
+        }
     }
     void shlRegImm8(Buffer &buf, Register dst, uint8_t src)
     {
-        buf.write8(RexPrefix);
+        buf.write8(rex(0, dst));
         buf.write8(0xc1);
-        buf.write8(0xe0 | dst);
+        buf.write8(0xe0 | (dst & 7));
         buf.write8(src);
     }
     void shrRegImm8(Buffer &buf, Register dst, uint8_t src)
     {
-        buf.write8(RexPrefix);
+        buf.write8(rex(0, dst));
         buf.write8(0xc1); // todo: look up the opcode
-        buf.write8(0xe8 | dst);
+        buf.write8(0xe8 | (dst & 7));
+        buf.write8(src);
+    }
+    void sarRegImm8(Buffer &buf, Register dst, uint8_t src)
+    {
+        buf.write8(rex(0, dst));
+        buf.write8(0xc1);
+        buf.write8(0xf8 | (dst & 7));
         buf.write8(src);
     }
+    // movzx dst, src (32 bit, which clears the upper half)
+    void movzxRegByte(Buffer &buf, Register dst, PartialRegister src)
+    {
+        buf.write8(0x0f);
+        buf.write8(0xb6);
+        buf.write8(modrm(3, src, dst));
+    }
     void orRegImm8(Buffer &buf, Register dst, uint8_t src)
     {
         buf.write8(RexPrefix);
@@ -374,17 +942,7 @@ namespace Emit
     }
     void cmpRegImm32(Buffer &buf, Register left, int32_t right)
     {
-        buf.write8(RexPrefix);
-        if (left == Rax)
-        {
-            buf.write8(0x3d);
-        }
-        else
-        {
-            buf.write8(0x81);
-            buf.write8(0xf8 | left);
-        }
-        buf.write32(right);
+        group1RegImm(buf, 7, left, right);
     }
     void setccImm8(Buffer &buf, Condition cond, PartialRegister dst)
     {
@@ -399,33 +957,33 @@ namespace Emit
 
     void storeIndirectReg(Buffer &buf, const Indirect &dst, const Register src)
     {
-        buf.write8(RexPrefix);
+        buf.write8(rex(src, dst.reg));
         buf.write8(0x89);
-        addressDisp8(buf, src, dst);
+        addressDisp(buf, src, dst);
     }
     void loadRegIndirect(Buffer &buf, Register dst, const Indirect &src)
     {
-        buf.write8(RexPrefix);
+        buf.write8(rex(dst, src.reg));
         buf.write8(0x8b);
-        addressDisp8(buf, dst, src);
+        addressDisp(buf, dst, src);
     }
     void addRegIndirect(Buffer &buf, Register dst, const Indirect &src)
     {
         buf.write8(RexPrefix);
         buf.write8(0x3);
-        addressDisp8(buf, dst, src);
+        addressDisp(buf, dst, src);
     }
     void subRegIndirect(Buffer &buf, Register dst, const Indirect &src)
     {
         buf.write8(RexPrefix);
         buf.write8(0x2b);
-        addressDisp8(buf, dst, src);
+        addressDisp(buf, dst, src);
     }
     void cmpRegIndirect(Buffer &buf, Register left, const Indirect &right)
     {
         buf.write8(RexPrefix);
         buf.write8(0x3b);
-        addressDisp8(buf, left, right);
+        addressDisp(buf, left, right);
     }
     word jcc(Buffer &buf, Condition cond, int32_t offset)
     {
@@ -443,21 +1001,313 @@ namespace Emit
         return static_cast<word>(pos);
     }
 
-    void callImm32(Buffer &buf, word absoluteAddress)
+    void addIndirectImm8(Buffer &buf, const Indirect &dst, int8_t src)
+    {
+        buf.write8(RexPrefix);
+        buf.write8(0x83);
+        addressDisp(buf, static_cast<Register>(0), dst);
+        buf.write8(disp8(src));
+    }
+    void pushReg(Buffer &buf, Register src)
+    {
+        if (src >= R8)
+        {
+            buf.write8(0x41); // REX.B
+        }
+        buf.write8(0x50 + (src & 7));
+    }
+    void popReg(Buffer &buf, Register dst)
+    {
+        if (dst >= R8)
+        {
+            buf.write8(0x41); // REX.B
+        }
+        buf.write8(0x58 + (dst & 7));
+    }
+    void jmpReg(Buffer &buf, Register src)
+    {
+        buf.write8(0xff);
+        buf.write8(modrm(3, src, 4));
+    }
+    void cmpIndirectByteImm8(Buffer &buf, Register left, uint8_t right)
+    {
+        buf.write8(0x80);
+        buf.write8(modrm(0, left, 7));
+        buf.write8(right);
+    }
+    void callIndirectDisp8(Buffer &buf, Register src, int8_t disp)
+    {
+        buf.write8(0xff);
+        buf.write8(modrm(1, src, 2));
+        buf.write8(disp8(disp));
+    }
+    void callIndirect(Buffer &buf, Register src)
+    {
+        buf.write8(0xff);
+        buf.write8(modrm(0, src, 2));
+    }
+    void jmpIndirect(Buffer &buf, Register src)
+    {
+        buf.write8(0xff);
+        buf.write8(modrm(0, src, 4));
+    }
+    void callReg(Buffer &buf, Register src)
+    {
+        buf.write8(0xff);
+        buf.write8(modrm(3, src, 2));
+    }
+
+    // [base + index * scale + disp]; index Rsp means none
+    struct Indexed
+    {
+        Register base;
+        Register index;
+        Scale scale;
+        int32_t disp;
+    };
+    constexpr Register NoIndex = Rsp;
+
+    static void addressIndexed(Buffer &buf, uint8_t reg, const Indexed &mem)
+    {
+        assert(mem.base < R8 && mem.index < R8);
+        auto mod = dispMod(mem.base, mem.disp);
+        buf.write8(modrm(mod, IndexNone, reg)); // rm 100: a SIB byte follows
+        buf.write8(sib(mem.base, static_cast<Index>(mem.index), mem.scale));
+        writeDisp(buf, mod, mem.disp);
+    }
+
+    void loadRegIndexed(Buffer &buf, Register dst, const Indexed &src)
+    {
+        buf.write8(rex(dst, 0));
+        buf.write8(0x8b);
+        addressIndexed(buf, dst, src);
+    }
+    void storeIndexedReg(Buffer &buf, const Indexed &dst, Register src)
+    {
+        buf.write8(rex(src, 0));
+        buf.write8(0x89);
+        addressIndexed(buf, src, dst);
+    }
+    void leaRegIndexed(Buffer &buf, Register dst, const Indexed &src)
+    {
+        buf.write8(rex(dst, 0));
+        buf.write8(0x8d);
+        addressIndexed(buf, dst, src);
+    }
+    void addRegIndexed(Buffer &buf, Register dst, const Indexed &src)
+    {
+        buf.write8(rex(dst, 0));
+        buf.write8(0x03);
+        addressIndexed(buf, dst, src);
+    }
+    void imulRegIndexed(Buffer &buf, Register dst, const Indexed &src)
+    {
+        buf.write8(rex(dst, 0));
+        buf.write8(0x0f);
+        buf.write8(0xaf);
+        addressIndexed(buf, dst, src);
+    }
+    // movzx dst, byte [src] (32 bit, which clears the upper half)
+    void movzxRegIndexedByte(Buffer &buf, Register dst, const Indexed &src)
+    {
+        buf.write8(0x0f);
+        buf.write8(0xb6);
+        addressIndexed(buf, dst, src);
+    }
+    void addRegReg(Buffer &buf, Register dst, Register src)
+    {
+        buf.write8(rex(src, dst));
+        buf.write8(0x01);
+        buf.write8(modrm(3, dst, src));
+    }
+    void subRegReg(Buffer &buf, Register dst, Register src)
+    {
+        buf.write8(rex(src, dst));
+        buf.write8(0x29);
+        buf.write8(modrm(3, dst, src));
+    }
+    void cmpRegReg(Buffer &buf, Register left, Register right)
+    {
+        buf.write8(rex(right, left));
+        buf.write8(0x39);
+        buf.write8(modrm(3, left, right));
+    }
+
+    // For compressed pairs
+    void store32IndirectReg(Buffer &buf, const Indirect &dst, Register src)
+    {
+        if (src >= R8 || dst.reg >= R8)
+        {
+            buf.write8(rex(src, dst.reg) & ~RexW);
+        }
+        buf.write8(0x89);
+        addressDisp(buf, src, dst);
+    }
+    // movsxd dst, dword [src]
+    void movsxdRegIndirect(Buffer &buf, Register dst, const Indirect &src)
+    {
+        buf.write8(rex(dst, src.reg));
+        buf.write8(0x63);
+        addressDisp(buf, dst, src);
+    }
+    // mov dst32, src32, which clears the upper half of dst
+    void movRegReg32(Buffer &buf, Register dst, Register src)
+    {
+        if (src >= R8 || dst >= R8)
+        {
+            buf.write8(rex(src, dst) & ~RexW);
+        }
+        buf.write8(0x89);
+        buf.write8(modrm(3, dst, src));
+    }
+    void orRegReg(Buffer &buf, Register dst, Register src)
+    {
+        buf.write8(rex(src, dst));
+        buf.write8(0x09);
+        buf.write8(modrm(3, dst, src));
+    }
+    void testAlImm8(Buffer &buf, uint8_t src)
+    {
+        buf.write8(0xa8);
+        buf.write8(src);
+    }
+    void cmovRegReg(Buffer &buf, Condition cond, Register dst, Register src)
+    {
+        buf.write8(rex(dst, src));
+        buf.write8(0x0f);
+        buf.write8(0x40 | cond);
+        buf.write8(modrm(3, src, dst));
+    }
+
+    // AVX2. Only ymm0-ymm5 are used: the rest are nonvolatile in the Win64 ABI.
+    enum Ymm : uint8_t
+    {
+        Ymm0 = 0,
+        Ymm1,
+        Ymm2,
+        Ymm3,
+        Ymm4,
+    };
+    constexpr int32_t YmmSize = 32;
+
+    enum VexMap : uint8_t
+    {
+        Map0f = 1,
+        Map0f38 = 2,
+        Map0f3a = 3,
+    };
+    enum VexPrefix : uint8_t
+    {
+        Prefix66 = 1,
+        PrefixF3 = 2,
+    };
+
+    // The three byte VEX prefix, then the opcode. `src1` is the extra source
+    // register of the three operand forms; `wide` picks ymm over xmm.
+    static void vex(Buffer &buf, VexMap map, VexPrefix prefix, bool w, bool wide, uint8_t reg, uint8_t src1, uint8_t rm, uint8_t opcode)
+    {
+        buf.write8(0xc4);
+        // R, X and B are stored inverted, like src1
+        buf.write8(static_cast<uint8_t>((((~reg >> 3) & 1) << 7) | (1 << 6) | (((~rm >> 3) & 1) << 5) | map));
+        buf.write8(static_cast<uint8_t>((w << 7) | ((~src1 & 0xf) << 3) | (wide << 2) | prefix));
+        buf.write8(opcode);
+    }
+
+    void vpxor(Buffer &buf, Ymm dst, Ymm src1, Ymm src2)
+    {
+        vex(buf, Map0f, Prefix66, false, true, dst, src1, src2, 0xef);
+        buf.write8(modrm(3, src2, dst));
+    }
+    void vpaddq(Buffer &buf, Ymm dst, Ymm src1, Ymm src2, bool wide = true)
+    {
+        vex(buf, Map0f, Prefix66, false, wide, dst, src1, src2, 0xd4);
+        buf.write8(modrm(3, src2, dst));
+    }
+    void vpaddqIndexed(Buffer &buf, Ymm dst, Ymm src1, const Indexed &src2)
+    {
+        vex(buf, Map0f, Prefix66, false, true, dst, src1, 0, 0xd4);
+        addressIndexed(buf, dst, src2);
+    }
+    void vpmuludq(Buffer &buf, Ymm dst, Ymm src1, Ymm src2)
+    {
+        vex(buf, Map0f, Prefix66, false, true, dst, src1, src2, 0xf4);
+        buf.write8(modrm(3, src2, dst));
+    }
+    // vpsrlq and vpsllq by an immediate: 73 /2 and 73 /6, with dst in src1
+    void vpsrlqImm8(Buffer &buf, Ymm dst, Ymm src, uint8_t count)
+    {
+        vex(buf, Map0f, Prefix66, false, true, 2, dst, src, 0x73);
+        buf.write8(modrm(3, src, 2));
+        buf.write8(count);
+    }
+    void vpsllqImm8(Buffer &buf, Ymm dst, Ymm src, uint8_t count)
+    {
+        vex(buf, Map0f, Prefix66, false, true, 6, dst, src, 0x73);
+        buf.write8(modrm(3, src, 6));
+        buf.write8(count);
+    }
+    void vmovdquLoad(Buffer &buf, Ymm dst, const Indexed &src)
+    {
+        vex(buf, Map0f, PrefixF3, false, true, dst, 0, 0, 0x6f);
+        addressIndexed(buf, dst, src);
+    }
+    void vmovdquStore(Buffer &buf, const Indexed &dst, Ymm src)
+    {
+        vex(buf, Map0f, PrefixF3, false, true, src, 0, 0, 0x7f);
+        addressIndexed(buf, src, dst);
+    }
+    void vpbroadcastq(Buffer &buf, Ymm dst, const Indexed &src)
+    {
+        vex(buf, Map0f38, Prefix66, false, true, dst, 0, 0, 0x59);
+        addressIndexed(buf, dst, src);
+    }
+    // xmm dst = the upper half of ymm src
+    void vextracti128High(Buffer &buf, Ymm dst, Ymm src)
+    {
+        vex(buf, Map0f3a, Prefix66, false, true, src, 0, dst, 0x39);
+        buf.write8(modrm(3, dst, src));
+        buf.write8(1);
+    }
+    void vpshufd(Buffer &buf, Ymm dst, Ymm src, uint8_t order, bool wide = true)
+    {
+        vex(buf, Map0f, Prefix66, false, wide, dst, 0, src, 0x70);
+        buf.write8(modrm(3, src, dst));
+        buf.write8(order);
+    }
+    // The low quadword of xmm src
+    void vmovqRegYmm(Buffer &buf, Register dst, Ymm src)
+    {
+        vex(buf, Map0f, Prefix66, true, false, src, 0, dst, 0x7e);
+        buf.write8(modrm(3, dst, src));
+    }
+    // Clears the upper halves, so the SSE code that may follow does not pay for them
+    void vzeroupper(Buffer &buf)
+    {
+        buf.write8(0xc5);
+        buf.write8(0xf8);
+        buf.write8(0x77);
+    }
+
+    word call(Buffer &buf, int32_t offset)
     {
-        // 5 is length of call instruction
-        auto relativeAddress = absoluteAddress - (buf.size() + 5);
         buf.write8(0xe8);
-        buf.write32(static_cast<uint32_t>(relativeAddress));
+        auto pos = buf.size();
+        buf.write32(disp32(offset));
+        return static_cast<word>(pos);
     }
 
-    void backpatchImm32(Buffer &buf, size_t targetPos)
+    // Points the rel32 at targetPos to destPos
+    void patchImm32(Buffer &buf, size_t targetPos, size_t destPos)
     {
-        auto currentPos = buf.size();
-        auto relativePos = static_cast<int32_t>(currentPos - targetPos - sizeof(int32_t));
+        auto relativePos = static_cast<int32_t>(destPos - targetPos - sizeof(int32_t));
         buf.writeAt32(targetPos, disp32(relativePos));
     }
 
+    void backpatchImm32(Buffer &buf, size_t targetPos)
+    {
+        patchImm32(buf, targetPos, buf.size());
+    }
+
     void rspAdjust(Buffer &buf, word adjust)
     {
         if (adjust < 0)
@@ -492,6 +1342,7 @@ namespace Compile
     {
         using namespace Emit;
         cmpRegImm32(buf, Rax, value);
+        // Not a xor: setcc still needs the flags
         movRegImm32(buf, Rax, 0);
         setccImm8(buf, Equal, Al);
         shlRegImm8(buf, Rax, Objects::BoolShift);
@@ -511,317 +1362,1746 @@ namespace Compile
         return list->asPair()->cdr->asPair()->cdr->asPair()->car;
     }
 
-    int let(Buffer &buf, ASTNode *bindings, ASTNode *body, word stackIndex, const Env *bindingEnv, const Env *bodyEnv, const Env *labels)
+    constexpr int32_t LabelPlaceholder = 0xdeadbeef;
+    // Hot label entries start on a boundary of this many bytes, padded with int3
+    constexpr size_t LabelAlignment = 16;
+    constexpr uint8_t Int3 = 0xcc;
+
+    constexpr Emit::Register HeapPointer = Emit::Rsi;
+
+    constexpr Emit::Register SafepointPointer = Emit::Rdi;
+    // With Options::compressed: the start of the heap's region. r15 is
+    // nonvolatile, so the entry function keeps the caller's in its first slot.
+    constexpr Emit::Register CompressedBase = Emit::R15;
+    constexpr Emit::Indirect SavedCompressedBase{Emit::Rsp, -WordSize};
+    // See RegisterArgs
+    constexpr Emit::Register ArgRegisters[RegisterArgs] = {Emit::R8, Emit::R9, Emit::R10, Emit::R11};
+    // Win64 lets a callee use 32 bytes above its return address
+    constexpr int32_t ShadowSpace = 32;
+
+    // cmp byte [rdi], 0; je over; call the stub with the live stack slots
+    // below rsp stepped over; over:
+    static void safepointPoll(Buffer &buf, int32_t liveBytes)
     {
-        if (bindings->isNil())
+        if (!buf._options.safepoints)
         {
-            // Base case: no bindings. Compile the body
-            _(expr(buf, body, stackIndex, bodyEnv, labels));
-            return 0;
+            return;
         }
-        else
+        static_assert(offsetof(SafepointControl, yieldRequested) == 0, "the poll reads the flag at [rdi]");
+        Emit::cmpIndirectByteImm8(buf, SafepointPointer, 0);
+        buf.write8(0x74); // je rel8
+        auto overPos = buf.size();
+        buf.write8(0);
+        Emit::rspAdjust(buf, -liveBytes);
+        if (liveBytes)
         {
-            assert(bindings->isPair());
-            // Get the next binding
-            auto pair = bindings->asPair();
-            assert(pair->car->isPair());
-            auto binding = pair->car->asPair();
-            auto name = binding->car;
-            assert(name->isSymbol());
-            auto bindingExpr = binding->cdr->asPair()->car;
-            // Compile the binding expression
-            _(expr(buf, bindingExpr, stackIndex, bindingEnv, labels));
-            Emit::storeIndirectReg(buf, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)}, Emit::Rax);
-            // Bind the name
-            Env entry{name->asSymbol()->str, stackIndex, bodyEnv};
-            // process the rest of bindings recursively
-            _(let(buf, pair->cdr, body, stackIndex - WordSize, bindingEnv, &entry, labels));
-            return 0;
+            buf._frameChanges.push_back({buf.size(), static_cast<int32_t>(WordSize + liveBytes)});
         }
+        Emit::callIndirectDisp8(buf, SafepointPointer, static_cast<int8_t>(offsetof(SafepointControl, stub)));
+        Emit::rspAdjust(buf, liveBytes);
+        if (liveBytes)
+        {
+            buf._frameChanges.push_back({buf.size(), static_cast<int32_t>(WordSize)});
+        }
+        buf._buf[overPos] = static_cast<uint8_t>(buf.size() - overPos - 1);
     }
 
-    constexpr int32_t LabelPlaceholder = 0xdeadbeef;
-    int if_(Buffer &buf, ASTNode *condition, ASTNode *onThen, ASTNode *onElse, word stackIndex, const Env *varEnv, const Env *labels)
-    {
-        _(expr(buf, condition, stackIndex, varEnv, labels));
-        Emit::cmpRegImm32(buf, Emit::Rax, static_cast<int32_t>(Objects::encodeBool(false)));
-        auto onElsePos = Emit::jcc(buf, Emit::Equal, LabelPlaceholder);
-        _(expr(buf, onThen, stackIndex, varEnv, labels));
-        auto endPos = Emit::jmp(buf, LabelPlaceholder);
-        Emit::backpatchImm32(buf, onElsePos);
-        _(expr(buf, onElse, stackIndex, varEnv, labels));
-        Emit::backpatchImm32(buf, endPos);
-        return 0;
+    // The entry function's prologue and epilogue. With safepoints, rdi holds
+    // the SafepointControl, whose savedRdi keeps the caller's value.
+    static void mainPrologue(Buffer &buf)
+    {
+        if (buf._options.safepoints)
+        {
+            Emit::storeIndirectReg(buf, Emit::Indirect{Emit::Rdx, static_cast<int8_t>(offsetof(SafepointControl, savedRdi))}, Emit::Rdi);
+            Emit::movRegReg(buf, SafepointPointer, Emit::Rdx);
+        }
+        buf.writeArray(FunctionPrologue, sizeof(FunctionPrologue));
+        if (buf._options.compressed)
+        {
+            Emit::storeIndirectReg(buf, SavedCompressedBase, CompressedBase);
+            Emit::movRegReg(buf, CompressedBase, HeapPointer);
+            Emit::shrRegImm8(buf, CompressedBase, Objects::CompressedRegionBits);
+            Emit::shlRegImm8(buf, CompressedBase, Objects::CompressedRegionBits);
+        }
+    }
+    static void mainEpilogue(Buffer &buf)
+    {
+        if (buf._options.safepoints)
+        {
+            Emit::loadRegIndirect(buf, Emit::Rdi, Emit::Indirect{SafepointPointer, static_cast<int8_t>(offsetof(SafepointControl, savedRdi))});
+        }
+        if (buf._options.compressed)
+        {
+            Emit::loadRegIndirect(buf, CompressedBase, SavedCompressedBase);
+        }
+        buf.writeArray(FunctionEpilogue, sizeof(FunctionEpilogue));
+    }
+    // Where the entry function's locals start
+    static word mainStackIndex(const Buffer &buf)
+    {
+        return buf._options.compressed ? SavedCompressedBase.disp - WordSize : -WordSize;
     }
 
-    constexpr Emit::Register HeapPointer = Emit::Rsi;
+    const Code &safepointStub()
+    {
+        static const Code stub = [] {
+            using namespace Emit;
+            Buffer buf;
+            buf._labels.push_back({"safepoint", 0});
+            movRegReg(buf, Rax, Rsp);
+            andRegImm8(buf, Rsp, 0xf0);
+            pushReg(buf, Rax);
+            // The poll may come after a call's register arguments are loaded
+            for (auto reg : ArgRegisters)
+            {
+                pushReg(buf, reg);
+            }
+            subRegImm32(buf, Rsp, ShadowSpace + WordSize);
+            movRegReg(buf, Rcx, SafepointPointer);
+            callIndirectDisp8(buf, SafepointPointer, static_cast<int8_t>(offsetof(SafepointControl, handler)));
+            addRegImm32(buf, Rsp, ShadowSpace + WordSize);
+            for (auto reg = std::rbegin(ArgRegisters); reg != std::rend(ArgRegisters); ++reg)
+            {
+                popReg(buf, *reg);
+            }
+            popReg(buf, Rsp);
+            ret(buf);
+            return buf.freeze();
+        }();
+        return stub;
+    }
 
-    int cons(Buffer &buf, ASTNode *car, ASTNode *cdr, word stackIndex, const Env *varEnv, const Env *labels)
-    {
-        // Compile and store car on the stack
-        _(expr(buf, car, stackIndex, varEnv, labels));
-        Emit::storeIndirectReg(buf, Emit::Indirect{HeapPointer, static_cast<int8_t>(Objects::CarOffset)}, Emit::Rax);
-        // Compile and store cdr
-        _(expr(buf, cdr, stackIndex - WordSize, varEnv, labels));
-        Emit::storeIndirectReg(buf, Emit::Indirect{HeapPointer, Objects::CdrOffset}, Emit::Rax);
-        // Store tagged pointer in rax
-        Emit::movRegReg(buf, Emit::Rax, HeapPointer);
-        Emit::orRegImm8(buf, Emit::Rax, Objects::PairTag);
-        // bump the heap pointer
-        Emit::addRegImm32(buf, HeapPointer, Objects::PairSize);
-        return 0;
+    // Untags ArgRegisters, moves them to the Win64 argument registers and
+    // calls `function` on a 16 byte aligned stack with shadow space. rsi and
+    // rdi are nonvolatile in the Win64 ABI, so the heap pointer and the
+    // SafepointControl survive the call.
+    void foreignStub(Buffer &buf, const void *function, ForeignType result, const std::vector<ForeignType> &args)
+    {
+        using namespace Emit;
+        assert(args.size() <= RegisterArgs);
+        static const Register Win64Args[RegisterArgs] = {Rcx, Rdx, R8, R9};
+        for (size_t i = 0; i < args.size(); ++i)
+        {
+            switch (args[i])
+            {
+            case ForeignType::Integer:
+                sarRegImm8(buf, ArgRegisters[i], Objects::IntegerShift);
+                break;
+            case ForeignType::Char:
+                shrRegImm8(buf, ArgRegisters[i], Objects::CharShift);
+                break;
+            case ForeignType::Bool:
+                shrRegImm8(buf, ArgRegisters[i], Objects::BoolShift);
+                break;
+            case ForeignType::Object:
+            case ForeignType::Void:
+                break;
+            }
+        }
+        movRegReg(buf, Rax, Rsp);
+        andRegImm8(buf, Rsp, 0xf0);
+        pushReg(buf, Rax);
+        subRegImm32(buf, Rsp, ShadowSpace + WordSize);
+        // In order, so r8 and r9 are read before they are overwritten
+        for (size_t i = 0; i < args.size(); ++i)
+        {
+            movRegReg(buf, Win64Args[i], ArgRegisters[i]);
+        }
+        movRegImm64(buf, Rax, reinterpret_cast<uint64_t>(function));
+        callReg(buf, Rax);
+        addRegImm32(buf, Rsp, ShadowSpace + WordSize);
+        popReg(buf, Rsp);
+        switch (result)
+        {
+        case ForeignType::Void:
+            movRegImm(buf, Rax, static_cast<word>(Objects::nil()));
+            break;
+        case ForeignType::Integer:
+            shlRegImm8(buf, Rax, Objects::IntegerShift);
+            break;
+        case ForeignType::Char:
+            movzxRegByte(buf, Rax, Al);
+            shlRegImm8(buf, Rax, Objects::CharShift);
+            orRegImm8(buf, Rax, static_cast<uint8_t>(Objects::CharTag));
+            break;
+        case ForeignType::Bool:
+            movzxRegByte(buf, Rax, Al);
+            shlRegImm8(buf, Rax, Objects::BoolShift);
+            orRegImm8(buf, Rax, Objects::BoolTag);
+            break;
+        case ForeignType::Object:
+            break;
+        }
+        ret(buf);
+    }
+
+    // The string primitives that call Strings routines
+    static bool isRuntimeCall(std::string_view name)
+    {
+        return name == "string=?" || name == "string-index";
+    }
+
+    static const Foreign &runtime()
+    {
+        static Foreign table;
+        static const bool added = table.add("string=?", &Strings::equal) == 0 &&
+                                  table.add("string-index", &Strings::index) == 0;
+        assert(added);
+        (void)added;
+        return table;
+    }
+
+    // Whether compiling `node` emits a call, which clobbers ArgRegisters
+    static bool hasCall(ASTNode *node)
+    {
+        static thread_local std::vector<ASTNode *> pending;
+        pending.clear();
+        pending.push_back(node);
+        while (!pending.empty())
+        {
+            node = pending.back();
+            pending.pop_back();
+            if (!node->isPair())
+            {
+                continue;
+            }
+            auto pair = node->asPair();
+            if (pair->car->isSymbol() && (pair->car->asSymbol()->str == "labelcall" || pair->car->asSymbol()->str == "foreign-call" ||
+                                          isRuntimeCall(pair->car->asSymbol()->str)))
+            {
+                return true;
+            }
+            pending.push_back(pair->cdr);
+            pending.push_back(pair->car);
+        }
+        return false;
+    }
+
+    // The register formals of a `code` body that must be spilled on entry:
+    // bit i is set when ArgRegisters[i] may have been overwritten, by a call
+    // or by a labelcall's argument moves, before `formals`' i-th is read.
+    static uint8_t clobberedFormals(ASTNode *formals, ASTNode *body)
+    {
+        if (!hasCall(body))
+        {
+            return 0;
+        }
+        constexpr uint8_t All = (1 << RegisterArgs) - 1;
+        // Whether each pair of the body makes a call, children before parents
+        std::unordered_map<ASTNode *, bool> calls;
+        std::vector<ASTNode *> order{body};
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            if (order[i]->isPair())
+            {
+                order.push_back(order[i]->asPair()->car);
+                order.push_back(order[i]->asPair()->cdr);
+            }
+        }
+        for (auto node = order.rbegin(); node != order.rend(); ++node)
+        {
+            if ((*node)->isPair())
+            {
+                auto pair = (*node)->asPair();
+                auto head = pair->car->isSymbol() ? std::string_view{pair->car->asSymbol()->str} : std::string_view{};
+                calls[*node] = head == "labelcall" || head == "foreign-call" || isRuntimeCall(head) ||
+                               calls[pair->car] || calls[pair->cdr];
+            }
+        }
+        auto called = [&](ASTNode *node) { return node->isPair() && calls[node]; };
+
+        // A formal's value is its index; names bound by let are -1
+        std::deque<Env> scopes;
+        const Env *formalScope = nullptr;
+        word index = 0;
+        for (auto formal = formals; formal->isPair(); formal = formal->asPair()->cdr, ++index)
+        {
+            formalScope = &scopes.emplace_back(Env{formal->asPair()->car->asSymbol()->str, index, formalScope});
+        }
+        struct Use
+        {
+            ASTNode *node;
+            const Env *scope;
+            // The registers that may be overwritten by the time `node` runs
+            uint8_t clobbered;
+        };
+        uint8_t result = 0;
+        std::vector<Use> pending{{body, formalScope, 0}};
+        while (!pending.empty())
+        {
+            auto [node, scope, clobbered] = pending.back();
+            pending.pop_back();
+            if (clobbered == 0 && !called(node))
+            {
+                continue;
+            }
+            if (node->isSymbol())
+            {
+                auto env = scope ? scope->lookup(node->asSymbol()->str) : nullptr;
+                if (env && env->value >= 0 && env->value < static_cast<word>(RegisterArgs))
+                {
+                    result |= clobbered & (1 << env->value);
+                }
+                continue;
+            }
+            if (!node->isPair())
+            {
+                continue;
+            }
+            auto head = node->asPair()->car;
+            auto args = node->asPair()->cdr;
+            auto name = head->isSymbol() ? std::string_view{head->asSymbol()->str} : std::string_view{};
+            if (name == "let")
+            {
+                // Bindings run in order in the outer scope, then the body
+                auto inner = scope;
+                for (auto binding = operand1(args); binding->isPair(); binding = binding->asPair()->cdr)
+                {
+                    auto value = operand2(binding->asPair()->car);
+                    pending.push_back({value, scope, clobbered});
+                    clobbered |= called(value) ? All : 0;
+                    inner = &scopes.emplace_back(Env{binding->asPair()->car->asPair()->car->asSymbol()->str, -1, inner});
+                }
+                pending.push_back({operand2(args), inner, clobbered});
+            }
+            else if (name == "if")
+            {
+                auto test = operand1(args);
+                pending.push_back({test, scope, clobbered});
+                clobbered |= called(test) ? All : 0;
+                pending.push_back({operand2(args), scope, clobbered});
+                pending.push_back({operand3(args), scope, clobbered});
+            }
+            else if (name == "labelcall" || name == "foreign-call" || isRuntimeCall(name))
+            {
+                // Arguments run left to right and each may be moved to its
+                // register before the next one runs
+                auto position = 0;
+                for (auto arg = isRuntimeCall(name) ? args : args->asPair()->cdr; arg->isPair(); arg = arg->asPair()->cdr, ++position)
+                {
+                    pending.push_back({arg->asPair()->car, scope, clobbered});
+                    clobbered |= called(arg->asPair()->car) ? All : 0;
+                    clobbered |= position < static_cast<int>(RegisterArgs) ? 1 << position : 0;
+                }
+            }
+            else
+            {
+                // Any other order: an operand may run after any call among the others
+                if (name == "vector-map")
+                {
+                    args = args->asPair()->cdr;
+                }
+                auto calling = 0;
+                for (auto arg = args; arg->isPair(); arg = arg->asPair()->cdr)
+                {
+                    calling += called(arg->asPair()->car);
+                }
+                for (auto arg = args; arg->isPair(); arg = arg->asPair()->cdr)
+                {
+                    auto others = calling - called(arg->asPair()->car) > 0;
+                    pending.push_back({arg->asPair()->car, scope, static_cast<uint8_t>(clobbered | (others ? All : 0))});
+                }
+            }
+        }
+        return result;
+    }
+
+    // The multiplier and shift that divide by `divisor` > 1 with a multiply,
+    // exact for every 64 bit dividend (Hacker's Delight, chapter 10)
+    static std::pair<word, int> divisionMagic(uword divisor)
+    {
+        constexpr uword Two63 = uword{1} << 63;
+        auto limit = Two63 - 1 - Two63 % divisor;
+        auto p = 63;
+        auto q1 = Two63 / limit, r1 = Two63 - q1 * limit;
+        auto q2 = Two63 / divisor, r2 = Two63 - q2 * divisor;
+        uword delta;
+        do
+        {
+            ++p;
+            q1 *= 2;
+            r1 *= 2;
+            if (r1 >= limit)
+            {
+                ++q1;
+                r1 -= limit;
+            }
+            q2 *= 2;
+            r2 *= 2;
+            if (r2 >= divisor)
+            {
+                ++q2;
+                r2 -= divisor;
+            }
+            delta = divisor - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+        return {static_cast<word>(q2 + 1), p - BitsPerWord};
+    }
+
+    // The tag `node` is known to have. Only what holds bit for bit is
+    // claimed, for ill-typed programs too, so code that relies on it still
+    // matches the interpreter. Gives up below `depth` levels.
+    static ValueKind kindOf(ASTNode *node, const Env *varEnv, int depth = 8)
+    {
+        if (node->isInteger())
+        {
+            return ValueKind::Integer;
+        }
+        if (node->isChar())
+        {
+            return ValueKind::Char;
+        }
+        if (node->isBool())
+        {
+            return ValueKind::Bool;
+        }
+        if (node->isSymbol())
+        {
+            auto entry = varEnv ? varEnv->lookup(node->asSymbol()->str) : nullptr;
+            return entry ? entry->kind : ValueKind::Unknown;
+        }
+        if (!node->isPair() || !node->asPair()->car->isSymbol() || depth == 0)
+        {
+            return ValueKind::Unknown;
+        }
+        auto &name = node->asPair()->car->asSymbol()->str;
+        auto args = node->asPair()->cdr;
+        auto kind = [&](ASTNode *operand) { return kindOf(operand, varEnv, depth - 1); };
+        static const std::string_view predicates[] = {"=", "<", "nil?", "zero?", "not", "integer?", "boolean?", "string=?"};
+        if (std::find(std::begin(predicates), std::end(predicates), name) != std::end(predicates))
+        {
+            return ValueKind::Bool;
+        }
+        if (name == "string-ref")
+        {
+            return ValueKind::Char;
+        }
+        if (name == "string-index")
+        {
+            return ValueKind::Integer;
+        }
+        // Only a zero divisor gives something other than an integer
+        if (name == "quotient" || name == "remainder" || name == "modulo")
+        {
+            auto divisor = operand2(args);
+            return divisor->isInteger() && divisor->getInteger() != 0 ? ValueKind::Integer : ValueKind::Unknown;
+        }
+        // Adding and subtracting keep the low bits of integers clear, and a
+        // product keeps those of its first operand
+        if (name == "+" || name == "-")
+        {
+            auto integers = kind(operand1(args)) == ValueKind::Integer && kind(operand2(args)) == ValueKind::Integer;
+            return integers ? ValueKind::Integer : ValueKind::Unknown;
+        }
+        if (name == "*" || name == "add1" || name == "sub1")
+        {
+            return kind(operand1(args)) == ValueKind::Integer ? ValueKind::Integer : ValueKind::Unknown;
+        }
+        if (name == "integer->char")
+        {
+            return kind(operand1(args)) == ValueKind::Integer ? ValueKind::Char : ValueKind::Unknown;
+        }
+        if (name == "char->integer")
+        {
+            return kind(operand1(args)) == ValueKind::Char ? ValueKind::Integer : ValueKind::Unknown;
+        }
+        if (name == "if")
+        {
+            auto consequent = kind(operand2(args));
+            return consequent == kind(operand3(args)) ? consequent : ValueKind::Unknown;
+        }
+        if (name == "let")
+        {
+            // Reserved up front: entries point at each other
+            size_t count = 0;
+            for (auto binding = operand1(args); binding->isPair(); binding = binding->asPair()->cdr)
+            {
+                ++count;
+            }
+            std::vector<Env> entries;
+            entries.reserve(count);
+            auto bodyEnv = varEnv;
+            for (auto binding = operand1(args); binding->isPair(); binding = binding->asPair()->cdr)
+            {
+                auto pair = binding->asPair()->car->asPair();
+                entries.push_back(Env{pair->car->asSymbol()->str, 0, bodyEnv});
+                entries.back().kind = kind(pair->cdr->asPair()->car);
+                bodyEnv = &entries.back();
+            }
+            return kindOf(operand2(args), bodyEnv, depth - 1);
+        }
+        return ValueKind::Unknown;
     }
 
-    int labelcall(Buffer &buf, ASTNode *callable, ASTNode *args, word stackIndex, const Env *varEnv, const Env *labels, word rspAdjust)
+    // The expression compiler keeps its own stack of work instead of
+    // recursing once per subexpression, so that machine-generated
+    // expressions of any depth compile. Compiling a form pushes a step that
+    // compiles each operand into rax, each followed by the step that emits
+    // the code using it, in reverse order.
+    struct Worklist
     {
-        if (args->isNil())
+        enum class Step
+        {
+            Expr,
+            // Ends the NodeRange at index count
+            ExprEnd,
+            // Primitives of one operand, which is in rax
+            Add1,
+            Sub1,
+            IntegerToChar,
+            CharToInteger,
+            IsNil,
+            IsZero,
+            Not,
+            IsInteger,
+            IsBoolean,
+            Car,
+            Cdr,
+            StringLength,
+            VectorLength,
+            VectorSum,
+            // Saves rax at stackIndex while the next operand is compiled
+            Spill,
+            SpillUntagged,
+            // Moves rax to ArgRegisters[count]
+            ArgRegister,
+            // Primitives of two operands: the first is in rax, the second at stackIndex
+            Plus,
+            Minus,
+            Times,
+            // rax times the integer literal in node
+            TimesLiteral,
+            Quotient,
+            Remainder,
+            Modulo,
+            // The dividend is in rax and node is the operands, the second a literal
+            QuotientLiteral,
+            RemainderLiteral,
+            ModuloLiteral,
+            Equal,
+            Less,
+            // Jumps to the else branch, or with a nonzero count to the then
+            // branch, which is then laid out second
+            IfTest,
+            // Jumps to the else branch unless the comparison in node holds,
+            // without making a boolean: its operands are where Less or IsZero
+            // would find them. Negated like IfTest.
+            IfCompare,
+            IfElse,
+            IfEnd,
+            // Ends the arm laid out first of an `if` whose other arm, node,
+            // goes past the function's ret
+            IfCold,
+            // Adds one to counter
+            Count,
+            LetBind,
+            ConsCar,
+            ConsCdr,
+            ConsSpilled,
+            StringRef,
+            MakeVector,
+            VectorRef,
+            VectorFill,
+            // The vector in rax, the index at stackIndex - 8 and the value at stackIndex
+            VectorSet,
+            // The first vector in rax, the second at stackIndex; node is the operator
+            VectorMap,
+            Labelcall,
+            ForeignCall,
+            // A routine of the runtime() table
+            RuntimeCall,
+        };
+
+        struct Task
+        {
+            Step step;
+            // The expression; the bindings left for LetBind; the label for
+            // Labelcall; the operator for VectorMap
+            ASTNode *node;
+            word stackIndex;
+            const Env *varEnv;
+            // LetBind: the body and the environment it sees so far
+            ASTNode *body;
+            const Env *bodyEnv;
+            // Labelcall: see labelcall()
+            word rspAdjust;
+            // ArgRegister: the argument; Labelcall: the register arguments that were spilled;
+            // IfTest and IfCompare: whether the test is negated
+            int count;
+            uint64_t *counter;
+        };
+
+        // An arm of an `if` compiled after the rest of the function: the
+        // test jumps to it at `jump`, and it jumps back to `end`
+        struct ColdArm
+        {
+            ASTNode *node;
+            word stackIndex;
+            const Env *varEnv;
+            size_t jump;
+            size_t end;
+        };
+
+        // Kept per thread, so that compiling many small bodies does not allocate each time
+        struct Storage
+        {
+            std::vector<Task> tasks;
+            // Jumps of the enclosing ifs still waiting for their target
+            std::vector<size_t> jumps;
+            // Stable storage for formals and let bindings
+            std::deque<Env> envs;
+            std::vector<ColdArm> cold;
+            // The operands of each `if` of a program compiled with a usable
+            // profile, numbered like Profile::branches
+            std::unordered_map<const ASTNode *, size_t> branches;
+        };
+
+        static Storage &storage()
+        {
+            static thread_local Storage storage;
+            return storage;
+        }
+
+        void push(Step step, ASTNode *node, word stackIndex, const Env *varEnv)
         {
-            auto codeAddress = labels->find(callable->asSymbol()->str);
-            if (!codeAddress)
+            tasks.push_back({step, node, stackIndex, varEnv, nullptr, nullptr, 0, 0, nullptr});
+        }
+
+        void unary(Step step, ASTNode *operand, word stackIndex, const Env *varEnv)
+        {
+            push(step, nullptr, stackIndex, varEnv);
+            push(Step::Expr, operand, stackIndex, varEnv);
+        }
+
+        // The second operand is compiled first and spilled
+        void binary(Step step, ASTNode *args, word stackIndex, const Env *varEnv)
+        {
+            push(step, nullptr, stackIndex, varEnv);
+            push(Step::Expr, operand1(args), stackIndex - WordSize, varEnv);
+            push(step == Step::Times ? Step::SpillUntagged : Step::Spill, nullptr, stackIndex, varEnv);
+            push(Step::Expr, operand2(args), stackIndex, varEnv);
+        }
+
+        // Shortcuts for operands of a known kind (see kindOf). Returns false
+        // if `name` is compiled the usual way.
+        bool typed(const std::string &name, ASTNode *args, word stackIndex, const Env *varEnv)
+        {
+            if (name == "*")
+            {
+                // A literal factor needs no untagging: x * k is the tagged
+                // product for any x when k >= 0, and for integers otherwise
+                auto literal = [&](ASTNode *factor, ASTNode *other, bool anySign) {
+                    if (!factor->isInteger() || factor->getInteger() < INT32_MIN || factor->getInteger() > INT32_MAX ||
+                        (!(anySign && factor->getInteger() >= 0) && kindOf(other, varEnv) != ValueKind::Integer))
+                    {
+                        return false;
+                    }
+                    push(Step::TimesLiteral, factor, stackIndex, varEnv);
+                    push(Step::Expr, other, stackIndex, varEnv);
+                    return true;
+                };
+                return literal(operand2(args), operand1(args), true) || literal(operand1(args), operand2(args), false);
+            }
+            if (name == "quotient" || name == "remainder" || name == "modulo")
+            {
+                // Zero is left to the generic code, which returns an error
+                auto divisor = operand2(args);
+                if (!divisor->isInteger() || divisor->getInteger() == 0 || divisor->getInteger() < INT32_MIN ||
+                    divisor->getInteger() > INT32_MAX)
+                {
+                    return false;
+                }
+                auto step = name == "quotient" ? Step::QuotientLiteral : name == "remainder" ? Step::RemainderLiteral : Step::ModuloLiteral;
+                push(step, args, stackIndex, varEnv);
+                push(Step::Expr, operand1(args), stackIndex, varEnv);
+                return true;
+            }
+            if (name == "integer->char")
+            {
+                // The round trip through an integer gives back the same char
+                auto operand = operand1(args);
+                if (operand->isPair() && operand->asPair()->car->isSymbol() && operand->asPair()->car->asSymbol()->str == "char->integer" &&
+                    kindOf(operand1(operand->asPair()->cdr), varEnv) == ValueKind::Char)
+                {
+                    push(Step::Expr, operand1(operand->asPair()->cdr), stackIndex, varEnv);
+                    return true;
+                }
+                return false;
+            }
+            if (name == "integer?" || name == "boolean?")
+            {
+                auto kind = kindOf(operand1(args), varEnv);
+                if (kind == ValueKind::Unknown)
+                {
+                    return false;
+                }
+                // Still evaluated, for its calls
+                push(Step::Expr, ASTNode::newBool(kind == (name == "integer?" ? ValueKind::Integer : ValueKind::Bool)), stackIndex, varEnv);
+                push(Step::Expr, operand1(args), stackIndex, varEnv);
+                return true;
+            }
+            return false;
+        }
+
+        // An `if` on a comparison branches on the flags. `negate` jumps when the test holds.
+        void ifTest(ASTNode *test, word stackIndex, const Env *varEnv, bool negate)
+        {
+            auto name = test->isPair() && test->asPair()->car->isSymbol() ? std::string_view{test->asPair()->car->asSymbol()->str} : std::string_view{};
+            auto args = name.empty() ? nullptr : test->asPair()->cdr;
+            auto branch = tasks.size();
+            if (name == "<" || name == "=")
+            {
+                push(Step::IfCompare, test, stackIndex, varEnv);
+                push(Step::Expr, operand1(args), stackIndex - WordSize, varEnv);
+                push(Step::Spill, nullptr, stackIndex, varEnv);
+                push(Step::Expr, operand2(args), stackIndex, varEnv);
+            }
+            else if (name == "zero?" || name == "nil?" || name == "not")
+            {
+                push(Step::IfCompare, test, stackIndex, varEnv);
+                push(Step::Expr, operand1(args), stackIndex, varEnv);
+            }
+            else
+            {
+                push(Step::IfTest, nullptr, stackIndex, varEnv);
+                push(Step::Expr, test, stackIndex, varEnv);
+            }
+            tasks[branch].count = negate;
+        }
+
+        void count(uint64_t *counter, word stackIndex)
+        {
+            push(Step::Count, nullptr, stackIndex, nullptr);
+            tasks.back().counter = counter;
+        }
+
+        // Lays out `(if test then else)`: in source order, or as the profile says
+        void ifElse(ASTNode *args, word stackIndex, const Env *varEnv)
+        {
+            auto test = operand1(args), then = operand2(args), otherwise = operand3(args);
+            auto profile = buf._options.profile;
+            auto &branches = storage().branches;
+            auto found = profile ? branches.find(args) : branches.end();
+            if (found == branches.end())
+            {
+                push(Step::IfEnd, nullptr, stackIndex, varEnv);
+                push(Step::Expr, otherwise, stackIndex, varEnv);
+                push(Step::IfElse, nullptr, stackIndex, varEnv);
+                push(Step::Expr, then, stackIndex, varEnv);
+                ifTest(test, stackIndex, varEnv, false);
+                return;
+            }
+            auto &branch = profile->branches[found->second];
+            if (buf._options.instrument)
+            {
+                push(Step::IfEnd, nullptr, stackIndex, varEnv);
+                push(Step::Expr, otherwise, stackIndex, varEnv);
+                count(&branch.otherwise, stackIndex);
+                push(Step::IfElse, nullptr, stackIndex, varEnv);
+                push(Step::Expr, then, stackIndex, varEnv);
+                count(&branch.then, stackIndex);
+                ifTest(test, stackIndex, varEnv, false);
+                return;
+            }
+            // The arm that ran more often falls through from the test
+            auto swap = branch.otherwise > branch.then;
+            auto first = swap ? otherwise : then, second = swap ? then : otherwise;
+            if (deferCold && (swap ? branch.then : branch.otherwise) == 0)
+            {
+                push(Step::IfCold, second, stackIndex, varEnv);
+            }
+            else
+            {
+                push(Step::IfEnd, nullptr, stackIndex, varEnv);
+                push(Step::Expr, second, stackIndex, varEnv);
+                push(Step::IfElse, nullptr, stackIndex, varEnv);
+            }
+            push(Step::Expr, first, stackIndex, varEnv);
+            ifTest(test, stackIndex, varEnv, swap);
+        }
+
+        // Compiles the first of `bindings` and binds it, or the body when there are none left
+        void let(ASTNode *bindings, ASTNode *body, word stackIndex, const Env *bindingEnv, const Env *bodyEnv)
+        {
+            if (bindings->isNil())
+            {
+                push(Step::Expr, body, stackIndex, bodyEnv);
+                return;
+            }
+            assert(bindings->isPair());
+            auto binding = bindings->asPair()->car;
+            assert(binding->isPair());
+            tasks.push_back({Step::LetBind, bindings, stackIndex, bindingEnv, body, bodyEnv, 0, 0, nullptr});
+            push(Step::Expr, binding->asPair()->cdr->asPair()->car, stackIndex, bindingEnv);
+        }
+
+        // Also compiles foreign-call, which passes its arguments the same way
+        void labelcall(ASTNode *label, ASTNode *args, word stackIndex, const Env *varEnv, Step step = Step::Labelcall)
+        {
+            assert(label->isSymbol());
+            // skip a space on the stack to put the return address
+            auto argStackIndex = stackIndex - WordSize;
+            // We enter with a stackIndex pointing to the next available spot
+            // on the stack. Add WordSize (stackIndex is negative) so that
+            // it's only a multiple of the number of locals N, not N+1.
+            auto rspAdjust = stackIndex + WordSize;
+            // An argument can go straight to its register unless a later one
+            // calls a label, which would clobber it. Otherwise it waits on
+            // the stack and is loaded just before the call.
+            auto count = 0;
+            auto spilled = 0;
+            for (auto arg = args; !arg->isNil(); arg = arg->asPair()->cdr)
+            {
+                assert(arg->isPair());
+                ++count;
+                if (count > 1 && hasCall(arg->asPair()->car))
+                {
+                    spilled = std::min(count - 1, static_cast<int>(RegisterArgs));
+                }
+            }
+            tasks.push_back({step, label, argStackIndex - count * WordSize, varEnv, nullptr, nullptr, rspAdjust, spilled, nullptr});
+            // Each argument goes to the next slot: push them in order, then reverse them
+            auto first = tasks.size();
+            auto index = 0;
+            for (auto arg = args; !arg->isNil(); arg = arg->asPair()->cdr, argStackIndex -= WordSize, ++index)
+            {
+                push(Step::Expr, arg->asPair()->car, argStackIndex, varEnv);
+                if (index >= spilled && index < static_cast<int>(RegisterArgs))
+                {
+                    tasks.push_back({Step::ArgRegister, nullptr, argStackIndex, varEnv, nullptr, nullptr, 0, index, nullptr});
+                }
+                else
+                {
+                    push(Step::Spill, nullptr, argStackIndex, varEnv);
+                }
+            }
+            std::reverse(tasks.begin() + first, tasks.end());
+        }
+
+        int call(ASTNode *callable, ASTNode *args, word stackIndex, const Env *varEnv)
+        {
+            if (!callable->isSymbol())
+            {
+                assert(false && "unexpected call type");
+                return -1;
+            }
+            static const std::pair<std::string_view, Step> unaries[] = {
+                {"add1", Step::Add1},
+                {"sub1", Step::Sub1},
+                {"integer->char", Step::IntegerToChar},
+                {"char->integer", Step::CharToInteger},
+                {"nil?", Step::IsNil},
+                {"zero?", Step::IsZero},
+                {"not", Step::Not},
+                {"integer?", Step::IsInteger},
+                {"boolean?", Step::IsBoolean},
+                {"car", Step::Car},
+                {"cdr", Step::Cdr},
+                {"string-length", Step::StringLength},
+                {"vector-length", Step::VectorLength},
+                {"vector-sum", Step::VectorSum},
+            };
+            static const std::pair<std::string_view, Step> binaries[] = {
+                {"+", Step::Plus},
+                {"-", Step::Minus},
+                {"*", Step::Times},
+                {"=", Step::Equal},
+                {"<", Step::Less},
+                {"quotient", Step::Quotient},
+                {"remainder", Step::Remainder},
+                {"modulo", Step::Modulo},
+                {"string-ref", Step::StringRef},
+                {"make-vector", Step::MakeVector},
+                {"vector-ref", Step::VectorRef},
+                {"vector-fill!", Step::VectorFill},
+            };
+            auto &name = callable->asSymbol()->str;
+            if (typed(name, args, stackIndex, varEnv))
+            {
+                return 0;
+            }
+            for (auto &[primitive, step] : unaries)
+            {
+                if (name == primitive)
+                {
+                    unary(step, operand1(args), stackIndex, varEnv);
+                    return 0;
+                }
+            }
+            for (auto &[primitive, step] : binaries)
+            {
+                if (name == primitive)
+                {
+                    binary(step, args, stackIndex, varEnv);
+                    return 0;
+                }
+            }
+            if (name == "let")
+            {
+                let(operand1(args), operand2(args), stackIndex, varEnv, varEnv);
+            }
+            else if (name == "if")
+            {
+                ifElse(args, stackIndex, varEnv);
+            }
+            else if (name == "cons")
+            {
+                // cdr may allocate and move the heap pointer, so car stays on
+                // the stack until both halves are known. Otherwise it is
+                // stored on the heap right away.
+                auto cdr = operand2(args);
+                auto allocates = cdr->isPair() || cdr->isString();
+                push(allocates ? Step::ConsSpilled : Step::ConsCdr, nullptr, stackIndex, varEnv);
+                push(Step::Expr, cdr, stackIndex - WordSize, varEnv);
+                push(allocates ? Step::Spill : Step::ConsCar, nullptr, stackIndex, varEnv);
+                push(Step::Expr, operand1(args), stackIndex, varEnv);
+            }
+            else if (name == "vector-set!")
+            {
+                push(Step::VectorSet, nullptr, stackIndex, varEnv);
+                push(Step::Expr, operand1(args), stackIndex - 2 * WordSize, varEnv);
+                push(Step::Spill, nullptr, stackIndex - WordSize, varEnv);
+                push(Step::Expr, operand2(args), stackIndex - WordSize, varEnv);
+                push(Step::Spill, nullptr, stackIndex, varEnv);
+                push(Step::Expr, operand3(args), stackIndex, varEnv);
+            }
+            else if (name == "vector-map")
+            {
+                auto op = operand1(args);
+                if (!op->isSymbol() || (op->asSymbol()->str != "+" && op->asSymbol()->str != "*"))
+                {
+                    return -1;
+                }
+                push(Step::VectorMap, op, stackIndex, varEnv);
+                push(Step::Expr, operand2(args), stackIndex - WordSize, varEnv);
+                push(Step::Spill, nullptr, stackIndex, varEnv);
+                push(Step::Expr, operand3(args), stackIndex, varEnv);
+            }
+            else if (name == "labelcall")
+            {
+                labelcall(operand1(args), args->asPair()->cdr, stackIndex, varEnv);
+            }
+            else if (name == "foreign-call")
+            {
+                labelcall(operand1(args), args->asPair()->cdr, stackIndex, varEnv, Step::ForeignCall);
+            }
+            else if (isRuntimeCall(name))
+            {
+                labelcall(callable, args, stackIndex, varEnv, Step::RuntimeCall);
+            }
+            else
             {
+                assert(false && "unexpected call type");
                 return -1;
             }
-
-            // Save the locals
-            Emit::rspAdjust(buf, rspAdjust);
-            Emit::callImm32(buf, *codeAddress);
-            // Unsave the locals
-            Emit::rspAdjust(buf, -rspAdjust);
             return 0;
         }
 
-        assert(args->isPair());
-        auto arg = args->asPair()->car;
-        _(expr(buf, arg, stackIndex, varEnv, labels));
-        Emit::storeIndirectReg(buf, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)}, Emit::Rax);
-        return labelcall(buf, callable, args->asPair()->cdr, stackIndex - WordSize, varEnv, labels, rspAdjust);
-    }
-
-    int call(Buffer &buf, ASTNode *callable, ASTNode *args, word stackIndex, const Env *varEnv, const Env *labels)
-    {
-        if (callable->isSymbol())
+        int expr(ASTNode *node, word stackIndex, const Env *varEnv)
         {
-            auto symbol = callable->asSymbol();
-            if (symbol->str == "add1")
+            if (node->isInteger())
             {
-                _(expr(buf, operand1(args), stackIndex, varEnv, labels));
-                Emit::addRegImm32(buf, Emit::Rax, static_cast<int32_t>(Objects::encodeInteger(1)));
+                auto value = node->getInteger();
+                Emit::movRegImm(buf, Emit::Rax, static_cast<word>(Objects::encodeInteger(value)));
                 return 0;
             }
-            else if (symbol->str == "sub1")
+            else if (node->isChar())
             {
-                _(expr(buf, operand1(args), stackIndex, varEnv, labels));
-                Emit::addRegImm32(buf, Emit::Rax, static_cast<int32_t>(Objects::encodeInteger(-1)));
+                auto value = node->getChar();
+                Emit::movRegImm(buf, Emit::Rax, static_cast<word>(Objects::encodeChar(value)));
                 return 0;
             }
-            else if (symbol->str == "integer->char")
+            else if (node->isBool())
             {
-                _(expr(buf, operand1(args), stackIndex, varEnv, labels));
-                Emit::shlRegImm8(buf, Emit::Rax, Objects::CharShift - Objects::IntegerShift);
-                Emit::orRegImm8(buf, Emit::Rax, static_cast<uint8_t>(Objects::CharTag));
+                auto value = node->getBool();
+                Emit::movRegImm(buf, Emit::Rax, static_cast<word>(Objects::encodeBool(value)));
                 return 0;
             }
-            else if (symbol->str == "char->integer")
+            else if (node->isNil())
             {
-                _(expr(buf, operand1(args), stackIndex, varEnv, labels));
-                Emit::shrRegImm8(buf, Emit::Rax, Objects::CharShift - Objects::IntegerShift);
+                Emit::movRegImm(buf, Emit::Rax, static_cast<word>(Objects::nil()));
                 return 0;
             }
-            else if (symbol->str == "nil?")
+            else if (node->isString())
             {
-                _(expr(buf, operand1(args), stackIndex, varEnv, labels));
-                compareInt32(buf, static_cast<int32_t>(Objects::nil()));
+                stringLiteral(node->asString());
                 return 0;
             }
-            else if (symbol->str == "zero?")
+            else if (node->isPair())
             {
-                _(expr(buf, operand1(args), stackIndex, varEnv, labels));
-                compareInt32(buf, static_cast<int32_t>(Objects::encodeInteger(0)));
-                return 0;
+                auto pair = node->asPair();
+                return call(pair->car, pair->cdr, stackIndex, varEnv);
             }
-            else if (symbol->str == "not")
+            else if (node->isSymbol())
             {
-                _(expr(buf, operand1(args), stackIndex, varEnv, labels));
-                compareInt32(buf, static_cast<int32_t>(Objects::encodeBool(false)));
+                auto &symbol = node->asSymbol()->str;
+                auto entry = varEnv ? varEnv->lookup(symbol) : nullptr;
+                if (!entry)
+                {
+                    return -1;
+                }
+                if (entry->reg >= 0)
+                {
+                    Emit::movRegReg(buf, Emit::Rax, static_cast<Emit::Register>(entry->reg));
+                }
+                else
+                {
+                    Emit::loadRegIndirect(buf, Emit::Rax, Emit::Indirect{Emit::Rsp, static_cast<int32_t>(entry->value)});
+                }
                 return 0;
             }
-            else if (symbol->str == "integer?")
+            assert(0 && "Unexpected node type");
+            return -1;
+        }
+
+        int labelcallCall(const Task &task)
+        {
+            auto &name = task.node->asSymbol()->str;
+            auto rspAdjust = task.rspAdjust;
+            std::optional<size_t> label, global, foreign;
+            auto table = task.step == Step::RuntimeCall ? &runtime() : buf._options.foreign;
+            if (task.step == Step::ForeignCall || task.step == Step::RuntimeCall)
             {
-                _(expr(buf, operand1(args), stackIndex, varEnv, labels));
-                Emit::andRegImm8(buf, Emit::Rax, Objects::IntegerMask);
-                compareInt32(buf, Objects::IntegerTag);
-                return 0;
+                foreign = table ? table->find(name) : std::nullopt;
+                auto arity = (rspAdjust - 2 * WordSize - task.stackIndex) / WordSize;
+                if (!foreign || table->arity(*foreign) != static_cast<size_t>(arity))
+                {
+                    return -1;
+                }
             }
-            else if (symbol->str == "boolean?")
+            else
             {
-                _(expr(buf, operand1(args), stackIndex, varEnv, labels));
-                Emit::andRegImm8(buf, Emit::Rax, Objects::BoolTag);
-                compareInt32(buf, Objects::BoolTag);
-                return 0;
+                label = labels ? labels->find(name) : std::nullopt;
+                global = !label && buf._options.globals ? buf._options.globals->find(name) : std::nullopt;
+                if (!label && !global)
+                {
+                    return -1;
+                }
+                safepointPoll(buf, static_cast<int32_t>(-task.stackIndex));
             }
-            else if (symbol->str == "+")
+            // The arguments start right below the slot for the return address
+            for (auto i = 0; i < task.count; ++i)
             {
-                _(expr(buf, operand2(args), stackIndex, varEnv, labels));
-                Emit::storeIndirectReg(buf, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)}, Emit::Rax);
-                _(expr(buf, operand1(args), stackIndex - WordSize, varEnv, labels));
-                Emit::addRegIndirect(buf, Emit::Rax, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)});
-                return 0;
+                auto slot = static_cast<int32_t>(rspAdjust - 2 * WordSize - i * WordSize);
+                Emit::loadRegIndirect(buf, ArgRegisters[i], Emit::Indirect{Emit::Rsp, slot});
             }
-            else if (symbol->str == "-")
+            // Save the locals
+            Emit::rspAdjust(buf, rspAdjust);
+            if (rspAdjust)
             {
-                _(expr(buf, operand2(args), stackIndex, varEnv, labels));
-                Emit::storeIndirectReg(buf, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)}, Emit::Rax);
-                _(expr(buf, operand1(args), stackIndex - WordSize, varEnv, labels));
-                Emit::subRegIndirect(buf, Emit::Rax, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)});
-                return 0;
+                buf._frameChanges.push_back({buf.size(), static_cast<int32_t>(WordSize - rspAdjust)});
             }
-            else if (symbol->str == "*")
+            if (foreign)
             {
-                _(expr(buf, operand2(args), stackIndex, varEnv, labels));
-                // Remove the tag so that the result is still only tagged with 0b00
-                // instead of 0b0000
-                Emit::shrRegImm8(buf, Emit::Rax, static_cast<int8_t>(Objects::IntegerShift));
-                Emit::storeIndirectReg(buf, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)}, Emit::Rax);
-                _(expr(buf, operand1(args), stackIndex - WordSize, varEnv, labels));
-                Emit::mulRegIndirect(buf, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)});
-                return 0;
+                Emit::movRegImm64(buf, Emit::Rax, reinterpret_cast<uint64_t>(table->stub(*foreign)));
+                Emit::callReg(buf, Emit::Rax);
             }
-            else if (symbol->str == "=")
+            else if (global)
             {
-                _(expr(buf, operand2(args), stackIndex, varEnv, labels));
-                Emit::storeIndirectReg(buf, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)}, Emit::Rax);
-                _(expr(buf, operand1(args), stackIndex - WordSize, varEnv, labels));
-                Emit::cmpRegIndirect(buf, Emit::Rax, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)});
-                Emit::movRegImm32(buf, Emit::Rax, 0);
-                Emit::setccImm8(buf, Emit::Equal, Emit::Al);
-                Emit::shlRegImm8(buf, Emit::Rax, Objects::BoolShift);
-                Emit::orRegImm8(buf, Emit::Rax, Objects::BoolTag);
-                return 0;
+                // call qword [slot], so redefining the global reaches this call too
+                Emit::movRegImm64(buf, Emit::Rax, static_cast<uint64_t>(buf._options.globals->addresses[*global]));
+                Emit::callIndirect(buf, Emit::Rax);
             }
-            else if (symbol->str == "<")
+            else if (buf._options.absoluteLabels)
             {
-                _(expr(buf, operand2(args), stackIndex, varEnv, labels));
-                Emit::storeIndirectReg(buf, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)}, Emit::Rax);
-                _(expr(buf, operand1(args), stackIndex - WordSize, varEnv, labels));
-                Emit::cmpRegIndirect(buf, Emit::Rax, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(stackIndex)});
-                Emit::movRegImm32(buf, Emit::Rax, 0);
-                Emit::setccImm8(buf, Emit::Less, Emit::Al);
-                Emit::shlRegImm8(buf, Emit::Rax, Objects::BoolShift);
-                Emit::orRegImm8(buf, Emit::Rax, Objects::BoolTag);
-                return 0;
+                Emit::movRegImm64(buf, Emit::Rax, static_cast<uint64_t>(labels->addresses[*label]));
+                Emit::callReg(buf, Emit::Rax);
             }
-            else if (symbol->str == "let")
+            else
             {
-                return let(buf, operand1(args), operand2(args), stackIndex,
-                           varEnv, // binding env.
-                           varEnv, // body env.
-                           labels);
+                // The label may not have been emitted yet
+                auto pos = Emit::call(buf, LabelPlaceholder);
+                buf._relocations.push_back({static_cast<size_t>(pos), *label});
             }
-            else if (symbol->str == "if")
+            // Unsave the locals
+            Emit::rspAdjust(buf, -rspAdjust);
+            if (rspAdjust)
             {
-                return if_(buf, operand1(args), // condition
-                           operand2(args),      // on true
-                           operand3(args),      // on false
-                           stackIndex, varEnv, labels);
+                buf._frameChanges.push_back({buf.size(), static_cast<int32_t>(WordSize)});
             }
-            else if (symbol->str == "cons")
+            return 0;
+        }
+
+        void setBool(Emit::Condition cond)
+        {
+            // Not a xor: setcc still needs the flags
+            Emit::movRegImm32(buf, Emit::Rax, 0);
+            Emit::setccImm8(buf, cond, Emit::Al);
+            Emit::shlRegImm8(buf, Emit::Rax, Objects::BoolShift);
+            Emit::orRegImm8(buf, Emit::Rax, Objects::BoolTag);
+        }
+
+        // rax *= factor, for a tagged rax. Shifts and lea where they do.
+        void multiplyLiteral(int32_t factor)
+        {
+            using namespace Emit;
+            if (factor == 0)
             {
-                return cons(buf,
-                            operand1(args), // car
-                            operand2(args), // cdr,
-                            stackIndex,
-                            varEnv, labels);
+                movRegImm(buf, Rax, 0);
+                return;
             }
-            else if (symbol->str == "car")
+            if (factor == -1)
             {
-                _(expr(buf, operand1(args), stackIndex, varEnv, labels));
-                Emit::loadRegIndirect(buf, Emit::Rax, Emit::Indirect{Emit::Rax, static_cast<int8_t>(Objects::CarOffset - Objects::PairTag)});
-                return 0;
+                negReg(buf, Rax);
+                return;
             }
-            else if (symbol->str == "cdr")
+            // factor = odd << shift, with odd 1, 3, 5 or 9
+            auto shift = 0;
+            auto odd = static_cast<uint32_t>(factor);
+            while (factor > 0 && !(odd & 1))
             {
-                _(expr(buf, operand1(args), stackIndex, varEnv, labels));
-                Emit::loadRegIndirect(buf, Emit::Rax, Emit::Indirect{Emit::Rax, static_cast<int8_t>(Objects::CdrOffset - Objects::PairTag)});
-                return 0;
+                odd >>= 1;
+                ++shift;
             }
-            else if (symbol->str == "labelcall")
+            if (factor > 0 && (odd == 1 || odd == 3 || odd == 5 || odd == 9))
             {
-                auto label = operand1(args);
-                assert(label->isSymbol());
-                auto callArgs = args->asPair()->cdr;
-                // skip a space on the stack to put the return address
-                auto argStackIndex = stackIndex - WordSize;
-                // We enter `call` with a stackIndex pointing to the next
-                // available spot on the stack. Add WordSize (stackIndex is negative)
-                // so that it's only a multiple of the number of locals N, not N+1.
-                auto rspAdjust = stackIndex + WordSize;
-                return labelcall(buf, label, callArgs, argStackIndex, varEnv, labels, rspAdjust);
+                if (odd != 1)
+                {
+                    // lea rax, [rax + rax * (odd - 1)]
+                    auto scale = odd == 3 ? Scale2 : odd == 5 ? Scale4 : Scale8;
+                    leaRegIndexed(buf, Rax, Indexed{Rax, Rax, scale, 0});
+                }
+                if (shift)
+                {
+                    shlRegImm8(buf, Rax, static_cast<uint8_t>(shift));
+                }
+                return;
             }
+            imulRegRegImm32(buf, Rax, Rax, factor);
         }
-        assert(false && "unexpected call type");
-        return -1;
-    }
 
-    int expr(Buffer &buf, ASTNode *node, word stackIndex, const Env *varEnv, const Env *labels)
-    {
-        if (node->isInteger())
+        // Tags the integer in rax
+        void tagInteger()
         {
-            auto value = node->getInteger();
-            Emit::movRegImm32(buf, Emit::Rax, static_cast<int32_t>(Objects::encodeInteger(value)));
-            return 0;
+            Emit::shlRegImm8(buf, Emit::Rax, Objects::IntegerShift);
         }
-        else if (node->isChar())
+
+        // Divides the integer in rax by the one at `divisor`. A zero divisor
+        // gives an error object. Both are untagged with arithmetic shifts,
+        // so the division cannot overflow.
+        void divide(Step step, const Emit::Indirect &divisor)
         {
-            auto value = node->getChar();
-            Emit::movRegImm32(buf, Emit::Rax, static_cast<int32_t>(Objects::encodeChar(value)));
-            return 0;
+            using namespace Emit;
+            loadRegIndirect(buf, Rcx, divisor);
+            sarRegImm8(buf, Rcx, Objects::IntegerShift);
+            testRegReg(buf, Rcx, Rcx);
+            auto nonZero = jcc(buf, NotEqual, LabelPlaceholder);
+            movRegImm(buf, Rax, static_cast<word>(Objects::error()));
+            auto end = jmp(buf, LabelPlaceholder);
+            backpatchImm32(buf, nonZero);
+            sarRegImm8(buf, Rax, Objects::IntegerShift);
+            cqo(buf);
+            idivReg(buf, Rcx);
+            if (step != Step::Quotient)
+            {
+                movRegReg(buf, Rax, Rdx);
+            }
+            if (step == Step::Modulo)
+            {
+                // Takes the divisor's sign: add it to a remainder of the other sign
+                testRegReg(buf, Rdx, Rdx);
+                auto zero = jcc(buf, Equal, LabelPlaceholder);
+                xorRegReg(buf, Rdx, Rcx);
+                auto sameSign = jcc(buf, NotSign, LabelPlaceholder);
+                addRegReg(buf, Rax, Rcx);
+                backpatchImm32(buf, zero);
+                backpatchImm32(buf, sameSign);
+            }
+            tagInteger();
+            backpatchImm32(buf, end);
         }
-        else if (node->isBool())
+
+        // Divides by a nonzero constant with a multiply by its reciprocal,
+        // or with shifts for a power of two
+        void divideLiteral(Step step, word divisor)
         {
-            auto value = node->getBool();
-            Emit::movRegImm32(buf, Emit::Rax, static_cast<int32_t>(Objects::encodeBool(value)));
-            return 0;
+            using namespace Emit;
+            sarRegImm8(buf, Rax, Objects::IntegerShift);
+            // rcx keeps the dividend for the remainder
+            movRegReg(buf, Rcx, Rax);
+            auto magnitude = static_cast<uword>(divisor < 0 ? -divisor : divisor);
+            if (magnitude == 1)
+            {
+                // The quotient is the dividend or its negation
+            }
+            else if (!(magnitude & (magnitude - 1)))
+            {
+                // Round toward zero: add magnitude - 1 to a negative dividend first
+                auto bits = 0;
+                while ((uword{1} << bits) != magnitude)
+                {
+                    ++bits;
+                }
+                movRegReg(buf, Rdx, Rax);
+                sarRegImm8(buf, Rdx, BitsPerWord - 1);
+                shrRegImm8(buf, Rdx, static_cast<uint8_t>(BitsPerWord - bits));
+                addRegReg(buf, Rax, Rdx);
+                sarRegImm8(buf, Rax, static_cast<uint8_t>(bits));
+            }
+            else
+            {
+                auto [multiplier, shift] = divisionMagic(magnitude);
+                movRegImm(buf, Rax, multiplier);
+                imulReg(buf, Rcx);
+                if (multiplier < 0)
+                {
+                    addRegReg(buf, Rdx, Rcx);
+                }
+                if (shift)
+                {
+                    sarRegImm8(buf, Rdx, static_cast<uint8_t>(shift));
+                }
+                // Add one to a negative quotient
+                movRegReg(buf, Rax, Rdx);
+                shrRegImm8(buf, Rax, BitsPerWord - 1);
+                addRegReg(buf, Rax, Rdx);
+            }
+            if (divisor < 0)
+            {
+                negReg(buf, Rax);
+            }
+            if (step != Step::QuotientLiteral)
+            {
+                // dividend - quotient * divisor
+                imulRegRegImm32(buf, Rax, Rax, static_cast<int32_t>(divisor));
+                subRegReg(buf, Rcx, Rax);
+                movRegReg(buf, Rax, Rcx);
+            }
+            if (step == Step::ModuloLiteral)
+            {
+                // A remainder of the other sign than the divisor gets it added
+                movRegReg(buf, Rdx, Rax);
+                addRegImm32(buf, Rdx, static_cast<int32_t>(divisor));
+                testRegReg(buf, Rax, Rax);
+                cmovRegReg(buf, divisor > 0 ? Less : Greater, Rax, Rdx);
+            }
+            tagInteger();
+        }
+
+        // Stores rax as the new pair's car or cdr
+        void storeHalf(bool car)
+        {
+            if (buf._options.compressed)
+            {
+                auto offset = car ? Objects::CompressedCarOffset : Objects::CompressedCdrOffset;
+                Emit::store32IndirectReg(buf, Emit::Indirect{HeapPointer, offset}, Emit::Rax);
+                return;
+            }
+            auto offset = car ? Objects::CarOffset : Objects::CdrOffset;
+            Emit::storeIndirectReg(buf, Emit::Indirect{HeapPointer, offset}, Emit::Rax);
+        }
+
+        void allocatePair()
+        {
+            // Store tagged pointer in rax
+            Emit::movRegReg(buf, Emit::Rax, HeapPointer);
+            Emit::orRegImm8(buf, Emit::Rax, Objects::PairTag);
+            // bump the heap pointer
+            Emit::addRegImm32(buf, HeapPointer, buf._options.compressed ? Objects::CompressedPairSize : Objects::PairSize);
+        }
+
+        // Loads the pair in rax's car or cdr into rax
+        void loadHalf(bool car)
+        {
+            using namespace Emit;
+            if (!buf._options.compressed)
+            {
+                auto offset = car ? Objects::CarOffset : Objects::CdrOffset;
+                loadRegIndirect(buf, Rax, Indirect{Rax, static_cast<int8_t>(offset - Objects::PairTag)});
+                return;
+            }
+            // Sign extend, and for a heap tag (01 or 10: odd parity) take the
+            // zero extended offset in the region instead
+            auto offset = car ? Objects::CompressedCarOffset : Objects::CompressedCdrOffset;
+            movsxdRegIndirect(buf, Rax, Indirect{Rax, static_cast<int8_t>(offset - Objects::PairTag)});
+            movRegReg32(buf, Rcx, Rax);
+            orRegReg(buf, Rcx, CompressedBase);
+            testAlImm8(buf, Objects::IntegerMask);
+            cmovRegReg(buf, NotParity, Rax, Rcx);
+        }
+
+        // Copies the literal, padding included, to the heap eight bytes at a
+        // time, so the code does not point into the AST
+        void stringLiteral(const String *string)
+        {
+            using namespace Emit;
+            auto bytes = reinterpret_cast<const uint8_t *>(string);
+            auto size = static_cast<word>(String::allocationSize(string->size()));
+            movRegReg(buf, Rax, HeapPointer);
+            orRegImm8(buf, Rax, Objects::StringTag);
+            // Stores reach 120 bytes past the heap pointer before it has to move
+            word moved = 0;
+            for (word offset = 0; offset < size; offset += WordSize)
+            {
+                if (offset - moved > INT8_MAX - WordSize + 1)
+                {
+                    addRegImm32(buf, HeapPointer, static_cast<int32_t>(offset - moved));
+                    moved = offset;
+                }
+                uint64_t chunk;
+                std::memcpy(&chunk, bytes + offset, WordSize);
+                movRegImm64(buf, Rcx, chunk);
+                storeIndirectReg(buf, Indirect{HeapPointer, static_cast<int8_t>(offset - moved)}, Rcx);
+            }
+            addRegImm32(buf, HeapPointer, static_cast<int32_t>(size - moved));
+        }
+
+        // Emits `jmp test; body: body(); test: test(); j<again> body`
+        template <typename Body, typename Test>
+        void loop(Body body, Test test, Emit::Condition again)
+        {
+            auto toTest = Emit::jmp(buf, LabelPlaceholder);
+            auto start = buf.size();
+            body();
+            Emit::backpatchImm32(buf, static_cast<size_t>(toTest));
+            test();
+            auto back = Emit::jcc(buf, again, LabelPlaceholder);
+            Emit::patchImm32(buf, static_cast<size_t>(back), start);
+        }
+
+        // An encoded index is 4i, so scaling it by 2 gives the element's offset
+        static_assert(Objects::IntegerShift == 2 && WordSize == 8, "vector indexing scales encoded integers by 2");
+        static constexpr Emit::Scale ElementScale = Emit::Scale2;
+        static constexpr int8_t ElementsDisp = Objects::VectorElementsOffset - Objects::VectorTag;
+        static constexpr auto LengthDisp = static_cast<int8_t>(Objects::VectorLengthOffset - Objects::VectorTag);
+
+        // rax holds a vector: points rdx at its first element and rcx past its last
+        void elementRange()
+        {
+            using namespace Emit;
+            leaRegIndexed(buf, Rdx, Indexed{Rax, NoIndex, Scale1, ElementsDisp});
+            loadRegIndirect(buf, Rcx, Indirect{Rax, LengthDisp});
+            leaRegIndexed(buf, Rcx, Indexed{Rdx, Rcx, ElementScale, 0});
+        }
+
+        // Stores the word at `value` from rdx up to rcx. Clobbers rax.
+        void fillLoop(const Emit::Indirect &value)
+        {
+            using namespace Emit;
+            if (buf._options.avx2)
+            {
+                vpbroadcastq(buf, Ymm0, Indexed{value.reg, NoIndex, Scale1, value.disp});
+                leaRegIndexed(buf, Rax, Indexed{Rcx, NoIndex, Scale1, -YmmSize});
+                loop([&] {
+                    vmovdquStore(buf, Indexed{Rdx, NoIndex, Scale1, 0}, Ymm0);
+                    addRegImm32(buf, Rdx, YmmSize);
+                }, [&] { cmpRegReg(buf, Rdx, Rax); }, BelowEqual);
+                vzeroupper(buf);
+            }
+            loadRegIndirect(buf, Rax, value);
+            loop([&] {
+                storeIndexedReg(buf, Indexed{Rdx, NoIndex, Scale1, 0}, Rax);
+                addRegImm32(buf, Rdx, WordSize);
+            }, [&] { cmpRegReg(buf, Rdx, Rcx); }, Carry);
+        }
+
+        // The vector at the heap pointer ends at rcx: tags it into rax and
+        // moves the heap pointer past it, rounded up to 16 bytes
+        void allocateVector()
+        {
+            using namespace Emit;
+            movRegReg(buf, Rax, HeapPointer);
+            orRegImm8(buf, Rax, Objects::VectorTag);
+            subRegReg(buf, Rcx, HeapPointer);
+            addRegImm32(buf, Rcx, 15);
+            andRegImm8(buf, Rcx, 0xf0);
+            addRegReg(buf, HeapPointer, Rcx);
+        }
+
+        void vectorSum()
+        {
+            using namespace Emit;
+            elementRange();
+            if (buf._options.avx2)
+            {
+                vpxor(buf, Ymm0, Ymm0, Ymm0);
+                leaRegIndexed(buf, Rax, Indexed{Rcx, NoIndex, Scale1, -YmmSize});
+                loop([&] {
+                    vpaddqIndexed(buf, Ymm0, Ymm0, Indexed{Rdx, NoIndex, Scale1, 0});
+                    addRegImm32(buf, Rdx, YmmSize);
+                }, [&] { cmpRegReg(buf, Rdx, Rax); }, BelowEqual);
+                // Add up the four lanes
+                vextracti128High(buf, Ymm1, Ymm0);
+                vpaddq(buf, Ymm0, Ymm0, Ymm1, false);
+                vpshufd(buf, Ymm1, Ymm0, 0b0100'1110, false);
+                vpaddq(buf, Ymm0, Ymm0, Ymm1, false);
+                vmovqRegYmm(buf, Rax, Ymm0);
+                vzeroupper(buf);
+            }
+            else
+            {
+                movRegImm(buf, Rax, 0);
+            }
+            loop([&] {
+                addRegIndexed(buf, Rax, Indexed{Rdx, NoIndex, Scale1, 0});
+                addRegImm32(buf, Rdx, WordSize);
+            }, [&] { cmpRegReg(buf, Rdx, Rcx); }, Carry);
+        }
+
+        // Makes a vector as long as the one in rax of `op` applied to its
+        // elements and the second's at stackIndex. rbx, which the Win64 ABI
+        // preserves, is saved below them for the scalar loop.
+        void vectorMap(const std::string &op, word stackIndex)
+        {
+            using namespace Emit;
+            auto second = Indirect{Rsp, static_cast<int32_t>(stackIndex)};
+            auto savedRbx = Indirect{Rsp, static_cast<int32_t>(stackIndex - WordSize)};
+            auto end = Indirect{Rsp, static_cast<int32_t>(stackIndex - 2 * WordSize)};
+            auto wideEnd = Indirect{Rsp, static_cast<int32_t>(stackIndex - 3 * WordSize)};
+            auto plus = op == "+";
+            // rax and rdx walk the operands, rcx is the offset of the element
+            loadRegIndirect(buf, Rcx, Indirect{Rax, LengthDisp});
+            storeIndirectReg(buf, Indirect{HeapPointer, Objects::VectorLengthOffset}, Rcx);
+            addRegReg(buf, Rcx, Rcx);
+            storeIndirectReg(buf, end, Rcx);
+            storeIndirectReg(buf, savedRbx, Rbx);
+            addRegImm32(buf, Rax, ElementsDisp);
+            loadRegIndirect(buf, Rdx, second);
+            addRegImm32(buf, Rdx, ElementsDisp);
+            movRegImm(buf, Rcx, 0);
+            auto result = Indexed{HeapPointer, Rcx, Scale1, Objects::VectorElementsOffset};
+            if (buf._options.avx2)
+            {
+                leaRegIndexed(buf, Rbx, Indexed{Rcx, NoIndex, Scale1, -YmmSize});
+                addRegIndirect(buf, Rbx, end);
+                storeIndirectReg(buf, wideEnd, Rbx);
+                loop([&] {
+                    vmovdquLoad(buf, Ymm0, Indexed{Rax, Rcx, Scale1, 0});
+                    if (plus)
+                    {
+                        vpaddqIndexed(buf, Ymm0, Ymm0, Indexed{Rdx, Rcx, Scale1, 0});
+                    }
+                    else
+                    {
+                        // AVX2 has no 64 bit multiply: build the low half of
+                        // a * (b >> 2) out of 32 x 32 bit products
+                        vmovdquLoad(buf, Ymm1, Indexed{Rdx, Rcx, Scale1, 0});
+                        vpsrlqImm8(buf, Ymm1, Ymm1, Objects::IntegerShift);
+                        vpmuludq(buf, Ymm2, Ymm0, Ymm1);
+                        vpsrlqImm8(buf, Ymm3, Ymm0, 32);
+                        vpmuludq(buf, Ymm3, Ymm3, Ymm1);
+                        vpsrlqImm8(buf, Ymm4, Ymm1, 32);
+                        vpmuludq(buf, Ymm4, Ymm4, Ymm0);
+                        vpaddq(buf, Ymm3, Ymm3, Ymm4);
+                        vpsllqImm8(buf, Ymm3, Ymm3, 32);
+                        vpaddq(buf, Ymm0, Ymm2, Ymm3);
+                    }
+                    vmovdquStore(buf, result, Ymm0);
+                    addRegImm32(buf, Rcx, YmmSize);
+                }, [&] { cmpRegIndirect(buf, Rcx, wideEnd); }, LessEqual);
+                vzeroupper(buf);
+            }
+            loop([&] {
+                if (plus)
+                {
+                    loadRegIndexed(buf, Rbx, Indexed{Rax, Rcx, Scale1, 0});
+                    addRegIndexed(buf, Rbx, Indexed{Rdx, Rcx, Scale1, 0});
+                }
+                else
+                {
+                    // Like Times: the second operand loses its tag
+                    loadRegIndexed(buf, Rbx, Indexed{Rdx, Rcx, Scale1, 0});
+                    shrRegImm8(buf, Rbx, Objects::IntegerShift);
+                    imulRegIndexed(buf, Rbx, Indexed{Rax, Rcx, Scale1, 0});
+                }
+                storeIndexedReg(buf, result, Rbx);
+                addRegImm32(buf, Rcx, WordSize);
+            }, [&] { cmpRegIndirect(buf, Rcx, end); }, Less);
+            loadRegIndirect(buf, Rbx, savedRbx);
+            leaRegIndexed(buf, Rcx, result);
+            allocateVector();
         }
-        else if (node->isNil())
+
+        int step(const Task &task)
         {
-            Emit::movRegImm32(buf, Emit::Rax, static_cast<int32_t>(Objects::nil()));
+            using namespace Emit;
+            auto slot = Indirect{Rsp, static_cast<int32_t>(task.stackIndex)};
+            switch (task.step)
+            {
+            case Step::Expr:
+                if (buf._options.recordNodes && (task.node->isPair() || task.node->isSymbol()))
+                {
+                    // Runs once everything the expression pushes is done
+                    push(Step::ExprEnd, nullptr, task.stackIndex, task.varEnv);
+                    tasks.back().count = static_cast<int>(buf._nodeRanges.size());
+                    buf._nodeRanges.push_back({task.node, buf.size(), buf.size()});
+                }
+                return expr(task.node, task.stackIndex, task.varEnv);
+            case Step::ExprEnd:
+                buf._nodeRanges[task.count].end = buf.size();
+                break;
+            case Step::Add1:
+                addRegImm32(buf, Rax, static_cast<int32_t>(Objects::encodeInteger(1)));
+                break;
+            case Step::Sub1:
+                addRegImm32(buf, Rax, static_cast<int32_t>(Objects::encodeInteger(-1)));
+                break;
+            case Step::IntegerToChar:
+                shlRegImm8(buf, Rax, Objects::CharShift - Objects::IntegerShift);
+                orRegImm8(buf, Rax, static_cast<uint8_t>(Objects::CharTag));
+                break;
+            case Step::CharToInteger:
+                shrRegImm8(buf, Rax, Objects::CharShift - Objects::IntegerShift);
+                break;
+            case Step::IsNil:
+                compareInt32(buf, static_cast<int32_t>(Objects::nil()));
+                break;
+            case Step::IsZero:
+                compareInt32(buf, static_cast<int32_t>(Objects::encodeInteger(0)));
+                break;
+            case Step::Not:
+                compareInt32(buf, static_cast<int32_t>(Objects::encodeBool(false)));
+                break;
+            case Step::IsInteger:
+                andRegImm8(buf, Rax, Objects::IntegerMask);
+                compareInt32(buf, Objects::IntegerTag);
+                break;
+            case Step::IsBoolean:
+                andRegImm8(buf, Rax, Objects::BoolTag);
+                compareInt32(buf, Objects::BoolTag);
+                break;
+            case Step::Car:
+                loadHalf(true);
+                break;
+            case Step::Cdr:
+                loadHalf(false);
+                break;
+            case Step::StringLength:
+                loadRegIndirect(buf, Rax, Indirect{Rax, static_cast<int8_t>(Objects::StringLengthOffset - Objects::StringTag)});
+                break;
+            case Step::VectorLength:
+                loadRegIndirect(buf, Rax, Indirect{Rax, LengthDisp});
+                break;
+            case Step::VectorSum:
+                vectorSum();
+                break;
+            case Step::SpillUntagged:
+                // Remove the tag so that the product is still only tagged
+                // with 0b00 instead of 0b0000
+                shrRegImm8(buf, Rax, static_cast<int8_t>(Objects::IntegerShift));
+                storeIndirectReg(buf, slot, Rax);
+                break;
+            case Step::Spill:
+                storeIndirectReg(buf, slot, Rax);
+                break;
+            case Step::ArgRegister:
+                movRegReg(buf, ArgRegisters[task.count], Rax);
+                break;
+            case Step::Plus:
+                addRegIndirect(buf, Rax, slot);
+                break;
+            case Step::Minus:
+                subRegIndirect(buf, Rax, slot);
+                break;
+            case Step::Times:
+                imulRegIndirect(buf, Rax, slot);
+                break;
+            case Step::TimesLiteral:
+                multiplyLiteral(static_cast<int32_t>(task.node->getInteger()));
+                break;
+            case Step::Quotient:
+            case Step::Remainder:
+            case Step::Modulo:
+                divide(task.step, slot);
+                break;
+            case Step::QuotientLiteral:
+            case Step::RemainderLiteral:
+            case Step::ModuloLiteral:
+                divideLiteral(task.step, operand2(task.node)->getInteger());
+                break;
+            case Step::Equal:
+                cmpRegIndirect(buf, Rax, slot);
+                setBool(Equal);
+                break;
+            case Step::Less:
+                cmpRegIndirect(buf, Rax, slot);
+                setBool(Less);
+                break;
+            case Step::IfTest:
+                cmpRegImm32(buf, Rax, static_cast<int32_t>(Objects::encodeBool(false)));
+                jumps.push_back(static_cast<size_t>(jcc(buf, task.count ? NotEqual : Equal, LabelPlaceholder)));
+                break;
+            case Step::IfCompare:
+            {
+                auto &name = task.node->asPair()->car->asSymbol()->str;
+                auto otherwise = NotEqual;
+                if (name == "<" || name == "=")
+                {
+                    cmpRegIndirect(buf, Rax, slot);
+                    otherwise = name == "<" ? GreaterEqual : NotEqual;
+                }
+                else
+                {
+                    auto value = name == "zero?" ? Objects::encodeInteger(0) : name == "nil?" ? Objects::nil() : Objects::encodeBool(false);
+                    cmpRegImm32(buf, Rax, static_cast<int32_t>(value));
+                }
+                if (task.count)
+                {
+                    // Flipping the low bit of a condition code negates it
+                    otherwise = static_cast<Condition>(otherwise ^ 1);
+                }
+                jumps.push_back(static_cast<size_t>(jcc(buf, otherwise, LabelPlaceholder)));
+                break;
+            }
+            case Step::IfElse:
+            {
+                auto endPos = jmp(buf, LabelPlaceholder);
+                backpatchImm32(buf, jumps.back());
+                jumps.back() = static_cast<size_t>(endPos);
+                break;
+            }
+            case Step::IfEnd:
+                backpatchImm32(buf, jumps.back());
+                jumps.pop_back();
+                break;
+            case Step::IfCold:
+                cold.push_back({task.node, task.stackIndex, task.varEnv, jumps.back(), buf.size()});
+                jumps.pop_back();
+                break;
+            case Step::Count:
+                // rcx is free between expressions
+                movRegImm64(buf, Rcx, reinterpret_cast<uint64_t>(task.counter));
+                addIndirectImm8(buf, Indirect{Rcx, 0}, 1);
+                break;
+            case Step::LetBind:
+            {
+                storeIndirectReg(buf, slot, Rax);
+                // Bind the name for the body and compile the rest of the bindings
+                auto name = task.node->asPair()->car->asPair()->car;
+                assert(name->isSymbol());
+                envs.push_back(Env{name->asSymbol()->str, task.stackIndex, task.bodyEnv});
+                envs.back().kind = kindOf(task.node->asPair()->car->asPair()->cdr->asPair()->car, task.varEnv);
+                let(task.node->asPair()->cdr, task.body, task.stackIndex - WordSize, task.varEnv, &envs.back());
+                break;
+            }
+            case Step::ConsCar:
+                storeHalf(true);
+                break;
+            case Step::ConsCdr:
+                storeHalf(false);
+                allocatePair();
+                break;
+            case Step::ConsSpilled:
+                storeHalf(false);
+                loadRegIndirect(buf, Rax, Indirect{Rsp, static_cast<int32_t>(task.stackIndex)});
+                storeHalf(true);
+                allocatePair();
+                break;
+            case Step::StringRef:
+                loadRegIndirect(buf, Rcx, slot);
+                sarRegImm8(buf, Rcx, Objects::IntegerShift);
+                movzxRegIndexedByte(buf, Rax, Indexed{Rax, Rcx, Scale1, static_cast<int8_t>(Objects::StringBytesOffset - Objects::StringTag)});
+                shlRegImm8(buf, Rax, Objects::CharShift);
+                orRegImm8(buf, Rax, static_cast<uint8_t>(Objects::CharTag));
+                break;
+            case Step::MakeVector:
+                storeIndirectReg(buf, Indirect{HeapPointer, Objects::VectorLengthOffset}, Rax);
+                // A negative length allocates no elements rather than moving the heap pointer back
+                xorRegReg32(buf, Rcx, Rcx);
+                testRegReg(buf, Rax, Rax);
+                cmovRegReg(buf, Sign, Rax, Rcx);
+                leaRegIndexed(buf, Rdx, Indexed{HeapPointer, NoIndex, Scale1, Objects::VectorElementsOffset});
+                leaRegIndexed(buf, Rcx, Indexed{Rdx, Rax, ElementScale, 0});
+                fillLoop(slot);
+                allocateVector();
+                break;
+            case Step::VectorRef:
+                loadRegIndirect(buf, Rcx, slot);
+                loadRegIndexed(buf, Rax, Indexed{Rax, Rcx, ElementScale, ElementsDisp});
+                break;
+            case Step::VectorFill:
+            {
+                auto vector = Indirect{Rsp, static_cast<int32_t>(task.stackIndex - WordSize)};
+                storeIndirectReg(buf, vector, Rax);
+                elementRange();
+                fillLoop(slot);
+                loadRegIndirect(buf, Rax, vector);
+                break;
+            }
+            case Step::VectorSet:
+                loadRegIndirect(buf, Rcx, Indirect{Rsp, static_cast<int32_t>(task.stackIndex - WordSize)});
+                loadRegIndirect(buf, Rdx, slot);
+                storeIndexedReg(buf, Indexed{Rax, Rcx, ElementScale, ElementsDisp}, Rdx);
+                break;
+            case Step::VectorMap:
+                vectorMap(task.node->asSymbol()->str, task.stackIndex);
+                break;
+            case Step::Labelcall:
+            case Step::ForeignCall:
+            case Step::RuntimeCall:
+                return labelcallCall(task);
+            }
             return 0;
         }
-        else if (node->isPair())
+
+        int run(ASTNode *node, word stackIndex, const Env *varEnv)
         {
-            auto pair = node->asPair();
-            return call(buf, pair->car, pair->cdr, stackIndex, varEnv, labels);
+            push(Step::Expr, node, stackIndex, varEnv);
+            while (!tasks.empty())
+            {
+                auto task = tasks.back();
+                tasks.pop_back();
+                _(step(task));
+            }
+            return 0;
         }
-        else if (node->isSymbol())
+
+        // Compiles the arms left in `cold` where the buffer ends now
+        int runCold()
         {
-            auto symbol = node->asSymbol()->str;
-            if (auto val = varEnv->find(symbol))
+            while (!cold.empty())
             {
-                Emit::loadRegIndirect(buf, Emit::Rax, Emit::Indirect{Emit::Rsp, static_cast<int8_t>(*val)});
-                return 0;
+                auto arm = cold.back();
+                cold.pop_back();
+                Emit::backpatchImm32(buf, arm.jump);
+                _(run(arm.node, arm.stackIndex, arm.varEnv));
+                Emit::patchImm32(buf, static_cast<size_t>(Emit::jmp(buf, LabelPlaceholder)), arm.end);
             }
-            return -1;
+            return 0;
         }
-        assert(0 && "Unexpected node type");
-        return -1;
-    }
 
-    int codeImpl(Buffer &buf, ASTNode *formals, ASTNode *body, word stackIndex, Env *varEnv, Env* labels)
+        Buffer &buf;
+        const LabelTable *labels;
+        std::vector<Task> &tasks;
+        std::vector<size_t> &jumps;
+        std::deque<Env> &envs;
+        std::vector<ColdArm> &cold;
+        // Whether cold arms can wait for runCold
+        bool deferCold;
+    };
+
+    // Compiles the body of a function followed by `epilogue`, which returns,
+    // and then by the arms of its `if`s that a profile found cold
+    static int body(Buffer &buf, ASTNode *node, word stackIndex, const Env *varEnv, const LabelTable *labels,
+                    void (*epilogue)(Buffer &buf))
     {
-        if (formals->isNil())
+        auto &storage = Worklist::storage();
+        auto envCount = storage.envs.size();
+        Worklist worklist{buf, labels, storage.tasks, storage.jumps, storage.envs, storage.cold, epilogue != nullptr};
+        auto result = worklist.run(node, stackIndex, varEnv);
+        if (result == 0 && epilogue)
         {
-            _(expr(buf, body, stackIndex, varEnv, labels));
-            buf.writeArray(FunctionEpilogue, sizeof(FunctionEpilogue));
-            return 0;
+            epilogue(buf);
+            result = worklist.runCold();
         }
-        assert(formals->isPair());
-        auto name = formals->asPair()->car;
-        assert(name->isSymbol());
-        auto entry = Env{name->asSymbol()->str, stackIndex, varEnv};
-        return codeImpl(buf, formals->asPair()->cdr, body, stackIndex - WordSize, &entry, labels);
+        storage.tasks.clear();
+        storage.jumps.clear();
+        storage.cold.clear();
+        storage.envs.erase(storage.envs.begin() + envCount, storage.envs.end());
+        return result;
     }
 
-    int code(Buffer &buf, ASTNode *code, Env *labels)
+    int expr(Buffer &buf, ASTNode *node, word stackIndex, const Env *varEnv, const LabelTable *labels)
+    {
+        return body(buf, node, stackIndex, varEnv, labels, nullptr);
+    }
+
+    static void functionEpilogue(Buffer &buf)
+    {
+        buf.writeArray(FunctionEpilogue, sizeof(FunctionEpilogue));
+    }
+
+    int code(Buffer &buf, ASTNode *code, const LabelTable *labels)
     {
         assert(code->isPair());
         auto codeSym = code->asPair()->car;
@@ -830,38 +3110,183 @@ namespace Compile
         auto args = code->asPair()->cdr;
         auto formals = operand1(args);
         auto codeBody = operand2(args);
-        // Formals are laid out before the function frame, so their offsets from RSP are positive
-        return codeImpl(buf, formals, codeBody, -WordSize, nullptr, labels);
+        int32_t arity = 0;
+        for (auto formal = formals; formal->isPair(); formal = formal->asPair()->cdr)
+        {
+            ++arity;
+        }
+        safepointPoll(buf, arity * WordSize);
+        // Formals are laid out before the function frame, so their offsets
+        // from RSP are positive. The ones passed in registers stay there
+        // unless a call may overwrite them before they are read.
+        auto spill = clobberedFormals(formals, codeBody);
+        auto &envs = Worklist::storage().envs;
+        auto envCount = envs.size();
+        const Env *varEnv = nullptr;
+        word stackIndex = -WordSize;
+        size_t index = 0;
+        for (auto formal = formals; formal->isPair(); formal = formal->asPair()->cdr, stackIndex -= WordSize, ++index)
+        {
+            auto name = formal->asPair()->car;
+            assert(name->isSymbol());
+            envs.push_back(Env{name->asSymbol()->str, stackIndex, varEnv});
+            if (index < RegisterArgs && (spill & (1 << index)))
+            {
+                Emit::storeIndirectReg(buf, Emit::Indirect{Emit::Rsp, static_cast<int32_t>(stackIndex)}, ArgRegisters[index]);
+            }
+            else if (index < RegisterArgs)
+            {
+                envs.back().reg = static_cast<int8_t>(ArgRegisters[index]);
+            }
+            varEnv = &envs.back();
+        }
+        auto compiled = body(buf, codeBody, stackIndex, varEnv, labels, functionEpilogue);
+        envs.erase(envs.begin() + envCount, envs.end());
+        _(compiled);
+        return 0;
+    }
+
+    // Counts the call and jumps through the label's slot:
+    //   mov rax, &slot; add qword [rax+calls], 1; jmp qword [rax+target]
+    static void labelStub(Buffer &buf, LabelSlot *slot)
+    {
+        Emit::movRegImm64(buf, Emit::Rax, reinterpret_cast<uint64_t>(slot));
+        Emit::addIndirectImm8(buf, Emit::Indirect{Emit::Rax, static_cast<int8_t>(offsetof(LabelSlot, calls))}, 1);
+        static_assert(offsetof(LabelSlot, target) == 0, "the jump reads the target at [rax]");
+        Emit::jmpIndirect(buf, Emit::Rax);
     }
 
-    int labels(Buffer &buf, ASTNode *bindings, ASTNode *body, Env *labelEnv, word bodyPos)
+    // Stands in for a label body until lazyCompile has produced one. The
+    // caller's arguments live below rsp, so they are stepped over before
+    // calling into C++ on a 16 byte aligned stack. rsi is nonvolatile in the
+    // Win64 ABI and survives the call; the register arguments wait in their
+    // stack slots.
+    static void lazyTrampoline(Buffer &buf, size_t labelIndex, int arity)
     {
-        if (bindings->isNil())
+        using namespace Emit;
+        auto registerArgs = std::min(arity, static_cast<int>(RegisterArgs));
+        for (auto i = 0; i < registerArgs; ++i)
         {
-            Emit::backpatchImm32(buf, bodyPos);
-            // Base case: no bindings. Compile the body
-            _(expr(buf, body, -WordSize, nullptr, labelEnv));
-            buf.writeArray(FunctionEpilogue, sizeof(FunctionEpilogue));
-            return 0;
+            storeIndirectReg(buf, Indirect{Rsp, static_cast<int8_t>(-(i + 1) * WordSize)}, ArgRegisters[i]);
+        }
+        movRegReg(buf, Rax, Rsp);
+        rspAdjust(buf, -arity * WordSize);
+        andRegImm8(buf, Rsp, 0xf0);
+        pushReg(buf, Rax);
+        subRegImm32(buf, Rsp, ShadowSpace + WordSize);
+        movRegImm64(buf, Rcx, reinterpret_cast<uint64_t>(buf._options.lazyContext));
+        movRegImm64(buf, Rdx, labelIndex);
+        movRegImm64(buf, Rax, reinterpret_cast<uint64_t>(buf._options.lazyCompile));
+        callReg(buf, Rax);
+        addRegImm32(buf, Rsp, ShadowSpace + WordSize);
+        popReg(buf, Rsp);
+        // The stack is back to how the label was entered
+        for (auto i = 0; i < registerArgs; ++i)
+        {
+            loadRegIndirect(buf, ArgRegisters[i], Indirect{Rsp, static_cast<int8_t>(-(i + 1) * WordSize)});
+        }
+        jmpReg(buf, Rax);
+    }
+
+    int labels(Buffer &buf, ASTNode *bindings, ASTNode *body, word bodyPos)
+    {
+        // First pass: every label gets an index, so bodies can call labels
+        // that are emitted after them
+        LabelTable table;
+        for (auto binding = bindings; !binding->isNil(); binding = binding->asPair()->cdr)
+        {
+            assert(binding->isPair());
+            auto name = binding->asPair()->car->asPair()->car;
+            assert(name->isSymbol());
+            if (!table.add(name->asSymbol()->str))
+            {
+                return -1;
+            }
+        }
+
+        std::vector<ASTNode *> order;
+        for (auto binding = bindings; !binding->isNil(); binding = binding->asPair()->cdr)
+        {
+            order.push_back(binding->asPair()->car);
+        }
+        auto profile = buf._options.profile;
+        if (profile && buf._options.instrument)
+        {
+            profile->labelCalls.resize(order.size());
+        }
+        auto layout = profile && !buf._options.instrument && profile->labelCalls.size() == order.size();
+        std::vector<size_t> indices(order.size());
+        for (size_t i = 0; i < indices.size(); ++i)
+        {
+            indices[i] = i;
+        }
+        if (layout)
+        {
+            // The most called labels first, so hot code sits together
+            std::stable_sort(indices.begin(), indices.end(), [&](size_t a, size_t b) {
+                return profile->labelCalls[a] > profile->labelCalls[b];
+            });
+        }
+
+        for (auto labelIndex : indices)
+        {
+            auto name = order[labelIndex]->asPair()->car;
+            auto bindingCode = order[labelIndex]->asPair()->cdr->asPair()->car;
+            if (layout && profile->labelCalls[labelIndex])
+            {
+                // Padding that is never run
+                while (buf.size() % LabelAlignment)
+                {
+                    buf.write8(Int3);
+                }
+            }
+            auto functionLocation = buf.size();
+            table.addresses[labelIndex] = static_cast<word>(functionLocation);
+            buf._labels.push_back({name->asSymbol()->str, functionLocation});
+            if (buf._options.labelSlots)
+            {
+                labelStub(buf, &buf._options.labelSlots[labelIndex]);
+                assert(buf.size() - functionLocation == LabelStubSize);
+            }
+            if (buf._options.lazyCompile)
+            {
+                assert(buf._options.labelSlots);
+                int arity = 0;
+                for (auto formal = operand1(bindingCode->asPair()->cdr); formal->isPair(); formal = formal->asPair()->cdr)
+                {
+                    ++arity;
+                }
+                lazyTrampoline(buf, labelIndex, arity);
+            }
+            else
+            {
+                if (profile && buf._options.instrument)
+                {
+                    Emit::movRegImm64(buf, Emit::Rcx, reinterpret_cast<uint64_t>(&profile->labelCalls[labelIndex]));
+                    Emit::addIndirectImm8(buf, Emit::Indirect{Emit::Rcx, 0}, 1);
+                }
+                // Compile the binding function
+                _(code(buf, bindingCode, &table));
+            }
+        }
+
+        Emit::backpatchImm32(buf, bodyPos);
+        buf._labels.push_back({"main", buf.size()});
+        _(Compile::body(buf, body, mainStackIndex(buf), nullptr, &table, mainEpilogue));
+
+        // Second pass: every label has an address now
+        for (auto &relocation : buf._relocations)
+        {
+            Emit::patchImm32(buf, relocation.offset, static_cast<size_t>(table.addresses[relocation.label]));
         }
-        assert(bindings->isPair());
-        // Get the next binding
-        auto binding = bindings->asPair()->car;
-        auto name = binding->asPair()->car;
-        assert(name->isSymbol());
-        auto bindingCode = binding->asPair()->cdr->asPair()->car;
-        auto functionLocation = static_cast<word>(buf.size());
-        // Bind the name to the location in the instruction stream
-        auto entry = Env{name->asSymbol()->str, functionLocation, labelEnv};
-        // Compile the binding function
-        _(code(buf, bindingCode, &entry));
-        _(labels(buf, bindings->asPair()->cdr, body, &entry, bodyPos));
+        buf._relocations.clear();
         return 0;
     }
 
-    int function(Buffer &buf, ASTNode *node)
+    static int functionImpl(Buffer &buf, ASTNode *node)
     {
-        buf.writeArray(FunctionPrologue, sizeof(FunctionPrologue));
+        buf._labels.push_back({"main", buf.size()});
+        mainPrologue(buf);
         if (node->isPair())
         {
             // assume it's `(labels ...)`
@@ -874,16 +3299,60 @@ namespace Compile
                 auto bindings = operand1(args);
                 assert(bindings->isPair() || bindings->isNil());
                 auto body = operand2(args);
-                _(labels(buf, bindings, body, /*labels=*/nullptr, bodyPos));
+                _(labels(buf, bindings, body, bodyPos));
                 return 0;
             }
         }
 
-        _(expr(buf, node, -WordSize, nullptr, nullptr));
-        buf.writeArray(FunctionEpilogue, sizeof(FunctionEpilogue));
-
+        _(body(buf, node, mainStackIndex(buf), nullptr, nullptr, mainEpilogue));
         return 0;
     }
+
+    // Numbers the `if`s of `program` in preorder, like Profile::branches
+    static void numberBranches(ASTNode *program, std::unordered_map<const ASTNode *, size_t> &branches)
+    {
+        std::vector<ASTNode *> pending{program};
+        while (!pending.empty())
+        {
+            auto node = pending.back();
+            pending.pop_back();
+            if (!node->isPair())
+            {
+                continue;
+            }
+            auto pair = node->asPair();
+            if (pair->car->isSymbol() && pair->car->asSymbol()->str == "if")
+            {
+                branches.emplace(pair->cdr, branches.size());
+            }
+            pending.push_back(pair->cdr);
+            pending.push_back(pair->car);
+        }
+    }
+
+    int function(Buffer &buf, ASTNode *node)
+    {
+        Stats::Timer timer{Stats::Phase::Compile};
+        auto start = buf.size();
+        auto &branches = Worklist::storage().branches;
+        if (auto profile = buf._options.profile)
+        {
+            numberBranches(node, branches);
+            if (buf._options.instrument)
+            {
+                profile->branches.resize(branches.size());
+            }
+            else if (profile->branches.size() != branches.size())
+            {
+                // A profile of some other program
+                branches.clear();
+            }
+        }
+        auto result = functionImpl(buf, node);
+        branches.clear();
+        timer.setBytes(buf.size() - start);
+        return result;
+    }
 #undef _
 } // namespace Compile
 
@@ -938,6 +3407,7 @@ namespace Reader
             case '<':
             case '=':
             case '?':
+            case '!':
                 return true;
             default:
                 return isalpha(c);
@@ -979,22 +3449,39 @@ namespace Reader
             return ASTNode::newChar(c);
         }
 
-        ASTNode *readList()
+        ASTNode *readString()
         {
-            char c = skipWS();
-            if (c == ')')
+            std::string text;
+            for (char c = input[pos]; c != '"'; c = next())
             {
-                advance();
-                return ASTNode::nil();
+                if (c == '\0')
+                {
+                    return ASTNode::error();
+                }
+                if (c == '\\')
+                {
+                    switch (c = next())
+                    {
+                    case 'n':
+                        c = '\n';
+                        break;
+                    case 't':
+                        c = '\t';
+                        break;
+                    case '"':
+                    case '\\':
+                        break;
+                    default:
+                        return ASTNode::error();
+                    }
+                }
+                text.push_back(c);
             }
-            ASTNode *car = readRec();
-            assert(car != ASTNode::error());
-            ASTNode *cdr = readList();
-            assert(cdr != ASTNode::error());
-            return ASTNode::newPair(car, cdr);
+            advance();
+            return ASTNode::newString(text);
         }
 
-        ASTNode *readRec()
+        ASTNode *readAtom()
         {
             char c = skipWS();
             if (std::isdigit(c))
@@ -1020,6 +3507,11 @@ namespace Reader
                 advance();
                 return readChar();
             }
+            if (c == '"')
+            {
+                advance();
+                return readString();
+            }
             if (c == '#' && peek() == 't')
             {
                 advance();
@@ -1032,21 +3524,75 @@ namespace Reader
                 advance();
                 return ASTNode::newBool(false);
             }
-            if (c == '(')
+            return ASTNode::error();
+        }
+
+        // Lists are read with a stack of the ones still open rather than by
+        // recursion, so input nested deeper than the native stack reads too
+        ASTNode *readRec()
+        {
+            struct OpenList
             {
-                advance();
-                return readList();
+                ASTNode *head;
+                ASTNode *last;
+                word begin;
+            };
+            std::vector<OpenList> open;
+            for (;;)
+            {
+                char c = skipWS();
+                ASTNode *node;
+                auto begin = pos;
+                if (c == '(')
+                {
+                    advance();
+                    open.push_back({ASTNode::nil(), nullptr, begin});
+                    continue;
+                }
+                if (c == ')' && !open.empty())
+                {
+                    advance();
+                    node = open.back().head;
+                    begin = open.back().begin;
+                    open.pop_back();
+                }
+                else
+                {
+                    node = readAtom();
+                    if (node->isError())
+                    {
+                        for (auto &list : open)
+                        {
+                            heapFree(list.head);
+                        }
+                        return node;
+                    }
+                }
+                if (spans && (node->isPair() || node->isSymbol() || node->isString()))
+                {
+                    spans->emplace(node, SourceSpan{static_cast<size_t>(begin), static_cast<size_t>(pos)});
+                }
+                if (open.empty())
+                {
+                    return node;
+                }
+                auto pair = ASTNode::newPair(node, ASTNode::nil());
+                auto &list = open.back();
+                (list.last ? list.last->asPair()->cdr : list.head) = pair;
+                list.last = pair;
             }
-            return ASTNode::error();
         }
 
         std::string input;
         word pos;
+        SourceSpans *spans;
     };
-    std::unique_ptr<ASTNode, decltype(&heapFree)> read(std::string &&input)
+    std::unique_ptr<ASTNode, decltype(&heapFree)> read(std::string &&input, SourceSpans *spans)
     {
+        Stats::Timer timer{Stats::Phase::Read};
+        timer.setBytes(input.size());
         return std::unique_ptr<ASTNode, decltype(&heapFree)>{
-            Reader{input, (word)0}.readRec(),
+            Reader{input, (word)0, spans}.readRec(),
             &heapFree};
     }
 
@@ -3,24 +3,211 @@
 #include <vector>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <optional>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
 
 using JitFunction = int (*)(uint64_t*);
 
+// Stats: per-phase latency counters. Compiled out unless ALISP_STATS is defined.
+namespace Stats
+{
+    enum class Phase
+    {
+        Read,
+        Compile,
+        Freeze,
+        Execute,
+        Interpret,
+        Count
+    };
+
+    // Bucket N counts samples that took [2^(N-1), 2^N) nanoseconds
+    constexpr int HistogramBuckets = 40;
+
+    struct PhaseStats
+    {
+        uint64_t count{};
+        uint64_t totalNs{};
+        uint64_t maxNs{};
+        uint64_t bytes{};
+        std::array<uint64_t, HistogramBuckets> histogram{};
+
+        // Upper bound of the bucket holding the given quantile (0..1), capped at maxNs
+        uint64_t quantileNs(double q) const;
+    };
+
+    constexpr bool enabled()
+    {
+#ifdef ALISP_STATS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    const char *name(Phase phase);
+    PhaseStats get(Phase phase);
+    void record(Phase phase, uint64_t ns, uint64_t bytes);
+    void reset();
+
+    // Records the lifetime of the scope against `phase`
+    struct Timer final
+    {
+#ifdef ALISP_STATS
+        explicit Timer(Phase phase) : _phase{phase} {}
+        ~Timer()
+        {
+            auto elapsed = std::chrono::steady_clock::now() - _start;
+            record(_phase, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), _bytes);
+        }
+        void setBytes(uint64_t bytes) { _bytes = bytes; }
+
+    private:
+        Phase _phase;
+        uint64_t _bytes{};
+        std::chrono::steady_clock::time_point _start = std::chrono::steady_clock::now();
+#else
+        explicit Timer(Phase) {}
+        void setBytes(uint64_t) {}
+#endif
+    };
+} // namespace Stats
+
+// What the processor running the compiler supports beyond x86-64
+namespace Cpu
+{
+    // AVX2, and an OS that saves the ymm registers
+    bool hasAvx2();
+} // namespace Cpu
+
+class CodeArena;
+class Foreign;
+struct LabelTable;
+struct ASTNode;
+
+// Where a form was read from: [begin, end) in bytes of the source text
+struct SourceSpan
+{
+    size_t begin;
+    size_t end;
+};
+// Filled by Reader::read for every pair, symbol and string it makes
+using SourceSpans = std::unordered_map<const ASTNode *, SourceSpan>;
+
 struct Code final
 {
     Code(const std::vector<uint8_t> &buf);
+    // The code lives in `arena` and must not outlive it
+    Code(const std::vector<uint8_t> &buf, CodeArena &arena);
 
     static void VFree(uint8_t *ptr);
 
+    const uint8_t *data() const { return _ptr.get(); }
+    size_t size() const { return _size; }
+
     template <typename TF>
     auto toFunc() const
     {
         return reinterpret_cast<TF *>(_ptr.get());
     }
 
+    // Calls the code as a TF, timing it as Stats::Phase::Execute
+    template <typename TF, typename... Args>
+    auto call(Args... args) const
+    {
+        Stats::Timer timer{Stats::Phase::Execute};
+        return toFunc<TF>()(args...);
+    }
+
 private:
+    friend struct Buffer;
+
     std::unique_ptr<uint8_t, void (*)(uint8_t *)> _ptr;
+    size_t _size;
+    // Released before the code itself so debuggers never see freed code
+    std::shared_ptr<void> _debugRegistration;
+};
+
+// Executable memory for code that lives as long as the arena. Small pieces
+// of code share pages rather than taking at least one each. Placing code
+// briefly makes its pages writable, so nothing in them may run on another
+// thread meanwhile.
+class CodeArena final
+{
+public:
+    static constexpr size_t ChunkSize = 64 * 1024;
+
+    CodeArena() = default;
+    CodeArena(const CodeArena &) = delete;
+    CodeArena &operator=(const CodeArena &) = delete;
+    ~CodeArena();
+
+    uint8_t *place(const std::vector<uint8_t> &bytes);
+    size_t chunkCount() const { return _chunks.size(); }
+
+private:
+    struct Chunk
+    {
+        uint8_t *base;
+        size_t size;
+        size_t used;
+    };
+    std::vector<Chunk> _chunks;
+};
+
+// Lets another thread interrupt code compiled with Buffer::Options::safepoints.
+// The code keeps a pointer to it in rdi for the whole run.
+struct SafepointControl
+{
+    using Handler = void (*)(SafepointControl *control);
+
+    // Polled at every label entry and labelcall
+    std::atomic<uint8_t> yieldRequested{};
+    // Compile::safepointStub(), which calls `handler` on a stack fit for C++
+    uint64_t stub{};
+    Handler handler{};
+    // The caller's rdi, restored before the code returns
+    uint64_t savedRdi{};
+    void *context{};
+};
+
+// What a foreign function takes and returns, on the C++ side: word,
+// char, bool or ASTNode * (any object, untouched). Void results read as nil.
+enum class ForeignType
+{
+    Void,
+    Integer,
+    Char,
+    Bool,
+    Object,
+};
+
+// A patchable label entry. Compiled code enters the label by counting the
+// call and jumping to `target`, which can be swapped while code is running.
+struct LabelSlot
+{
+    std::atomic<uint64_t> target{};
+    std::atomic<uint64_t> calls{};
+};
+
+// How often each arm of every `if` and each label of a program ran. Code
+// compiled with Buffer::Options::instrument counts into it; compiling the
+// same program again with the filled profile lays the code out to match.
+struct Profile
+{
+    struct Branch
+    {
+        uint64_t then = 0;
+        uint64_t otherwise = 0;
+    };
+    // By the position of the `if` in a preorder walk of the program
+    std::vector<Branch> branches;
+    // By the label's position in the outermost `labels`
+    std::vector<uint64_t> labelCalls;
 };
 
 struct Buffer final
@@ -32,8 +219,82 @@ struct Buffer final
     size_t size() const;
 
     Code freeze() const;
+    Code freeze(CodeArena &arena) const;
+    // Tells profilers and debuggers about freshly frozen code
+    void registerCode(Code &code) const;
+
+    // A named region of code that starts at `offset` and runs up to the next label
+    struct Label
+    {
+        std::string name;
+        size_t offset;
+    };
+
+    // A rel32 call that is pointed at a label once every label is emitted
+    struct Relocation
+    {
+        size_t offset;
+        size_t label;
+    };
+    // From `offset` on, the canonical frame address is rsp + cfaOffset.
+    // Every region starts at rsp + WordSize, right after the return address.
+    struct FrameChange
+    {
+        size_t offset;
+        int32_t cfaOffset;
+    };
+    // The code compiled for `node` is [begin, end). Ranges of subexpressions
+    // nest inside it, except for arms moved out of line by a profile.
+    struct NodeRange
+    {
+        const ASTNode *node;
+        size_t begin;
+        size_t end;
+    };
+
+    // How code in this buffer reaches labels
+    struct Options
+    {
+        // Label N of a `labels` form starts with an entry stub through labelSlots[N]
+        LabelSlot *labelSlots = nullptr;
+        // Label environments hold absolute addresses rather than buffer offsets
+        bool absoluteLabels = false;
+        // With labelSlots set, label bodies are left out. Each stub is followed by a
+        // trampoline that calls lazyCompile(lazyContext, N) on the label's first call
+        // and jumps to the entry point it returns.
+        using LazyCompile = uint64_t (*)(void *context, uint64_t label);
+        LazyCompile lazyCompile = nullptr;
+        void *lazyContext = nullptr;
+        // Functions callable from any program, by the address of the 8 byte slot
+        // that holds their entry point. Labels of the program shadow them.
+        const LabelTable *globals = nullptr;
+        // Poll a SafepointControl at label entries and labelcalls. The function
+        // then takes (uword *heap, SafepointControl *control).
+        bool safepoints = false;
+        // C++ functions for `(foreign-call name args...)`
+        const Foreign *foreign = nullptr;
+        // Emit AVX2 loops for the bulk vector primitives instead of scalar ones
+        bool avx2 = Cpu::hasAvx2();
+        // Pairs hold 32 bit references (see Objects::compress). The heap must
+        // come from a CompressedHeap; r15 holds its base while the code runs.
+        bool compressed = false;
+        // With `instrument`, the code counts into `profile` (its tables are
+        // resized to the program). Otherwise a profile of the same program
+        // puts the arm of an `if` that ran more often first, moves an arm that
+        // never ran past the function's ret, and emits labels by call count
+        // with the entries of called ones aligned to 16 bytes.
+        Profile *profile = nullptr;
+        bool instrument = false;
+        // Record a NodeRange for every pair and variable compiled (see SourceMap)
+        bool recordNodes = false;
+    };
 
     std::vector<uint8_t> _buf;
+    std::vector<Label> _labels;
+    std::vector<FrameChange> _frameChanges;
+    std::vector<Relocation> _relocations;
+    std::vector<NodeRange> _nodeRanges;
+    Options _options;
 };
 
 // Objects
@@ -69,6 +330,19 @@ namespace Objects
 
     constexpr unsigned int SymbolTag = 0b0000'0101;
 
+    // A vector is its length, as an encoded integer, followed by its
+    // elements. It takes an even number of words so the heap pointer stays
+    // 16 byte aligned relative to where it started.
+    constexpr unsigned int VectorTag = 0b0000'0010;
+    constexpr int8_t VectorLengthOffset = 0;
+    constexpr int8_t VectorElementsOffset = WordSize;
+
+    // A string is laid out like a vector, with bytes for elements, and is
+    // padded with zeros to a multiple of 16 bytes
+    constexpr unsigned int StringTag = 0b0000'0110;
+    constexpr int8_t StringLengthOffset = 0;
+    constexpr int8_t StringBytesOffset = WordSize;
+
     constexpr unsigned int ErrorTag = 0b0011'1111;
 
     constexpr int CarIndex = 0;
@@ -77,6 +351,18 @@ namespace Objects
     constexpr int8_t CdrOffset = CdrIndex * WordSize;
     constexpr int PairSize = CdrOffset + WordSize;
 
+    // With Buffer::Options::compressed, heap objects live in one 4 GiB
+    // aligned region and a pair holds its car and cdr in 32 bits each: heap
+    // objects as their offset in the region, tag included, and other values
+    // as their low 32 bits. That keeps any value whose encoding fits in an
+    // int32, so integers in pairs are limited to 30 bits.
+    constexpr int CompressedRefSize = 4;
+    constexpr int8_t CompressedCarOffset = 0;
+    constexpr int8_t CompressedCdrOffset = CompressedCarOffset + CompressedRefSize;
+    constexpr int CompressedPairSize = CompressedCdrOffset + CompressedRefSize;
+    constexpr int CompressedRegionBits = 32;
+    constexpr uword CompressedRegionSize = uword{1} << CompressedRegionBits;
+
     word encodeInteger(word value);
     word decodeInteger(word value);
 
@@ -91,11 +377,41 @@ namespace Objects
     uword address(const void *obj);
 
     uword error();
+
+    uint32_t compress(word value);
+    // `base` is the start of the region the heap objects are in
+    word decompress(uint32_t value, uword base);
+    // The start of the region holding the object at `address`
+    uword compressedBase(const void *address);
 } // namespace Objects
 
+// The heap for code compiled with Buffer::Options::compressed: a 4 GiB
+// aligned region, of which the first `size` bytes are committed
+class CompressedHeap final
+{
+public:
+    static constexpr size_t DefaultSize = size_t{64} << 20;
+
+    explicit CompressedHeap(size_t size = DefaultSize);
+    CompressedHeap(const CompressedHeap &) = delete;
+    CompressedHeap &operator=(const CompressedHeap &) = delete;
+    ~CompressedHeap();
+
+    uword *data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    void *_reservation{};
+    uword *_data{};
+    size_t _size;
+};
+
 // AST
 struct Pair;
+struct CompressedPair;
 struct Symbol;
+struct Vector;
+struct String;
 
 struct ASTNode final
 {
@@ -117,6 +433,8 @@ struct ASTNode final
     static ASTNode *newPair(ASTNode *car, ASTNode *cdr);
     bool isPair() const;
     Pair *asPair() const;
+    // Only for pairs that compressed code made
+    CompressedPair *asCompressedPair() const;
 
     static ASTNode *newSymbol(const std::string_view &name);
     bool isSymbol() const;
@@ -125,6 +443,13 @@ struct ASTNode final
     static ASTNode *newUnaryCall(const std::string_view &name, ASTNode *arg);
     static ASTNode *newBinaryCall(const std::string_view &name, ASTNode *arg1, ASTNode* arg2);
 
+    bool isVector() const;
+    Vector *asVector() const;
+
+    static ASTNode *newString(std::string_view text);
+    bool isString() const;
+    String *asString() const;
+
     static ASTNode* error();
     bool isError() const;
 };
@@ -139,17 +464,89 @@ struct Pair
     ASTNode *cdr{};
 };
 
+struct CompressedPair
+{
+    uint32_t car;
+    uint32_t cdr;
+
+    ASTNode *getCar() const { return reinterpret_cast<ASTNode *>(Objects::decompress(car, Objects::compressedBase(this))); }
+    ASTNode *getCdr() const { return reinterpret_cast<ASTNode *>(Objects::decompress(cdr, Objects::compressedBase(this))); }
+};
+
 struct Symbol
 {
     std::string str{};
 };
 
+// Only compiled code and the interpreter make vectors, on their heap
+struct Vector
+{
+    word length;
+
+    size_t size() const { return static_cast<size_t>(Objects::decodeInteger(length)); }
+    ASTNode *const *elements() const { return reinterpret_cast<ASTNode *const *>(this + 1); }
+};
+
+// Also made by the reader, for literals
+struct String
+{
+    word length;
+
+    size_t size() const { return static_cast<size_t>(Objects::decodeInteger(length)); }
+    const char *data() const { return reinterpret_cast<const char *>(this + 1); }
+    std::string_view view() const { return {data(), size()}; }
+    // Bytes taken by a string of `size` characters
+    static size_t allocationSize(size_t size) { return (sizeof(String) + size + 15) & ~size_t{15}; }
+};
+
+// The string primitives that are too long to compile inline. Compiled code
+// calls them like foreign functions; both use SSE2 to compare 16 bytes at a time.
+namespace Strings
+{
+    bool equal(ASTNode *left, ASTNode *right);
+    // The index of the first `c` in `string`, or -1
+    word index(ASTNode *string, char c);
+} // namespace Strings
+
+// What the compiler can prove about a value's tag
+enum class ValueKind : uint8_t
+{
+    Unknown,
+    Integer,
+    Char,
+    Bool,
+};
+
 struct Env{
     std::string name;
     word value;
     const Env* prev;
+    // For the compiler: the value is held in this register rather than at [rsp+value]
+    int8_t reg = -1;
+    // For the compiler: the tag the value is known to have
+    ValueKind kind = ValueKind::Unknown;
 
     std::optional<word> find(const std::string_view& name) const;
+    const Env *lookup(const std::string_view& name) const;
+};
+
+// The labels of a `labels` form. Every label can call every other one,
+// whatever order they are written in.
+struct LabelTable
+{
+    // Returns false if the name is already taken. Names are not copied.
+    bool add(std::string_view name, word address = 0);
+    std::optional<size_t> find(std::string_view name) const;
+
+    // Buffer offset of each label, or its absolute address with Buffer::Options::absoluteLabels
+    std::vector<word> addresses;
+
+private:
+    void rehash(size_t capacity);
+
+    std::vector<std::string_view> _names;
+    // Open addressing: label index + 1, or 0 for an empty bucket
+    std::vector<uint32_t> _buckets;
 };
 
 // Emit
@@ -165,6 +562,14 @@ namespace Emit
         Rbp,
         Rsi,
         Rdi,
+        R8,
+        R9,
+        R10,
+        R11,
+        R12,
+        R13,
+        R14,
+        R15,
     };
 
     enum PartialRegister : uint8_t
@@ -187,20 +592,29 @@ namespace Emit
         Equal = 4,    // Zero
         NotEqual = 5, // NotZero
 
+        BelowEqual = 6,
+
         Sign = 8,
+        NotSign = 9,
+        NotParity = 0xb, // ParityOdd
         Less = 0xc,
+        GreaterEqual = 0xd,
+        LessEqual = 0xe,
+        Greater = 0xf,
         // Etc. See https://c9x.me/x86/html/file_module_x86_id_288.html
     };
 
     struct Indirect{
         Register reg;
-        int8_t disp;
+        // Encoded as a disp8 where it fits, else a disp32
+        int32_t disp;
     };
 
     void movRegImm32(Buffer &buf, Register dst, int32_t src);
     void addRegImm32(Buffer &buf, Register dst, int32_t src);
     void shlRegImm8(Buffer &buf, Register dst, uint8_t src);
     void shrRegImm8(Buffer &buf, Register dst, uint8_t src);
+    void sarRegImm8(Buffer &buf, Register dst, uint8_t src);
     void orRegImm8(Buffer &buf, Register dst, uint8_t src);
     void andRegImm8(Buffer &buf, Register dst, uint8_t src);
     void cmpRegImm32(Buffer &buf, Register left, int32_t right);
@@ -217,11 +631,29 @@ namespace Emit
 
 namespace Compile
 {
-    int expr(Buffer &buf, ASTNode *node, word stackIndex, const Env* varEnv, const Env* labels);
+    int expr(Buffer &buf, ASTNode *node, word stackIndex, const Env* varEnv, const LabelTable* labels);
     int function(Buffer &buf, ASTNode *node);
-    int code(Buffer &buf, ASTNode *code, Env *labels);
+    int code(Buffer &buf, ASTNode *code, const LabelTable *labels);
+
+    // Shared slow path of every safepoint poll
+    const Code &safepointStub();
+    // Calls `function` from compiled code: converts the tagged arguments,
+    // which arrive like a label's, and tags the result
+    void foreignStub(Buffer &buf, const void *function, ForeignType result, const std::vector<ForeignType> &args);
+
+    // Size of the entry stub in front of each label when Buffer::Options::labelSlots is set
+    constexpr size_t LabelStubSize = 17;
+
+    // How labels are called: the first RegisterArgs arguments arrive in
+    // r8-r11 and the others at [rsp-8*(i+1)], below the return address, as
+    // if all of them had been stored there. The result is returned in rax,
+    // and rsi, the heap pointer, comes back past whatever the callee
+    // allocated. rdi holds the SafepointControl when compiled with
+    // safepoints. r8-r11 and rdx do not survive a call.
+    constexpr size_t RegisterArgs = 4;
 } // namespace Compile
 
 namespace Reader{
-    std::unique_ptr<ASTNode, decltype(&heapFree)> read(std::string&& input);
+    // With `spans`, records where each form came from
+    std::unique_ptr<ASTNode, decltype(&heapFree)> read(std::string&& input, SourceSpans *spans = nullptr);
 }
\ No newline at end of file
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "alisp.h"
+#include "interp.h"
+
+// Every allocation made by the process goes through here, so a benchmark
+// can report how many allocations a single operation costs.
+static uint64_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    if (auto ptr = std::malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+using Clock = std::chrono::steady_clock;
+
+struct Sample
+{
+    Clock::duration elapsed{};
+    uint64_t bytes{};
+    uint64_t allocations{};
+};
+
+// Measures the code between construction and `stop`. Setup and teardown
+// of a batch must happen outside of that window.
+struct Probe
+{
+    Sample stop(uint64_t bytes) const
+    {
+        return Sample{Clock::now() - start, bytes, allocations - startAllocations};
+    }
+
+    Clock::time_point start = Clock::now();
+    uint64_t startAllocations = allocations;
+};
+
+using Bench = Sample (*)(const std::string &source, size_t iterations);
+
+static Sample benchRead(const std::string &source, size_t iterations)
+{
+    std::vector<std::string> inputs(iterations, source);
+    std::vector<std::unique_ptr<ASTNode, decltype(&heapFree)>> nodes;
+    nodes.reserve(iterations);
+
+    Probe probe;
+    for (auto &input : inputs)
+    {
+        nodes.push_back(Reader::read(std::move(input)));
+    }
+    return probe.stop(0);
+}
+
+static Sample benchCompile(const std::string &source, size_t iterations)
+{
+    auto node = Reader::read(std::string{source});
+    std::vector<Buffer> buffers(iterations);
+
+    Probe probe;
+    uint64_t bytes = 0;
+    for (auto &buf : buffers)
+    {
+        if (Compile::function(buf, node.get()) != 0)
+        {
+            fmt::print(stderr, "compile error\n");
+            std::exit(1);
+        }
+        bytes += buf.size();
+    }
+    return probe.stop(bytes);
+}
+
+static Sample benchFreeze(const std::string &source, size_t iterations)
+{
+    auto node = Reader::read(std::string{source});
+    Buffer buf;
+    Compile::function(buf, node.get());
+    std::vector<Code> codes;
+    codes.reserve(iterations);
+
+    Probe probe;
+    for (auto i = 0u; i < iterations; ++i)
+    {
+        codes.push_back(buf.freeze());
+    }
+    return probe.stop(buf.size() * iterations);
+}
+
+static Sample benchInterpret(const std::string &source, size_t iterations)
+{
+    auto node = Reader::read(std::string{source});
+    std::vector<uword> heap(1 << 12);
+
+    Probe probe;
+    for (auto i = 0u; i < iterations; ++i)
+    {
+        Interp::run(node.get(), heap.data());
+    }
+    return probe.stop(0);
+}
+
+static Sample benchHeapFree(const std::string &source, size_t iterations)
+{
+    std::vector<ASTNode *> nodes;
+    nodes.reserve(iterations);
+    for (auto i = 0u; i < iterations; ++i)
+    {
+        nodes.push_back(Reader::read(std::string{source}).release());
+    }
+
+    Probe probe;
+    for (auto node : nodes)
+    {
+        heapFree(node);
+    }
+    return probe.stop(0);
+}
+
+// A `labels` program where every label calls the previous one, so both the
+// number of labels and the depth of the label environment grow with `count`.
+static std::string generateLabels(int count)
+{
+    std::string source = "(labels ((f0 (code (x) x))";
+    for (int i = 1; i < count; ++i)
+    {
+        source += fmt::format(" (f{} (code (x) (labelcall f{} (add1 x))))", i, i - 1);
+    }
+    source += fmt::format(") (labelcall f{} 0))", count - 1);
+    return source;
+}
+
+struct Input
+{
+    const char *name;
+    std::string source;
+};
+
+struct Phase
+{
+    const char *name;
+    Bench bench;
+};
+
+// Doubles the batch until it runs long enough to be timed reliably, then
+// reports the median of several batches.
+static void run(const Phase &phase, const Input &input, int samples)
+{
+    using namespace std::chrono;
+    constexpr auto MinBatchTime = milliseconds(20);
+
+    size_t iterations = 1;
+    while (phase.bench(input.source, iterations).elapsed < MinBatchTime && iterations < (1u << 20))
+    {
+        iterations *= 2;
+    }
+
+    std::vector<Sample> results;
+    for (int i = 0; i < samples; ++i)
+    {
+        results.push_back(phase.bench(input.source, iterations));
+    }
+    std::sort(results.begin(), results.end(), [](const Sample &a, const Sample &b) { return a.elapsed < b.elapsed; });
+    auto &median = results[results.size() / 2];
+
+    auto nsPerOp = static_cast<double>(duration_cast<nanoseconds>(median.elapsed).count()) / iterations;
+    fmt::print("{:<10} {:<8} {:>14.1f} {:>12.1f} {:>12.2f}\n",
+               phase.name, input.name, nsPerOp,
+               static_cast<double>(median.bytes) / iterations,
+               static_cast<double>(median.allocations) / iterations);
+}
+
+int main(int argc, char *argv[])
+{
+    // Usage: bench-alisp [filter] [samples]
+    std::string filter = argc > 1 ? argv[1] : "";
+    int samples = argc > 2 ? std::max(1, std::atoi(argv[2])) : 7;
+
+    const Input inputs[] = {
+        {"small", "(+ 1 2)"},
+        {"medium", "(labels ((factorial (code (x) "
+                   "            (if (< x 2) 1 (* x (labelcall factorial (- x 1)))))))"
+                   "    (labelcall factorial 5))"},
+        {"huge", generateLabels(1000)},
+    };
+    const Phase phases[] = {
+        {"read", &benchRead},
+        {"compile", &benchCompile},
+        {"freeze", &benchFreeze},
+        {"interpret", &benchInterpret},
+        {"heapFree", &benchHeapFree},
+    };
+
+    fmt::print("{:<10} {:<8} {:>14} {:>12} {:>12}\n", "phase", "input", "ns/op", "bytes/op", "allocs/op");
+    for (auto &phase : phases)
+    {
+        for (auto &input : inputs)
+        {
+            auto name = std::string{phase.name} + "/" + input.name;
+            if (name.find(filter) == std::string::npos)
+            {
+                continue;
+            }
+            run(phase, input, samples);
+        }
+    }
+    return 0;
+}
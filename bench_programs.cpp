@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+#include <fmt/core.h>
+
+#include "alisp.h"
+
+// Classic workloads written in the language the compiler supports.
+// `expected` is the decoded integer result, so a miscompile fails the run
+// before its timing is even looked at.
+struct Program
+{
+    const char *name;
+    const char *source;
+    word expected;
+};
+
+static const Program corpus[] = {
+    {"fib",
+     "(labels ((fib (code (n)"
+     "            (if (< n 2) n (+ (labelcall fib (- n 1)) (labelcall fib (- n 2)))))))"
+     "    (labelcall fib 25))",
+     75025},
+    {"tak",
+     "(labels ((tak (code (x y z)"
+     "            (if (not (< y x))"
+     "                z"
+     "                (labelcall tak (labelcall tak (- x 1) y z)"
+     "                               (labelcall tak (- y 1) z x)"
+     "                               (labelcall tak (- z 1) x y))))))"
+     "    (labelcall tak 18 12 6))",
+     7},
+    {"ackermann",
+     "(labels ((ack (code (m n)"
+     "            (if (zero? m)"
+     "                (add1 n)"
+     "                (if (zero? n)"
+     "                    (labelcall ack (sub1 m) 1)"
+     "                    (labelcall ack (sub1 m) (labelcall ack m (sub1 n))))))))"
+     "    (labelcall ack 2 300))",
+     603},
+    {"list-sum",
+     "(labels ((build (code (n) (if (zero? n) () (cons n (labelcall build (sub1 n))))))"
+     "         (sum (code (l) (if (nil? l) 0 (+ (car l) (labelcall sum (cdr l)))))))"
+     "    (labelcall sum (labelcall build 5000)))",
+     12502500},
+    {"list-reverse",
+     "(labels ((build (code (n) (if (zero? n) () (cons n (labelcall build (sub1 n))))))"
+     "         (rev (code (l acc) (if (nil? l) acc (labelcall rev (cdr l) (cons (car l) acc)))))"
+     "         (len (code (l) (if (nil? l) 0 (add1 (labelcall len (cdr l)))))))"
+     "    (let ((l (labelcall rev (labelcall build 5000) ())))"
+     "      (+ (car l) (labelcall len l))))",
+     5001},
+};
+
+// Every label calls the previous one: a deep chain of distinct `labelcall`s.
+static std::string labelChain(int count)
+{
+    std::string source = "(labels ((f0 (code (x) x))";
+    for (int i = 1; i < count; ++i)
+    {
+        source += fmt::format(" (f{} (code (x) (labelcall f{} (add1 x))))", i, i - 1);
+    }
+    source += fmt::format(") (labelcall f{} 0))", count - 1);
+    return source;
+}
+
+using Clock = std::chrono::steady_clock;
+
+struct Measurement
+{
+    double nsPerRun{};
+    double cyclesPerRun{};
+};
+
+static uint64_t threadCycles()
+{
+    ULONG64 cycles = 0;
+    QueryThreadCycleTime(GetCurrentThread(), &cycles);
+    return cycles;
+}
+
+// Compiles the program once and reports the median of `samples` batches,
+// each batch long enough to be timed reliably.
+static std::optional<Measurement> measure(const std::string &name, const std::string &source, word expected, int samples)
+{
+    auto node = Reader::read(std::string{source});
+    Buffer buf;
+    if (node->isError() || Compile::function(buf, node.get()) != 0)
+    {
+        fmt::print(stderr, "{}: compile error\n", name);
+        return {};
+    }
+    auto code = buf.freeze();
+    auto entry = code.toFunc<ASTNode *(uword *)>();
+    std::vector<uword> heap(1 << 16);
+
+    auto result = entry(heap.data());
+    if (!result->isInteger() || result->getInteger() != expected)
+    {
+        fmt::print(stderr, "{}: wrong result\n", name);
+        return {};
+    }
+
+    using namespace std::chrono;
+    size_t runs = 1;
+    for (;; runs *= 2)
+    {
+        auto start = Clock::now();
+        for (auto i = 0u; i < runs; ++i)
+        {
+            entry(heap.data());
+        }
+        if (Clock::now() - start >= milliseconds(10))
+        {
+            break;
+        }
+    }
+
+    std::vector<Measurement> batches;
+    for (int s = 0; s < samples; ++s)
+    {
+        auto cycles = threadCycles();
+        auto start = Clock::now();
+        for (auto i = 0u; i < runs; ++i)
+        {
+            entry(heap.data());
+        }
+        auto elapsed = duration_cast<nanoseconds>(Clock::now() - start).count();
+        cycles = threadCycles() - cycles;
+        batches.push_back({static_cast<double>(elapsed) / runs, static_cast<double>(cycles) / runs});
+    }
+    std::sort(batches.begin(), batches.end(),
+              [](const Measurement &a, const Measurement &b) { return a.nsPerRun < b.nsPerRun; });
+    return batches[batches.size() / 2];
+}
+
+// Baseline file: one `name ns-per-run` pair per line, `#` starts a comment.
+static std::map<std::string, double> readBaseline(const std::string &path)
+{
+    std::map<std::string, double> baseline;
+    std::ifstream in{path};
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        std::istringstream fields{line};
+        std::string name;
+        double ns;
+        if (fields >> name >> ns)
+        {
+            baseline[name] = ns;
+        }
+    }
+    return baseline;
+}
+
+static void writeBaseline(const std::string &path, const std::map<std::string, double> &results)
+{
+    std::ofstream out{path};
+    out << "# bench-programs baseline: program ns-per-run\n";
+    out << "# Regenerate with `bench-programs --baseline <this file> --update`\n";
+    for (auto &[name, ns] : results)
+    {
+        out << name << ' ' << static_cast<uint64_t>(ns) << '\n';
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // Usage: bench-programs [--baseline FILE] [--update] [--tolerance PERCENT] [--samples N]
+    std::string baselinePath;
+    bool update = false;
+    double tolerance = 50;
+    int samples = 9;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--baseline" && i + 1 < argc)
+        {
+            baselinePath = argv[++i];
+        }
+        else if (arg == "--update")
+        {
+            update = true;
+        }
+        else if (arg == "--tolerance" && i + 1 < argc)
+        {
+            tolerance = std::atof(argv[++i]);
+        }
+        else if (arg == "--samples" && i + 1 < argc)
+        {
+            samples = std::max(1, std::atoi(argv[++i]));
+        }
+        else
+        {
+            fmt::print(stderr, "unknown argument: {}\n", arg);
+            return 2;
+        }
+    }
+
+    std::vector<Program> programs(std::begin(corpus), std::end(corpus));
+    auto chain = labelChain(200);
+    programs.push_back({"labelcall-chain", chain.c_str(), 199});
+
+    auto baseline = baselinePath.empty() || update ? std::map<std::string, double>{} : readBaseline(baselinePath);
+    std::map<std::string, double> results;
+    bool failed = false;
+
+    fmt::print("{:<16} {:>14} {:>14} {:>14} {:>8}\n", "program", "ns/run", "cycles/run", "baseline", "ratio");
+    for (auto &program : programs)
+    {
+        auto measurement = measure(program.name, program.source, program.expected, samples);
+        if (!measurement)
+        {
+            failed = true;
+            continue;
+        }
+        results[program.name] = measurement->nsPerRun;
+
+        auto found = baseline.find(program.name);
+        if (found == baseline.end())
+        {
+            fmt::print("{:<16} {:>14.0f} {:>14.0f} {:>14} {:>8}\n",
+                       program.name, measurement->nsPerRun, measurement->cyclesPerRun, "-", "-");
+            continue;
+        }
+        auto ratio = measurement->nsPerRun / found->second;
+        auto regressed = ratio > 1 + tolerance / 100;
+        fmt::print("{:<16} {:>14.0f} {:>14.0f} {:>14.0f} {:>7.2f}x{}\n",
+                   program.name, measurement->nsPerRun, measurement->cyclesPerRun, found->second, ratio,
+                   regressed ? " REGRESSION" : "");
+        failed |= regressed;
+    }
+
+    if (update && !baselinePath.empty())
+    {
+        writeBaseline(baselinePath, results);
+    }
+    return failed ? 1 : 0;
+}
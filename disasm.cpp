@@ -0,0 +1,604 @@
+#include "disasm.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+
+namespace Disasm
+{
+    namespace
+    {
+        const char *const Registers64[16] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                             "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+        const char *const Registers32[16] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                                             "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+        const char *const Registers8[16] = {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+                                            "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
+        const char *const Conditions[16] = {"o", "no", "b", "ae", "e", "ne", "be", "a",
+                                            "s", "ns", "p", "np", "l", "ge", "le", "g"};
+        // By the reg field of ModRM (or bits 3-5 of the opcode for 00-3f)
+        const char *const Group1[8] = {"add", "or", "adc", "sbb", "and", "sub", "xor", "cmp"};
+        const char *const Group2[8] = {"rol", "ror", "rcl", "rcr", "shl", "shr", "sal", "sar"};
+        const char *const Group3[8] = {"test", "test", "not", "neg", "mul", "imul", "div", "idiv"};
+
+        enum Width
+        {
+            Byte,
+            Dword,
+            Qword,
+            Xmm,
+            Ymm,
+        };
+
+        // Small numbers in decimal, the rest (addresses, tags, magic numbers) in hex
+        std::string number(int64_t value)
+        {
+            char text[32];
+            if (value > -4096 && value < 4096)
+            {
+                std::snprintf(text, sizeof(text), "%lld", static_cast<long long>(value));
+            }
+            else if (value < 0)
+            {
+                std::snprintf(text, sizeof(text), "-0x%llx", static_cast<unsigned long long>(-static_cast<uint64_t>(value)));
+            }
+            else
+            {
+                std::snprintf(text, sizeof(text), "0x%llx", static_cast<unsigned long long>(value));
+            }
+            return text;
+        }
+
+        std::string registerName(uint8_t reg, Width width)
+        {
+            switch (width)
+            {
+            case Byte:
+                return Registers8[reg];
+            case Dword:
+                return Registers32[reg];
+            case Qword:
+                return Registers64[reg];
+            case Xmm:
+                return "xmm" + std::to_string(reg);
+            case Ymm:
+                return "ymm" + std::to_string(reg);
+            }
+            return {};
+        }
+
+        // The r/m operand of a ModRM byte: a register or a memory address
+        struct Operand
+        {
+            bool isRegister;
+            uint8_t reg;
+            std::string address;
+
+            // `sized` spells out the width of memory, for instructions
+            // that have no register operand to imply it
+            std::string text(Width width, bool sized = false) const
+            {
+                if (isRegister)
+                {
+                    return registerName(reg, width);
+                }
+                if (!sized)
+                {
+                    return address;
+                }
+                static const char *const Sizes[] = {"byte ", "dword ", "qword ", "xmmword ", "ymmword "};
+                return Sizes[width] + address;
+            }
+        };
+
+        class Decoder final
+        {
+        public:
+            Decoder(const uint8_t *code, size_t size, size_t offset) : _code{code}, _size{size}, _pos{offset} {}
+
+            std::string instruction();
+            bool ok() const { return _ok; }
+            size_t pos() const { return _pos; }
+            const std::optional<size_t> &target() const { return _target; }
+
+        private:
+            uint8_t next8()
+            {
+                if (_pos >= _size)
+                {
+                    _ok = false;
+                    return 0;
+                }
+                return _code[_pos++];
+            }
+            int32_t next32()
+            {
+                uint32_t value = 0;
+                for (int i = 0; i < 4; ++i)
+                {
+                    value |= static_cast<uint32_t>(next8()) << (8 * i);
+                }
+                return static_cast<int32_t>(value);
+            }
+            int64_t next64()
+            {
+                auto low = static_cast<uint32_t>(next32());
+                auto high = static_cast<uint32_t>(next32());
+                return static_cast<int64_t>((static_cast<uint64_t>(high) << 32) | low);
+            }
+
+            // Reads ModRM and whatever SIB and displacement follow it. The
+            // reg field goes to `reg`, extended by REX.R.
+            Operand modrm(uint8_t &reg);
+            // jmp, jcc and call: `rel` counts from the end of the instruction
+            std::string branch(const std::string &mnemonic, int32_t rel);
+            std::string twoByte(uint8_t rex);
+            std::string vex(uint8_t first);
+
+            const uint8_t *_code;
+            size_t _size;
+            size_t _pos;
+            bool _ok = true;
+            // REX.R, REX.X and REX.B, or the same bits of a VEX prefix
+            uint8_t _extend = 0;
+            std::optional<size_t> _target;
+        };
+
+        Operand Decoder::modrm(uint8_t &reg)
+        {
+            auto byte = next8();
+            auto mod = byte >> 6;
+            auto rm = static_cast<uint8_t>((byte & 7) | ((_extend & 1) << 3));
+            reg = static_cast<uint8_t>(((byte >> 3) & 7) | ((_extend & 4) << 1));
+            if (mod == 3)
+            {
+                return {true, rm, {}};
+            }
+            std::string address = "[";
+            auto hasBase = true;
+            if ((rm & 7) == 4)
+            {
+                auto sib = next8();
+                auto index = static_cast<uint8_t>(((sib >> 3) & 7) | ((_extend & 2) << 2));
+                auto base = static_cast<uint8_t>((sib & 7) | ((_extend & 1) << 3));
+                hasBase = !(mod == 0 && (base & 7) == 5);
+                if (hasBase)
+                {
+                    address += Registers64[base];
+                }
+                if (index != 4)
+                {
+                    address += hasBase ? "+" : "";
+                    address += Registers64[index];
+                    if (sib >> 6)
+                    {
+                        address += "*" + std::to_string(1 << (sib >> 6));
+                    }
+                }
+            }
+            else if (mod == 0 && (rm & 7) == 5)
+            {
+                address += "rip";
+            }
+            else
+            {
+                address += Registers64[rm];
+            }
+            int32_t disp = 0;
+            if (mod == 1)
+            {
+                disp = static_cast<int8_t>(next8());
+            }
+            else if (mod == 2 || (mod == 0 && (rm & 7) == 5) || !hasBase)
+            {
+                disp = next32();
+            }
+            if (disp || !hasBase)
+            {
+                address += (disp < 0 || address.size() == 1) ? "" : "+";
+                address += number(disp);
+            }
+            return {false, 0, address + "]"};
+        }
+
+        std::string Decoder::branch(const std::string &mnemonic, int32_t rel)
+        {
+            auto destination = static_cast<int64_t>(_pos) + rel;
+            if (_ok && destination >= 0 && static_cast<size_t>(destination) < _size)
+            {
+                _target = static_cast<size_t>(destination);
+            }
+            char text[32];
+            std::snprintf(text, sizeof(text), "0x%llx", static_cast<unsigned long long>(destination));
+            return mnemonic + " " + text;
+        }
+
+        std::string Decoder::instruction()
+        {
+            uint8_t rex = 0;
+            auto op = next8();
+            if ((op & 0xf0) == 0x40)
+            {
+                rex = op;
+                _extend = rex & 7;
+                op = next8();
+            }
+            auto width = (rex & 8) ? Qword : Dword;
+            uint8_t reg;
+            if (op < 0x40 && ((op & 7) == 1 || (op & 7) == 3))
+            {
+                auto rm = modrm(reg);
+                auto name = std::string{Group1[op >> 3]} + " ";
+                return (op & 7) == 1 ? name + rm.text(width) + ", " + registerName(reg, width)
+                                     : name + registerName(reg, width) + ", " + rm.text(width);
+            }
+            if (op < 0x40 && (op & 7) == 5)
+            {
+                return std::string{Group1[op >> 3]} + " " + registerName(0, width) + ", " + number(next32());
+            }
+            if (op >= 0x50 && op < 0x60)
+            {
+                return std::string{op < 0x58 ? "push " : "pop "} + Registers64[(op & 7) | ((rex & 1) << 3)];
+            }
+            if (op >= 0x70 && op < 0x80)
+            {
+                auto rel = static_cast<int8_t>(next8());
+                return branch(std::string{"j"} + Conditions[op & 0xf], rel);
+            }
+            if (op >= 0xb8 && op < 0xc0)
+            {
+                auto dst = static_cast<uint8_t>((op & 7) | ((rex & 1) << 3));
+                if (width == Qword)
+                {
+                    return "movabs " + registerName(dst, Qword) + ", " + number(next64());
+                }
+                return "mov " + registerName(dst, Dword) + ", " + number(static_cast<uint32_t>(next32()));
+            }
+            switch (op)
+            {
+            case 0x0f:
+                return twoByte(rex);
+            case 0x63:
+            {
+                auto rm = modrm(reg);
+                return "movsxd " + registerName(reg, width) + ", " + rm.text(Dword, true);
+            }
+            case 0x69:
+            case 0x6b:
+            {
+                auto rm = modrm(reg);
+                auto imm = op == 0x6b ? static_cast<int8_t>(next8()) : next32();
+                return "imul " + registerName(reg, width) + ", " + rm.text(width) + ", " + number(imm);
+            }
+            case 0x80:
+            case 0x81:
+            case 0x83:
+            {
+                auto rm = modrm(reg);
+                auto immWidth = op == 0x80 ? Byte : width;
+                auto imm = op == 0x81 ? next32() : static_cast<int8_t>(next8());
+                return std::string{Group1[reg & 7]} + " " + rm.text(immWidth, true) + ", " + number(imm);
+            }
+            case 0x85:
+            case 0x89:
+            {
+                auto rm = modrm(reg);
+                return std::string{op == 0x85 ? "test " : "mov "} + rm.text(width) + ", " + registerName(reg, width);
+            }
+            case 0x8b:
+            case 0x8d:
+            {
+                auto rm = modrm(reg);
+                return std::string{op == 0x8b ? "mov " : "lea "} + registerName(reg, width) + ", " + rm.text(width);
+            }
+            case 0x90:
+                return "nop";
+            case 0x99:
+                return width == Qword ? "cqo" : "cdq";
+            case 0xa8:
+                return "test al, " + number(next8());
+            case 0xc1:
+            {
+                auto rm = modrm(reg);
+                return std::string{Group2[reg & 7]} + " " + rm.text(width, true) + ", " + number(next8());
+            }
+            case 0xc3:
+                return "ret";
+            case 0xc7:
+            {
+                auto rm = modrm(reg);
+                if (reg & 7)
+                {
+                    break;
+                }
+                return "mov " + rm.text(width, true) + ", " + number(next32());
+            }
+            case 0xcc:
+                return "int3";
+            case 0xe8:
+                return branch("call", next32());
+            case 0xe9:
+                return branch("jmp", next32());
+            case 0xeb:
+                return branch("jmp", static_cast<int8_t>(next8()));
+            case 0xf7:
+            {
+                auto rm = modrm(reg);
+                auto text = std::string{Group3[reg & 7]} + " " + rm.text(width, true);
+                return (reg & 7) < 2 ? text + ", " + number(next32()) : text;
+            }
+            case 0xff:
+            {
+                static const char *const Group5[8] = {"inc", "dec", "call", nullptr, "jmp", nullptr, "push", nullptr};
+                auto rm = modrm(reg);
+                if (!Group5[reg & 7])
+                {
+                    break;
+                }
+                // Calls, jumps and pushes are always 64 bit
+                auto operandWidth = (reg & 7) < 2 ? width : Qword;
+                return std::string{Group5[reg & 7]} + " " + rm.text(operandWidth, true);
+            }
+            case 0xc4:
+            case 0xc5:
+                if (!rex)
+                {
+                    return vex(op);
+                }
+                break;
+            }
+            _ok = false;
+            return {};
+        }
+
+        std::string Decoder::twoByte(uint8_t rex)
+        {
+            auto width = (rex & 8) ? Qword : Dword;
+            auto op = next8();
+            uint8_t reg;
+            if (op >= 0x40 && op < 0x50)
+            {
+                auto rm = modrm(reg);
+                return std::string{"cmov"} + Conditions[op & 0xf] + " " + registerName(reg, width) + ", " + rm.text(width);
+            }
+            if (op >= 0x80 && op < 0x90)
+            {
+                return branch(std::string{"j"} + Conditions[op & 0xf], next32());
+            }
+            if (op >= 0x90 && op < 0xa0)
+            {
+                auto rm = modrm(reg);
+                return std::string{"set"} + Conditions[op & 0xf] + " " + rm.text(Byte, true);
+            }
+            if (op == 0xaf)
+            {
+                auto rm = modrm(reg);
+                return "imul " + registerName(reg, width) + ", " + rm.text(width);
+            }
+            if (op == 0xb6)
+            {
+                auto rm = modrm(reg);
+                return "movzx " + registerName(reg, width) + ", " + rm.text(Byte, true);
+            }
+            _ok = false;
+            return {};
+        }
+
+        std::string Decoder::vex(uint8_t first)
+        {
+            uint8_t map = 1;
+            auto wide = false;
+            auto byte = next8();
+            _extend = static_cast<uint8_t>((~byte >> 5) & 4);
+            if (first == 0xc4)
+            {
+                _extend |= (~byte >> 5) & 3;
+                map = byte & 0x1f;
+                byte = next8();
+                wide = byte >> 7;
+            }
+            auto src1 = static_cast<uint8_t>((~byte >> 3) & 0xf);
+            auto vector = (byte & 4) ? Ymm : Xmm;
+            auto prefix = byte & 3;
+            auto op = next8();
+            uint8_t reg;
+            // Opcode, map and prefix (none, 66, f3, f2) in one number
+            switch ((map << 16) | (prefix << 8) | op)
+            {
+            case 0x10077:
+                return vector == Ymm ? "vzeroall" : "vzeroupper";
+            case 0x101ef:
+            case 0x101d4:
+            case 0x101f4:
+            {
+                auto rm = modrm(reg);
+                auto name = op == 0xef ? "vpxor " : op == 0xd4 ? "vpaddq " : "vpmuludq ";
+                return name + registerName(reg, vector) + ", " + registerName(src1, vector) + ", " + rm.text(vector);
+            }
+            case 0x10173:
+            {
+                static const char *const Shifts[8] = {nullptr, nullptr, "vpsrlq", "vpsrldq", nullptr, nullptr, "vpsllq", "vpslldq"};
+                auto rm = modrm(reg);
+                if (!Shifts[reg & 7])
+                {
+                    break;
+                }
+                return std::string{Shifts[reg & 7]} + " " + registerName(src1, vector) + ", " + rm.text(vector) + ", " + number(next8());
+            }
+            case 0x10170:
+            {
+                auto rm = modrm(reg);
+                return "vpshufd " + registerName(reg, vector) + ", " + rm.text(vector) + ", " + number(next8());
+            }
+            case 0x1017e:
+            {
+                auto rm = modrm(reg);
+                return std::string{wide ? "vmovq " : "vmovd "} + rm.text(wide ? Qword : Dword) + ", " + registerName(reg, Xmm);
+            }
+            case 0x1026f:
+            case 0x1027f:
+            {
+                auto rm = modrm(reg);
+                return op == 0x6f ? "vmovdqu " + registerName(reg, vector) + ", " + rm.text(vector)
+                                  : "vmovdqu " + rm.text(vector) + ", " + registerName(reg, vector);
+            }
+            case 0x20159:
+            {
+                auto rm = modrm(reg);
+                return "vpbroadcastq " + registerName(reg, vector) + ", " + rm.text(Xmm);
+            }
+            case 0x30139:
+            {
+                auto rm = modrm(reg);
+                return "vextracti128 " + rm.text(Xmm) + ", " + registerName(reg, vector) + ", " + number(next8());
+            }
+            }
+            _ok = false;
+            return {};
+        }
+
+        // What a form compiles: its primitive, or `variable`
+        std::string kind(const ASTNode *node)
+        {
+            if (!node->isPair())
+            {
+                return "variable";
+            }
+            auto head = node->asPair()->car;
+            return head->isSymbol() ? head->asSymbol()->str : "pair";
+        }
+    } // namespace
+
+    Instruction decode(const uint8_t *code, size_t size, size_t offset)
+    {
+        Decoder decoder{code, size, offset};
+        auto text = decoder.instruction();
+        if (!decoder.ok())
+        {
+            char bad[32];
+            std::snprintf(bad, sizeof(bad), "(bad) 0x%02x", code[offset]);
+            return {offset, 1, bad, std::nullopt};
+        }
+        return {offset, decoder.pos() - offset, std::move(text), decoder.target()};
+    }
+
+    std::vector<Instruction> decode(const std::vector<uint8_t> &code)
+    {
+        std::vector<Instruction> result;
+        for (size_t offset = 0; offset < code.size(); offset = result.back().offset + result.back().size)
+        {
+            result.push_back(decode(code.data(), code.size(), offset));
+        }
+        return result;
+    }
+
+    std::string listing(const Buffer &buf)
+    {
+        auto instructions = decode(buf._buf);
+        // Jumps to the start of a label use its name, other targets a local label
+        std::map<size_t, std::string> names;
+        for (auto &label : buf._labels)
+        {
+            names[label.offset] = label.name;
+        }
+        std::map<size_t, std::string> locals;
+        for (auto &instruction : instructions)
+        {
+            if (instruction.target && !names.count(*instruction.target))
+            {
+                locals[*instruction.target];
+            }
+        }
+        size_t count = 0;
+        for (auto &local : locals)
+        {
+            local.second = ".L" + std::to_string(++count);
+        }
+
+        std::string result;
+        auto label = buf._labels.begin();
+        for (auto &instruction : instructions)
+        {
+            for (; label != buf._labels.end() && label->offset <= instruction.offset; ++label)
+            {
+                result += label->name + ":\n";
+            }
+            auto local = locals.find(instruction.offset);
+            if (local != locals.end())
+            {
+                result += local->second + ":\n";
+            }
+            char line[64];
+            auto length = std::snprintf(line, sizeof(line), "  %04zx  ", instruction.offset);
+            for (size_t i = 0; i < instruction.size; ++i)
+            {
+                length += std::snprintf(line + length, sizeof(line) - length, "%02x ", buf._buf[instruction.offset + i]);
+            }
+            result += line;
+            // Room for a movabs
+            result.append(length < 40 ? 40 - length : 1, ' ');
+            if (instruction.target)
+            {
+                auto name = names.count(*instruction.target) ? names[*instruction.target] : locals[*instruction.target];
+                result += instruction.text.substr(0, instruction.text.find(' ')) + " " + name;
+            }
+            else
+            {
+                result += instruction.text;
+            }
+            result += '\n';
+        }
+        return result;
+    }
+
+    std::vector<KindSize> sizes(const Buffer &buf)
+    {
+        auto ranges = buf._nodeRanges;
+        std::sort(ranges.begin(), ranges.end(), [](const Buffer::NodeRange &a, const Buffer::NodeRange &b) {
+            return a.begin != b.begin ? a.begin < b.begin : a.end > b.end;
+        });
+        // The bytes of each range that no range inside it covers
+        std::vector<size_t> own(ranges.size());
+        std::vector<size_t> open;
+        // Bytes in some range, and the end of the ranges so far
+        size_t covered = 0;
+        size_t reach = 0;
+        for (size_t i = 0; i < ranges.size(); ++i)
+        {
+            auto &range = ranges[i];
+            own[i] = range.end - range.begin;
+            while (!open.empty() && ranges[open.back()].end <= range.begin)
+            {
+                open.pop_back();
+            }
+            if (!open.empty())
+            {
+                own[open.back()] -= std::min(range.end, ranges[open.back()].end) - range.begin;
+            }
+            open.push_back(i);
+            if (range.end > reach)
+            {
+                covered += range.end - std::max(range.begin, reach);
+                reach = range.end;
+            }
+        }
+
+        std::map<std::string, KindSize> kinds;
+        for (size_t i = 0; i < ranges.size(); ++i)
+        {
+            auto name = kind(ranges[i].node);
+            auto &size = kinds.try_emplace(name, KindSize{name, 0, 0}).first->second;
+            ++size.forms;
+            size.bytes += own[i];
+        }
+        kinds["(other)"] = {"(other)", 0, buf.size() - covered};
+
+        std::vector<KindSize> result;
+        for (auto &entry : kinds)
+        {
+            result.push_back(entry.second);
+        }
+        std::stable_sort(result.begin(), result.end(), [](const KindSize &a, const KindSize &b) { return a.bytes > b.bytes; });
+        return result;
+    }
+} // namespace Disasm
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "alisp.h"
+
+// Disasm: decodes the x86-64 that Emit writes, so compiled code can be read
+// without an external disassembler. Bytes outside that subset decode as a
+// one byte `(bad)`.
+namespace Disasm
+{
+    struct Instruction
+    {
+        size_t offset;
+        size_t size;
+        // Intel syntax, e.g. `mov [rsi+8], rax`
+        std::string text;
+        // Where a jump or call inside the code goes
+        std::optional<size_t> target;
+    };
+
+    Instruction decode(const uint8_t *code, size_t size, size_t offset);
+    std::vector<Instruction> decode(const std::vector<uint8_t> &code);
+
+    // One instruction per line with its offset and bytes. Labels of the
+    // buffer start a line of their own, and jump targets get local labels.
+    std::string listing(const Buffer &buf);
+
+    // The code of the forms of one kind: `+`, `car`, `if` and so on for
+    // pairs, `variable` for symbols, and `(other)` for code outside any form
+    // (prologues, label stubs, padding).
+    struct KindSize
+    {
+        std::string kind;
+        size_t forms;
+        size_t bytes;
+    };
+
+    // Needs a buffer compiled with Buffer::Options::recordNodes. Each byte
+    // counts once, for the innermost form whose code covers it. Largest first.
+    std::vector<KindSize> sizes(const Buffer &buf);
+} // namespace Disasm
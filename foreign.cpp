@@ -0,0 +1,18 @@
+#include "foreign.h"
+
+int Foreign::add(const std::string &name, const void *function, ForeignType result, const std::vector<ForeignType> &args)
+{
+    if (args.size() > Compile::RegisterArgs || _table.find(name))
+    {
+        return -1;
+    }
+    Buffer buf;
+    buf._labels.push_back({"foreign." + name, 0});
+    Compile::foreignStub(buf, function, result, args);
+
+    _stubs.push_back(buf.freeze(_arena));
+    _arities.push_back(args.size());
+    _names.push_back(name);
+    _table.add(_names.back());
+    return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "alisp.h"
+
+#include <deque>
+#include <type_traits>
+
+// Foreign: C++ functions that compiled code calls with
+// `(foreign-call name args...)`. Each one gets a stub that converts the
+// tagged arguments to the declared C++ types, calls the function by the
+// Win64 ABI and tags what it returns. Arguments are not type checked: a
+// function declared to take a word must be given an integer.
+class Foreign final
+{
+public:
+    // At most Compile::RegisterArgs arguments of the types ForeignType lists
+    template <typename R, typename... Args>
+    int add(const std::string &name, R (*function)(Args...))
+    {
+        return add(name, reinterpret_cast<const void *>(function), typeOf<R>(), {typeOf<Args>()...});
+    }
+
+    // Returns 0, or -1 if the name is taken or there are too many arguments
+    int add(const std::string &name, const void *function, ForeignType result, const std::vector<ForeignType> &args);
+
+    std::optional<size_t> find(std::string_view name) const { return _table.find(name); }
+    size_t arity(size_t index) const { return _arities[index]; }
+    const uint8_t *stub(size_t index) const { return _stubs[index].data(); }
+    const CodeArena &arena() const { return _arena; }
+
+private:
+    template <typename T>
+    static constexpr ForeignType typeOf()
+    {
+        if constexpr (std::is_void_v<T>)
+        {
+            return ForeignType::Void;
+        }
+        else if constexpr (std::is_same_v<T, bool>)
+        {
+            return ForeignType::Bool;
+        }
+        else if constexpr (std::is_same_v<T, char>)
+        {
+            return ForeignType::Char;
+        }
+        else if constexpr (std::is_same_v<T, ASTNode *>)
+        {
+            return ForeignType::Object;
+        }
+        else
+        {
+            // The stub uses all 64 bits of a result
+            static_assert(std::is_same_v<T, word>, "foreign functions take and return word, char, bool or ASTNode *");
+            return ForeignType::Integer;
+        }
+    }
+
+    CodeArena _arena;
+    // Stable storage for the names the table refers to
+    std::deque<std::string> _names;
+    LabelTable _table;
+    std::vector<size_t> _arities;
+    std::vector<Code> _stubs;
+};
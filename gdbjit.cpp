@@ -0,0 +1,373 @@
+#include "gdbjit.h"
+#include "perfmap.h"
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+
+// The interface gdb looks for, see "JIT Compilation Interface" in the gdb manual.
+extern "C"
+{
+    enum JitAction : uint32_t
+    {
+        JIT_NOACTION = 0,
+        JIT_REGISTER_FN,
+        JIT_UNREGISTER_FN
+    };
+
+    struct jit_code_entry
+    {
+        jit_code_entry *next_entry;
+        jit_code_entry *prev_entry;
+        const char *symfile_addr;
+        uint64_t symfile_size;
+    };
+
+    struct jit_descriptor
+    {
+        uint32_t version;
+        uint32_t action_flag;
+        jit_code_entry *relevant_entry;
+        jit_code_entry *first_entry;
+    };
+
+    // gdb sets a breakpoint here and reads the descriptor when it is hit
+    __declspec(noinline) void __jit_debug_register_code()
+    {
+        static volatile int barrier;
+        barrier = 0;
+    }
+
+    jit_descriptor __jit_debug_descriptor = {1, JIT_NOACTION, nullptr, nullptr};
+}
+
+namespace GdbJit
+{
+    namespace Elf
+    {
+        constexpr uint16_t TypeRelocatable = 1;
+        constexpr uint16_t MachineX86_64 = 62;
+
+        constexpr uint32_t SectionProgBits = 1;
+        constexpr uint32_t SectionSymTab = 2;
+        constexpr uint32_t SectionStrTab = 3;
+        constexpr uint32_t SectionNoBits = 8;
+
+        constexpr uint64_t FlagAlloc = 2;
+        constexpr uint64_t FlagExec = 4;
+
+        constexpr uint8_t GlobalFunction = (1 << 4) | 2; // STB_GLOBAL, STT_FUNC
+
+        struct Header
+        {
+            uint8_t ident[16];
+            uint16_t type;
+            uint16_t machine;
+            uint32_t version;
+            uint64_t entry;
+            uint64_t phoff;
+            uint64_t shoff;
+            uint32_t flags;
+            uint16_t ehsize;
+            uint16_t phentsize;
+            uint16_t phnum;
+            uint16_t shentsize;
+            uint16_t shnum;
+            uint16_t shstrndx;
+        };
+        static_assert(sizeof(Header) == 64, "ELF header layout");
+
+        struct SectionHeader
+        {
+            uint32_t name;
+            uint32_t type;
+            uint64_t flags;
+            uint64_t addr;
+            uint64_t offset;
+            uint64_t size;
+            uint32_t link;
+            uint32_t info;
+            uint64_t addralign;
+            uint64_t entsize;
+        };
+        static_assert(sizeof(SectionHeader) == 64, "ELF section header layout");
+
+        struct Sym
+        {
+            uint32_t name;
+            uint8_t info;
+            uint8_t other;
+            uint16_t shndx;
+            uint64_t value;
+            uint64_t size;
+        };
+        static_assert(sizeof(Sym) == 24, "ELF symbol layout");
+    } // namespace Elf
+
+    namespace Dwarf
+    {
+        constexpr uint8_t Rsp = 7;
+        constexpr uint8_t ReturnAddress = 16;
+
+        constexpr uint8_t CfaNop = 0x00;
+        constexpr uint8_t CfaAdvanceLoc4 = 0x04;
+        constexpr uint8_t CfaDefCfa = 0x0c;
+        constexpr uint8_t CfaDefCfaOffset = 0x0e;
+        constexpr uint8_t CfaOffset = 0x80;
+    } // namespace Dwarf
+
+    template <typename T>
+    static void put(std::vector<uint8_t> &out, const T &value)
+    {
+        auto bytes = reinterpret_cast<const uint8_t *>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <typename T>
+    static void putAt(std::vector<uint8_t> &out, size_t pos, const T &value)
+    {
+        std::memcpy(out.data() + pos, &value, sizeof(T));
+    }
+
+    static void putUleb(std::vector<uint8_t> &out, uint64_t value)
+    {
+        do
+        {
+            uint8_t byte = value & 0x7f;
+            value >>= 7;
+            out.push_back(value ? byte | 0x80 : byte);
+        } while (value);
+    }
+
+    static void align(std::vector<uint8_t> &out, size_t alignment, uint8_t fill = 0)
+    {
+        while (out.size() % alignment)
+        {
+            out.push_back(fill);
+        }
+    }
+
+    // Appends a CIE or FDE: a 4-byte length followed by `body`, padded with
+    // DW_CFA_nop so the next entry stays 8-byte aligned.
+    static void putFrameEntry(std::vector<uint8_t> &out, const std::vector<uint8_t> &body)
+    {
+        auto start = out.size();
+        put<uint32_t>(out, 0);
+        out.insert(out.end(), body.begin(), body.end());
+        align(out, 8, Dwarf::CfaNop);
+        putAt<uint32_t>(out, start, static_cast<uint32_t>(out.size() - start - 4));
+    }
+
+    struct Region
+    {
+        std::string name;
+        size_t start;
+        size_t end;
+    };
+
+    static std::vector<Region> regions(const Code &code, const Buffer &buf)
+    {
+        std::vector<Region> result;
+        auto &labels = buf._labels;
+        if (labels.empty())
+        {
+            result.push_back({"code", 0, code.size()});
+        }
+        for (auto i = 0u; i < labels.size(); ++i)
+        {
+            auto end = i + 1 < labels.size() ? labels[i + 1].offset : code.size();
+            if (end > labels[i].offset)
+            {
+                result.push_back({labels[i].name, labels[i].offset, end});
+            }
+        }
+        return result;
+    }
+
+    static std::vector<uint8_t> debugFrame(const Code &code, const Buffer &buf, const std::vector<Region> &regions)
+    {
+        std::vector<uint8_t> out;
+
+        // CIE: on entry the CFA is rsp+8 and the return address sits right below it
+        std::vector<uint8_t> cie;
+        put<uint32_t>(cie, 0xffffffff); // CIE id
+        cie.push_back(1);               // version
+        cie.push_back(0);               // empty augmentation
+        putUleb(cie, 1);                // code alignment factor
+        cie.push_back(0x78);            // data alignment factor, SLEB128(-8)
+        cie.push_back(Dwarf::ReturnAddress);
+        cie.push_back(Dwarf::CfaDefCfa);
+        putUleb(cie, Dwarf::Rsp);
+        putUleb(cie, WordSize);
+        cie.push_back(Dwarf::CfaOffset | Dwarf::ReturnAddress);
+        putUleb(cie, 1); // at CFA - 1 * 8
+        putFrameEntry(out, cie);
+
+        auto address = reinterpret_cast<uint64_t>(code.data());
+        for (auto &region : regions)
+        {
+            std::vector<uint8_t> fde;
+            put<uint32_t>(fde, 0); // offset of the CIE
+            put<uint64_t>(fde, address + region.start);
+            put<uint64_t>(fde, region.end - region.start);
+            auto location = region.start;
+            for (auto &change : buf._frameChanges)
+            {
+                if (change.offset < region.start || change.offset >= region.end)
+                {
+                    continue;
+                }
+                fde.push_back(Dwarf::CfaAdvanceLoc4);
+                put<uint32_t>(fde, static_cast<uint32_t>(change.offset - location));
+                fde.push_back(Dwarf::CfaDefCfaOffset);
+                putUleb(fde, change.cfaOffset);
+                location = change.offset;
+            }
+            putFrameEntry(out, fde);
+        }
+        return out;
+    }
+
+    std::vector<uint8_t> buildElf(const Code &code, const Buffer &buf)
+    {
+        enum SectionIndex : uint16_t
+        {
+            Null,
+            Text,
+            DebugFrame,
+            SymTab,
+            StrTab,
+            ShStrTab,
+            SectionCount
+        };
+
+        auto codeRegions = regions(code, buf);
+        auto address = reinterpret_cast<uint64_t>(code.data());
+
+        std::vector<uint8_t> shstrtab{0};
+        auto sectionName = [&](const char *name) {
+            auto offset = static_cast<uint32_t>(shstrtab.size());
+            shstrtab.insert(shstrtab.end(), name, name + std::strlen(name) + 1);
+            return offset;
+        };
+
+        std::vector<uint8_t> strtab{0};
+        std::vector<uint8_t> symtab;
+        put(symtab, Elf::Sym{});
+        for (auto &region : codeRegions)
+        {
+            auto name = PerfMap::symbolName(region.name);
+            Elf::Sym sym{static_cast<uint32_t>(strtab.size()), Elf::GlobalFunction, 0, Text,
+                         address + region.start, region.end - region.start};
+            strtab.insert(strtab.end(), name.begin(), name.end());
+            strtab.push_back(0);
+            put(symtab, sym);
+        }
+        auto frames = debugFrame(code, buf, codeRegions);
+
+        Elf::SectionHeader sections[SectionCount]{};
+        sections[Text] = {sectionName(".text"), Elf::SectionNoBits, Elf::FlagAlloc | Elf::FlagExec,
+                          address, 0, code.size(), 0, 0, 16, 0};
+        sections[DebugFrame] = {sectionName(".debug_frame"), Elf::SectionProgBits, 0, 0, 0, frames.size(), 0, 0, 8, 0};
+        sections[SymTab] = {sectionName(".symtab"), Elf::SectionSymTab, 0, 0, 0, symtab.size(), StrTab, 1, 8,
+                            sizeof(Elf::Sym)};
+        sections[StrTab] = {sectionName(".strtab"), Elf::SectionStrTab, 0, 0, 0, strtab.size(), 0, 0, 1, 0};
+        sections[ShStrTab] = {sectionName(".shstrtab"), Elf::SectionStrTab, 0, 0, 0, 0, 0, 0, 1, 0};
+        sections[ShStrTab].size = shstrtab.size();
+
+        std::vector<uint8_t> out(sizeof(Elf::Header));
+        auto append = [&](SectionIndex index, const std::vector<uint8_t> &data) {
+            align(out, 8);
+            sections[index].offset = out.size();
+            out.insert(out.end(), data.begin(), data.end());
+        };
+        append(DebugFrame, frames);
+        append(SymTab, symtab);
+        append(StrTab, strtab);
+        append(ShStrTab, shstrtab);
+        align(out, 8);
+        auto sectionsOffset = out.size();
+        for (auto &section : sections)
+        {
+            put(out, section);
+        }
+
+        Elf::Header header{};
+        const uint8_t ident[] = {0x7f, 'E', 'L', 'F', 2 /* 64-bit */, 1 /* little endian */, 1 /* version */};
+        std::memcpy(header.ident, ident, sizeof(ident));
+        header.type = Elf::TypeRelocatable;
+        header.machine = Elf::MachineX86_64;
+        header.version = 1;
+        header.shoff = sectionsOffset;
+        header.ehsize = sizeof(Elf::Header);
+        header.shentsize = sizeof(Elf::SectionHeader);
+        header.shnum = SectionCount;
+        header.shstrndx = ShStrTab;
+        putAt(out, 0, header);
+        return out;
+    }
+
+    static std::atomic<bool> on{false};
+    static std::mutex mutex;
+
+    struct Entry
+    {
+        jit_code_entry entry{};
+        std::vector<uint8_t> elf;
+    };
+
+    static void unregisterCode(Entry *registered)
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            auto entry = &registered->entry;
+            if (entry->prev_entry)
+            {
+                entry->prev_entry->next_entry = entry->next_entry;
+            }
+            else
+            {
+                __jit_debug_descriptor.first_entry = entry->next_entry;
+            }
+            if (entry->next_entry)
+            {
+                entry->next_entry->prev_entry = entry->prev_entry;
+            }
+            __jit_debug_descriptor.relevant_entry = entry;
+            __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+            __jit_debug_register_code();
+        }
+        delete registered;
+    }
+
+    std::shared_ptr<void> registerCode(const Code &code, const Buffer &buf)
+    {
+        auto registered = new Entry{};
+        registered->elf = buildElf(code, buf);
+        auto entry = &registered->entry;
+        entry->symfile_addr = reinterpret_cast<const char *>(registered->elf.data());
+        entry->symfile_size = registered->elf.size();
+
+        std::lock_guard<std::mutex> lock{mutex};
+        entry->next_entry = __jit_debug_descriptor.first_entry;
+        if (entry->next_entry)
+        {
+            entry->next_entry->prev_entry = entry;
+        }
+        __jit_debug_descriptor.first_entry = entry;
+        __jit_debug_descriptor.relevant_entry = entry;
+        __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+        __jit_debug_register_code();
+        return std::shared_ptr<void>{registered, [](void *ptr) { unregisterCode(static_cast<Entry *>(ptr)); }};
+    }
+
+    void enable(bool enabled)
+    {
+        on = enabled;
+    }
+
+    bool enabled()
+    {
+        return on.load(std::memory_order_relaxed);
+    }
+} // namespace GdbJit
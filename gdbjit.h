@@ -0,0 +1,18 @@
+#pragma once
+
+#include "alisp.h"
+
+// GdbJit: registers frozen code with gdb through the standard JIT interface
+// (`__jit_debug_register_code`). Each Code is described by an in-memory ELF
+// holding a symbol per label and .debug_frame unwind info.
+namespace GdbJit
+{
+    void enable(bool on = true);
+    bool enabled();
+
+    // Builds the ELF image for `code`, which was frozen from `buf`
+    std::vector<uint8_t> buildElf(const Code &code, const Buffer &buf);
+
+    // Registers `code`; it is unregistered when the returned handle is released
+    std::shared_ptr<void> registerCode(const Code &code, const Buffer &buf);
+} // namespace GdbJit
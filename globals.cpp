@@ -0,0 +1,60 @@
+#include "globals.h"
+
+bool Globals::isDefine(ASTNode *node)
+{
+    return node->isPair() && node->asPair()->car->isSymbol() && node->asPair()->car->asSymbol()->str == "define";
+}
+
+int Globals::define(ASTNode *node)
+{
+    // (define name (code (formals...) body))
+    auto args = node->asPair()->cdr;
+    if (!args->isPair() || !args->asPair()->car->isSymbol() || !args->asPair()->cdr->isPair())
+    {
+        return -1;
+    }
+    auto &name = args->asPair()->car->asSymbol()->str;
+    auto code = args->asPair()->cdr->asPair()->car;
+    if (!code->isPair() || !code->asPair()->car->isSymbol() || code->asPair()->car->asSymbol()->str != "code")
+    {
+        return -1;
+    }
+
+    // A new global is visible to its own body, so it can recurse
+    auto existing = _table.find(name);
+    auto table = _table;
+    if (!existing)
+    {
+        _slots.push_back(0);
+        table.add(name, reinterpret_cast<word>(&_slots.back()));
+    }
+
+    Buffer buf;
+    buf._options.globals = &table;
+    buf._options.compressed = _compressed;
+    buf._labels.push_back({name, 0});
+    {
+        Stats::Timer timer{Stats::Phase::Compile};
+        if (Compile::code(buf, code, nullptr) != 0)
+        {
+            if (!existing)
+            {
+                _slots.pop_back();
+            }
+            return -1;
+        }
+        timer.setBytes(buf.size());
+    }
+
+    _codes.push_back(buf.freeze(_arena));
+    auto entry = reinterpret_cast<uint64_t>(_codes.back().data());
+    if (existing)
+    {
+        _slots[*existing] = entry;
+        return 0;
+    }
+    _slots.back() = entry;
+    _names.push_back(name);
+    _table.add(_names.back(), reinterpret_cast<word>(&_slots.back()));
+    return 0;
+}
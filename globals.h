@@ -0,0 +1,38 @@
+#pragma once
+
+#include "alisp.h"
+
+#include <deque>
+
+// Globals: functions made with `(define name (code (formals...) body))` that
+// outlive the program that defined them. Later programs `labelcall` them
+// through a slot holding the current entry point, so redefining a global
+// takes effect in code that was compiled before.
+class Globals final
+{
+public:
+    Globals() = default;
+    // For programs compiled with Buffer::Options::compressed
+    explicit Globals(bool compressed) : _compressed{compressed} {}
+
+    static bool isDefine(ASTNode *node);
+
+    // Compiles a `define` form into the code arena. Returns 0 on success and
+    // -1 if it does not compile, in which case nothing changes.
+    int define(ASTNode *node);
+
+    // For Buffer::Options::globals
+    const LabelTable *table() const { return &_table; }
+    bool contains(const std::string &name) const { return _table.find(name).has_value(); }
+    const CodeArena &arena() const { return _arena; }
+
+private:
+    bool _compressed = false;
+    CodeArena _arena;
+    // Stable storage for the names and entry points the table refers to
+    std::deque<std::string> _names;
+    std::deque<uint64_t> _slots;
+    LabelTable _table;
+    // Every version ever defined: calls already running may still be in old ones
+    std::vector<Code> _codes;
+};
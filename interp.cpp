@@ -0,0 +1,611 @@
+#include "interp.h"
+#include "globals.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <deque>
+
+namespace Interp
+{
+    // Mirrors the operations the compiler emits, on tagged words
+    struct Interpreter
+    {
+        static ASTNode *operand1(ASTNode *list)
+        {
+            return list->asPair()->car;
+        }
+        static ASTNode *operand2(ASTNode *list)
+        {
+            return list->asPair()->cdr->asPair()->car;
+        }
+        static ASTNode *operand3(ASTNode *list)
+        {
+            return list->asPair()->cdr->asPair()->cdr->asPair()->car;
+        }
+
+        static word boolean(bool value)
+        {
+            return Objects::encodeBool(value);
+        }
+
+        // Both operands are untagged with an arithmetic shift, like the
+        // compiler does; a zero divisor gives an error object
+        static uword divide(const std::string &name, uword a, uword b)
+        {
+            auto dividend = static_cast<word>(a) >> Objects::IntegerShift;
+            auto divisor = static_cast<word>(b) >> Objects::IntegerShift;
+            if (divisor == 0)
+            {
+                return Objects::error();
+            }
+            auto result = name == "quotient" ? dividend / divisor : dividend % divisor;
+            if (name == "modulo" && result != 0 && (result < 0) != (divisor < 0))
+            {
+                result += divisor;
+            }
+            return static_cast<uword>(result) << Objects::IntegerShift;
+        }
+
+        static std::optional<word> lookup(const Env *env, const std::string &name)
+        {
+            return env ? env->find(name) : std::nullopt;
+        }
+
+        std::optional<word> let(ASTNode *bindings, ASTNode *body, const Env *bindingEnv, const Env *bodyEnv, const LabelTable *labels)
+        {
+            if (bindings->isNil())
+            {
+                return eval(body, bodyEnv, labels);
+            }
+            auto binding = bindings->asPair()->car->asPair();
+            auto name = binding->car;
+            assert(name->isSymbol());
+            auto value = eval(binding->cdr->asPair()->car, bindingEnv, labels);
+            if (!value)
+            {
+                return {};
+            }
+            Env entry{name->asSymbol()->str, *value, bodyEnv};
+            return let(bindings->asPair()->cdr, body, bindingEnv, &entry, labels);
+        }
+
+        std::optional<word> labelcall(ASTNode *label, ASTNode *args, const Env *varEnv, const LabelTable *labels)
+        {
+            assert(label->isSymbol());
+            auto found = labels ? labels->find(label->asSymbol()->str) : std::nullopt;
+            if (!found)
+            {
+                return {};
+            }
+            // (code (formals...) body)
+            auto code = reinterpret_cast<ASTNode *>(labels->addresses[*found]);
+            auto formals = operand1(code->asPair()->cdr);
+            auto body = operand2(code->asPair()->cdr);
+
+            // Arguments are evaluated left to right, all in the caller's environment
+            std::vector<Env> frame;
+            for (auto arg = args; !arg->isNil(); arg = arg->asPair()->cdr)
+            {
+                auto value = eval(arg->asPair()->car, varEnv, labels);
+                if (!value)
+                {
+                    return {};
+                }
+                frame.push_back(Env{{}, *value, nullptr});
+            }
+            const Env *env = nullptr;
+            auto formal = formals;
+            for (auto &entry : frame)
+            {
+                if (formal->isNil())
+                {
+                    break;
+                }
+                entry.name = formal->asPair()->car->asSymbol()->str;
+                entry.prev = env;
+                env = &entry;
+                formal = formal->asPair()->cdr;
+            }
+            return eval(body, env, labels);
+        }
+
+        static uword *elements(uword vector)
+        {
+            return reinterpret_cast<uword *>(vector - Objects::VectorTag + Objects::VectorElementsOffset);
+        }
+        static uword vectorLength(uword vector)
+        {
+            return *reinterpret_cast<uword *>(vector - Objects::VectorTag + Objects::VectorLengthOffset);
+        }
+        // Lengths are not checked, any more than in compiled code, but both
+        // allocate no elements for a negative one
+        static size_t length(uword encoded)
+        {
+            return static_cast<size_t>(std::max<word>(Objects::decodeInteger(encoded), 0));
+        }
+
+        // The vector at heap takes its length and the elements after it, rounded up to an even number of words
+        uword allocateVector(size_t length)
+        {
+            auto vector = reinterpret_cast<uword>(heap) | Objects::VectorTag;
+            heap += (length + 2) & ~size_t{1};
+            return vector;
+        }
+
+        std::optional<word> vectorMap(ASTNode *op, ASTNode *first, ASTNode *second, const Env *varEnv, const LabelTable *labels)
+        {
+            if (!op->isSymbol() || (op->asSymbol()->str != "+" && op->asSymbol()->str != "*"))
+            {
+                return {};
+            }
+            auto b = eval(second, varEnv, labels);
+            if (!b)
+            {
+                return {};
+            }
+            auto a = eval(first, varEnv, labels);
+            if (!a)
+            {
+                return {};
+            }
+            auto size = vectorLength(static_cast<uword>(*a));
+            heap[0] = size;
+            for (size_t i = 0; i < length(size); ++i)
+            {
+                auto x = elements(static_cast<uword>(*a))[i];
+                auto y = elements(static_cast<uword>(*b))[i];
+                heap[1 + i] = op->asSymbol()->str == "+" ? x + y : x * (y >> Objects::IntegerShift);
+            }
+            return allocateVector(length(size));
+        }
+
+        std::optional<word> call(ASTNode *callable, ASTNode *args, const Env *varEnv, const LabelTable *labels)
+        {
+            assert(callable->isSymbol());
+            auto &name = callable->asSymbol()->str;
+
+            if (name == "let")
+            {
+                return let(operand1(args), operand2(args), varEnv, varEnv, labels);
+            }
+            if (name == "if")
+            {
+                auto condition = eval(operand1(args), varEnv, labels);
+                if (!condition)
+                {
+                    return {};
+                }
+                return eval(*condition != Objects::encodeBool(false) ? operand2(args) : operand3(args), varEnv, labels);
+            }
+            if (name == "labelcall")
+            {
+                return labelcall(operand1(args), args->asPair()->cdr, varEnv, labels);
+            }
+            if (name == "foreign-call")
+            {
+                return {};
+            }
+            if (name == "vector-map")
+            {
+                return vectorMap(operand1(args), operand2(args), operand3(args), varEnv, labels);
+            }
+
+            // The remaining forms evaluate all of their operands, in the same
+            // order as the compiled code so allocations land in the same place
+            std::vector<ASTNode *> operands;
+            for (auto arg = args; !arg->isNil(); arg = arg->asPair()->cdr)
+            {
+                operands.push_back(arg->asPair()->car);
+            }
+            bool rightToLeft = name == "+" || name == "-" || name == "*" || name == "=" || name == "<" ||
+                               name == "quotient" || name == "remainder" || name == "modulo" ||
+                               name == "string-ref" || name == "make-vector" || name == "vector-ref" || name == "vector-fill!" ||
+                               name == "vector-set!";
+            if (rightToLeft)
+            {
+                std::reverse(operands.begin(), operands.end());
+            }
+            std::vector<uword> values;
+            for (auto operand : operands)
+            {
+                auto value = eval(operand, varEnv, labels);
+                if (!value)
+                {
+                    return {};
+                }
+                values.push_back(static_cast<uword>(*value));
+            }
+            if (rightToLeft)
+            {
+                std::reverse(values.begin(), values.end());
+            }
+            auto a = values.size() > 0 ? values[0] : 0;
+            auto b = values.size() > 1 ? values[1] : 0;
+            auto c = values.size() > 2 ? values[2] : 0;
+
+            if (name == "add1")
+                return a + Objects::encodeInteger(1);
+            if (name == "sub1")
+                return a + Objects::encodeInteger(-1);
+            if (name == "integer->char")
+                return (a << (Objects::CharShift - Objects::IntegerShift)) | Objects::CharTag;
+            if (name == "char->integer")
+                return a >> (Objects::CharShift - Objects::IntegerShift);
+            if (name == "nil?")
+                return boolean(a == static_cast<uword>(Objects::nil()));
+            if (name == "zero?")
+                return boolean(a == static_cast<uword>(Objects::encodeInteger(0)));
+            if (name == "not")
+                return boolean(a == static_cast<uword>(Objects::encodeBool(false)));
+            if (name == "integer?")
+                return boolean((a & Objects::IntegerMask) == Objects::IntegerTag);
+            if (name == "boolean?")
+                return boolean((a & Objects::BoolTag) == Objects::BoolTag);
+            if (name == "+")
+                return a + b;
+            if (name == "-")
+                return a - b;
+            if (name == "*")
+                return a * (b >> Objects::IntegerShift);
+            if (name == "quotient" || name == "remainder" || name == "modulo")
+                return divide(name, a, b);
+            if (name == "=")
+                return boolean(a == b);
+            if (name == "<")
+                return boolean(static_cast<word>(a) < static_cast<word>(b));
+            if (name == "cons" && compressed)
+            {
+                auto pair = reinterpret_cast<CompressedPair *>(heap);
+                pair->car = Objects::compress(a);
+                pair->cdr = Objects::compress(b);
+                heap += Objects::CompressedPairSize / WordSize;
+                return reinterpret_cast<uword>(pair) | Objects::PairTag;
+            }
+            if ((name == "car" || name == "cdr") && compressed)
+            {
+                auto pair = reinterpret_cast<ASTNode *>(a)->asCompressedPair();
+                return reinterpret_cast<word>(name == "car" ? pair->getCar() : pair->getCdr());
+            }
+            if (name == "cons")
+            {
+                heap[Objects::CarIndex] = a;
+                heap[Objects::CdrIndex] = b;
+                auto pair = reinterpret_cast<uword>(heap) | Objects::PairTag;
+                heap += Objects::PairSize / WordSize;
+                return pair;
+            }
+            if (name == "car")
+                return *reinterpret_cast<word *>(a - Objects::PairTag + Objects::CarOffset);
+            if (name == "cdr")
+                return *reinterpret_cast<word *>(a - Objects::PairTag + Objects::CdrOffset);
+            if (name == "string-length")
+                return *reinterpret_cast<word *>(a - Objects::StringTag + Objects::StringLengthOffset);
+            if (name == "string-ref")
+            {
+                auto bytes = reinterpret_cast<const uint8_t *>(a - Objects::StringTag + Objects::StringBytesOffset);
+                return (static_cast<uword>(bytes[Objects::decodeInteger(b)]) << Objects::CharShift) | Objects::CharTag;
+            }
+            if (name == "string=?")
+                return boolean(Strings::equal(reinterpret_cast<ASTNode *>(a), reinterpret_cast<ASTNode *>(b)));
+            if (name == "string-index")
+                return Objects::encodeInteger(Strings::index(reinterpret_cast<ASTNode *>(a), Objects::decodeChar(b)));
+            if (name == "make-vector")
+            {
+                heap[0] = a;
+                std::fill_n(heap + 1, length(a), b);
+                return allocateVector(length(a));
+            }
+            if (name == "vector-length")
+                return *reinterpret_cast<word *>(a - Objects::VectorTag + Objects::VectorLengthOffset);
+            if (name == "vector-ref")
+                return elements(a)[Objects::decodeInteger(b)];
+            if (name == "vector-set!")
+            {
+                elements(a)[Objects::decodeInteger(b)] = c;
+                return a;
+            }
+            if (name == "vector-fill!")
+            {
+                std::fill_n(elements(a), length(vectorLength(a)), b);
+                return a;
+            }
+            if (name == "vector-sum")
+            {
+                uword sum = 0;
+                for (size_t i = 0; i < length(vectorLength(a)); ++i)
+                {
+                    sum += elements(a)[i];
+                }
+                return sum;
+            }
+
+            assert(false && "unexpected call type");
+            return {};
+        }
+
+        std::optional<word> eval(ASTNode *node, const Env *varEnv, const LabelTable *labels)
+        {
+            if (node->isPair())
+            {
+                auto pair = node->asPair();
+                return call(pair->car, pair->cdr, varEnv, labels);
+            }
+            if (node->isSymbol())
+            {
+                return lookup(varEnv, node->asSymbol()->str);
+            }
+            if (node->isString())
+            {
+                // A fresh copy on the heap, like the compiled code makes
+                auto size = String::allocationSize(node->asString()->size());
+                std::memcpy(heap, node->asString(), size);
+                auto string = reinterpret_cast<uword>(heap) | Objects::StringTag;
+                heap += size / WordSize;
+                return string;
+            }
+            // Integers, chars, booleans and nil are their own encoding
+            return reinterpret_cast<word>(node);
+        }
+
+        // Whether every name in `program` is bound: variables in `env`, labelcalls
+        // in `labels`. The compiler rejects a program for a bad name even in code
+        // that never runs, so this is checked before evaluating anything. Also
+        // rejects the other forms the compiler refuses whether they run or not.
+        static bool resolves(ASTNode *program, const Env *env, const LabelTable *labels)
+        {
+            // Stable addresses: entries point at each other
+            std::deque<Env> entries;
+            std::vector<std::pair<ASTNode *, const Env *>> pending{{program, env}};
+            while (!pending.empty())
+            {
+                auto [node, varEnv] = pending.back();
+                pending.pop_back();
+                if (node->isSymbol())
+                {
+                    if (!lookup(varEnv, node->asSymbol()->str))
+                    {
+                        return false;
+                    }
+                    continue;
+                }
+                if (!node->isPair())
+                {
+                    continue;
+                }
+                if (!node->asPair()->car->isSymbol())
+                {
+                    return false;
+                }
+                auto &name = node->asPair()->car->asSymbol()->str;
+                auto args = node->asPair()->cdr;
+                if (name == "let")
+                {
+                    // Bindings are evaluated in the outer environment
+                    auto bodyEnv = varEnv;
+                    for (auto binding = operand1(args); binding->isPair(); binding = binding->asPair()->cdr)
+                    {
+                        auto pair = binding->asPair()->car->asPair();
+                        pending.push_back({pair->cdr->asPair()->car, varEnv});
+                        entries.push_back(Env{pair->car->asSymbol()->str, 0, bodyEnv});
+                        bodyEnv = &entries.back();
+                    }
+                    pending.push_back({operand2(args), bodyEnv});
+                    continue;
+                }
+                if (name == "labelcall")
+                {
+                    if (!labels || !labels->find(operand1(args)->asSymbol()->str))
+                    {
+                        return false;
+                    }
+                    args = args->asPair()->cdr;
+                }
+                else if (name == "vector-map")
+                {
+                    auto op = operand1(args);
+                    if (!op->isSymbol() || (op->asSymbol()->str != "+" && op->asSymbol()->str != "*"))
+                    {
+                        return false;
+                    }
+                    args = args->asPair()->cdr;
+                }
+                else if (name == "foreign-call")
+                {
+                    return false;
+                }
+                else if (name == "string=?" || name == "string-index")
+                {
+                    // Runtime calls, whose arity the compiler checks
+                    size_t count = 0;
+                    for (auto arg = args; arg->isPair(); arg = arg->asPair()->cdr)
+                    {
+                        ++count;
+                    }
+                    if (count != 2)
+                    {
+                        return false;
+                    }
+                }
+                for (auto arg = args; arg->isPair(); arg = arg->asPair()->cdr)
+                {
+                    pending.push_back({arg->asPair()->car, varEnv});
+                }
+            }
+            return true;
+        }
+
+        // Binds each label to its `code` node. Like the compiler, every label
+        // and the body see all of them, and every label body is checked
+        // whether it is called or not.
+        std::optional<word> labels(ASTNode *bindings, ASTNode *body)
+        {
+            LabelTable table;
+            for (auto binding = bindings; !binding->isNil(); binding = binding->asPair()->cdr)
+            {
+                auto name = binding->asPair()->car->asPair()->car;
+                auto code = operand2(binding->asPair()->car);
+                if (!table.add(name->asSymbol()->str, reinterpret_cast<word>(code)))
+                {
+                    return {};
+                }
+            }
+            for (auto binding = bindings; !binding->isNil(); binding = binding->asPair()->cdr)
+            {
+                auto code = operand2(binding->asPair()->car)->asPair()->cdr;
+                std::deque<Env> formals;
+                const Env *env = nullptr;
+                for (auto formal = operand1(code); formal->isPair(); formal = formal->asPair()->cdr)
+                {
+                    formals.push_back(Env{formal->asPair()->car->asSymbol()->str, 0, env});
+                    env = &formals.back();
+                }
+                if (!resolves(operand2(code), env, &table))
+                {
+                    return {};
+                }
+            }
+            if (!resolves(body, nullptr, &table))
+            {
+                return {};
+            }
+            return eval(body, nullptr, &table);
+        }
+
+        uword *heap;
+        bool compressed;
+    };
+
+    std::optional<ASTNode *> run(ASTNode *node, uword *heap, bool compressed)
+    {
+        Interpreter interpreter{heap, compressed};
+        std::optional<word> result;
+        if (node->isPair() && node->asPair()->car->isSymbol() && node->asPair()->car->asSymbol()->str == "labels")
+        {
+            auto args = node->asPair()->cdr;
+            result = interpreter.labels(Interpreter::operand1(args), Interpreter::operand2(args));
+        }
+        else if (Interpreter::resolves(node, nullptr, nullptr))
+        {
+            result = interpreter.eval(node, nullptr, nullptr);
+        }
+        if (!result)
+        {
+            return {};
+        }
+        return reinterpret_cast<ASTNode *>(*result);
+    }
+} // namespace Interp
+
+static bool hasCall(ASTNode *program, std::string_view form)
+{
+    std::vector<ASTNode *> pending{program};
+    while (!pending.empty())
+    {
+        auto node = pending.back();
+        pending.pop_back();
+        if (!node->isPair())
+        {
+            continue;
+        }
+        auto pair = node->asPair();
+        if (pair->car->isSymbol() && pair->car->asSymbol()->str == form)
+        {
+            return true;
+        }
+        pending.push_back(pair->cdr);
+        pending.push_back(pair->car);
+    }
+    return false;
+}
+
+// Whether forms nest more than `limit` deep in `program`
+static bool deeperThan(ASTNode *program, size_t limit)
+{
+    std::vector<std::pair<ASTNode *, size_t>> pending{{program, 0}};
+    while (!pending.empty())
+    {
+        auto [node, depth] = pending.back();
+        pending.pop_back();
+        if (!node->isPair())
+        {
+            continue;
+        }
+        if (depth > limit)
+        {
+            return true;
+        }
+        // The cdrs of a form are its operands, at the same depth
+        for (auto arg = node; arg->isPair(); arg = arg->asPair()->cdr)
+        {
+            pending.push_back({arg->asPair()->car, depth + 1});
+        }
+    }
+    return false;
+}
+
+Engine::Entry &Engine::remember(const std::string &source)
+{
+    auto found = _entries.find(source);
+    if (found == _entries.end())
+    {
+        // One-shot lines at the REPL would otherwise pile up forever
+        if (!_entries.empty() && _entries.size() >= _policy.maxEntries)
+        {
+            auto coldest = std::min_element(_entries.begin(), _entries.end(), [](const auto &a, const auto &b) {
+                return a.second.lastRun < b.second.lastRun;
+            });
+            _entries.erase(coldest);
+        }
+        found = _entries.emplace(source, Entry{}).first;
+    }
+    found->second.lastRun = ++_runs;
+    return found->second;
+}
+
+Engine::Tier Engine::choose(const std::string &source, ASTNode *node)
+{
+    auto &entry = remember(source);
+    if (entry.code || ++entry.runs >= _policy.hotThreshold)
+    {
+        return Tier::Compiler;
+    }
+    // The interpreter recurses once per level, the compiler keeps a worklist
+    if (deeperThan(node, Interp::MaxDepth))
+    {
+        return Tier::Compiler;
+    }
+    // The interpreter cannot call compiled globals
+    if ((_policy.compileRecursive || _globals) && hasCall(node, "labelcall"))
+    {
+        return Tier::Compiler;
+    }
+    if (hasCall(node, "foreign-call"))
+    {
+        return Tier::Compiler;
+    }
+    return Tier::Interpreter;
+}
+
+std::optional<ASTNode *> Engine::run(const std::string &source, ASTNode *node, uword *heap)
+{
+    if (choose(source, node) == Tier::Interpreter)
+    {
+        Stats::Timer timer{Stats::Phase::Interpret};
+        return Interp::run(node, heap, _policy.compressed);
+    }
+    auto &entry = _entries.at(source);
+    if (!entry.code)
+    {
+        Buffer buf;
+        buf._options.globals = _globals ? _globals->table() : nullptr;
+        buf._options.foreign = _foreign;
+        buf._options.compressed = _policy.compressed;
+        if (Compile::function(buf, node) != 0)
+        {
+            return {};
+        }
+        entry.code = std::make_unique<Code>(buf.freeze());
+    }
+    return _stack.run(*entry.code, heap);
+}
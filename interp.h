@@ -0,0 +1,80 @@
+#pragma once
+
+#include "alisp.h"
+#include "jitstack.h"
+
+#include <unordered_map>
+
+class Foreign;
+class Globals;
+
+// Interp: evaluates an AST directly, without generating code. Results, and
+// the pairs it writes to the heap, are bit-identical to what the compiled
+// code would produce.
+namespace Interp
+{
+    // Returns nothing where Compile::function would report an error, and for
+    // foreign-call, which only compiled code can make. Like the compiler, it
+    // rejects an unbound name before running anything, even in a dead arm.
+    // `compressed` lays out pairs the way Buffer::Options::compressed does.
+    std::optional<ASTNode *> run(ASTNode *node, uword *heap, bool compressed = false);
+
+    // run recurses on the native stack once per level of nesting, so Engine
+    // compiles programs nested deeper than this instead
+    constexpr size_t MaxDepth = 1000;
+} // namespace Interp
+
+// Engine: runs programs through the interpreter while they are cold and
+// switches to compiled code once the same source has been run often enough.
+// Programs deeper than Interp::MaxDepth are compiled from the start.
+class Engine final
+{
+public:
+    struct Policy
+    {
+        // Runs of the same source before it is compiled
+        int hotThreshold = 2;
+        // Compile programs with labelcalls right away: their run time is unbounded
+        bool compileRecursive = true;
+        // Compressed pairs (Buffer::Options::compressed) in both tiers. Heaps
+        // must come from a CompressedHeap, and globals be compressed too.
+        bool compressed = false;
+        // Sources remembered at once; the least recently run is forgotten first
+        size_t maxEntries = 256;
+    };
+
+    enum class Tier
+    {
+        Interpreter,
+        Compiler,
+    };
+
+    Engine() = default;
+    explicit Engine(Policy policy) : _policy{policy} {}
+
+    // Compiled programs can call the functions defined in `globals`
+    void setGlobals(const Globals *globals) { _globals = globals; }
+    // Programs that use foreign-call are always compiled
+    void setForeign(const Foreign *foreign) { _foreign = foreign; }
+
+    Tier choose(const std::string &source, ASTNode *node);
+    std::optional<ASTNode *> run(const std::string &source, ASTNode *node, uword *heap);
+
+private:
+    struct Entry
+    {
+        int runs{};
+        std::unique_ptr<Code> code;
+        uint64_t lastRun{};
+    };
+
+    Entry &remember(const std::string &source);
+
+    Policy _policy;
+    const Globals *_globals = nullptr;
+    const Foreign *_foreign = nullptr;
+    // Compiled programs run here, so deep recursion cannot crash the caller
+    JitStack _stack;
+    std::unordered_map<std::string, Entry> _entries;
+    uint64_t _runs{};
+};
@@ -0,0 +1,95 @@
+#include "jitstack.h"
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+// The JitStack whose fiber is running on this thread, if any
+static thread_local JitStack *t_running = nullptr;
+
+JitStack::JitStack(size_t reserve) : _reserve{reserve}
+{
+    // In front of handlers registered before, which may treat the overflow as fatal
+    _handler = AddVectoredExceptionHandler(1, &JitStack::onException);
+}
+
+JitStack::~JitStack()
+{
+    RemoveVectoredExceptionHandler(_handler);
+    if (_fiber)
+    {
+        DeleteFiber(_fiber);
+    }
+}
+
+ASTNode *JitStack::run(const Code &code, uword *heap)
+{
+    Stats::Timer timer{Stats::Phase::Execute};
+    if (!_fiber)
+    {
+        _fiber = CreateFiberEx(0, _reserve, 0, &JitStack::runFiber, this);
+        if (!_fiber)
+        {
+            // Not even the address space for the stack could be reserved
+            return ASTNode::error();
+        }
+    }
+    auto converted = !IsThreadAFiber();
+    _caller = converted ? ConvertThreadToFiber(nullptr) : GetCurrentFiber();
+    _code = &code;
+    _heap = heap;
+    _overflowed = false;
+
+    auto previous = t_running;
+    t_running = this;
+    SwitchToFiber(_fiber);
+    t_running = previous;
+
+    if (_overflowed)
+    {
+        // Its guard page is spent
+        DeleteFiber(_fiber);
+        _fiber = nullptr;
+        _resumeAt = 0;
+    }
+    if (converted)
+    {
+        ConvertFiberToThread();
+    }
+    return _overflowed ? ASTNode::error() : _result;
+}
+
+void JitStack::runFiber(void *param)
+{
+    auto stack = static_cast<JitStack *>(param);
+    char top;
+    stack->_resumeAt = reinterpret_cast<uintptr_t>(&top);
+    for (;;)
+    {
+        stack->_result = stack->_code->toFunc<ASTNode *(uword *)>()(stack->_heap);
+        SwitchToFiber(stack->_caller);
+    }
+}
+
+long JitStack::onException(_EXCEPTION_POINTERS *info)
+{
+    auto stack = t_running;
+    if (info->ExceptionRecord->ExceptionCode != EXCEPTION_STACK_OVERFLOW || !stack ||
+        GetCurrentFiber() != stack->_fiber)
+    {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+    // Nothing on the fiber's stack is needed any more: enter abandonRun near
+    // its top as if it had been called, with rsp 8 off 16-byte alignment
+    auto context = info->ContextRecord;
+    context->Rsp = (stack->_resumeAt & ~uintptr_t{15}) - 8;
+    context->Rip = reinterpret_cast<DWORD64>(&JitStack::abandonRun);
+    return EXCEPTION_CONTINUE_EXECUTION;
+}
+
+void JitStack::abandonRun()
+{
+    auto stack = t_running;
+    stack->_overflowed = true;
+    SwitchToFiber(stack->_caller);
+}
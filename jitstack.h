@@ -0,0 +1,46 @@
+#pragma once
+
+#include "alisp.h"
+
+struct _EXCEPTION_POINTERS;
+
+// JitStack: runs compiled code on a large stack of its own rather than the
+// caller's. Deep recursion through `labelcall` only needs address space, and
+// running into the guard page below the stack makes the run return an error
+// object instead of taking the process down.
+class JitStack final
+{
+public:
+    // Only reserved: pages are committed as the stack grows into them
+    static constexpr size_t DefaultReserve = size_t{256} << 20;
+
+    explicit JitStack(size_t reserve = DefaultReserve);
+    JitStack(const JitStack &) = delete;
+    JitStack &operator=(const JitStack &) = delete;
+    ~JitStack();
+
+    // Calls `code` as an ASTNode *(uword *heap), timing it as
+    // Stats::Phase::Execute. Returns ASTNode::error() if the stack overflowed,
+    // or could not be reserved.
+    ASTNode *run(const Code &code, uword *heap);
+    bool overflowed() const { return _overflowed; }
+
+private:
+    // A fiber's entry point
+    static void runFiber(void *param);
+    // A vectored exception handler: resumes an overflowing run in abandonRun
+    static long onException(_EXCEPTION_POINTERS *info);
+    // Runs near the top of the overflowed stack and never returns
+    static void abandonRun();
+
+    size_t _reserve;
+    void *_handler{};
+    void *_fiber{};
+    void *_caller{};
+    // The stack is thrown away after an overflow, so this is only set once per fiber
+    uintptr_t _resumeAt{};
+    const Code *_code{};
+    uword *_heap{};
+    ASTNode *_result{};
+    bool _overflowed{};
+};
@@ -2,12 +2,20 @@
 #include <ios>
 #include <iomanip>
 #include <string>
+#include <cassert>
 
 #include <fmt/ostream.h>
 
 #include "alisp.h"
+#include "disasm.h"
+#include "foreign.h"
+#include "gdbjit.h"
+#include "globals.h"
+#include "interp.h"
+#include "perfmap.h"
 
-std::string format_node(const ASTNode *node)
+// `compressed`: the pairs were made by code compiled with Buffer::Options::compressed
+std::string format_node(const ASTNode *node, bool compressed = false)
 {
     if (node->isInteger())
     {
@@ -25,18 +33,121 @@ std::string format_node(const ASTNode *node)
     {
         return std::string("'") + node->asSymbol()->str;
     }
+    else if (node->isNil())
+    {
+        return "()";
+    }
+    else if (node->isPair() && compressed)
+    {
+        auto pair = node->asCompressedPair();
+        return std::string("(cons ") + format_node(pair->getCar(), true) + " " + format_node(pair->getCdr(), true) + ")";
+    }
     else if (node->isPair())
     {
         auto pair = node->asPair();
         return std::string("(cons ") + format_node(pair->car) + " " + format_node(pair->cdr) + ")";
     }
+    else if (node->isString())
+    {
+        return "\"" + std::string{node->asString()->view()} + "\"";
+    }
+    else if (node->isVector())
+    {
+        auto vector = node->asVector();
+        std::string result = "#(";
+        for (size_t i = 0; i < vector->size(); ++i)
+        {
+            result += (i ? " " : "") + format_node(vector->elements()[i], compressed);
+        }
+        return result + ")";
+    }
     assert(false);
     return {};
 }
 
-int repl()
+// Natives the REPL offers through foreign-call
+static void write_int(word value)
+{
+    fmt::print("{}", value);
+}
+
+static void write_char(char c)
+{
+    fmt::print("{}", c);
+}
+
+static void newline()
+{
+    fmt::print("\n");
+}
+
+void print_stats()
+{
+    if (!Stats::enabled())
+    {
+        fmt::print("Stats are disabled in this build (configure with ALISP_ENABLE_STATS=ON)\n");
+        return;
+    }
+    fmt::print("{:<10} {:>8} {:>12} {:>10} {:>10} {:>10} {:>10} {:>10}\n",
+               "phase", "count", "total ms", "mean us", "p50 us", "p99 us", "max us", "MB/s");
+    for (int i = 0; i < static_cast<int>(Stats::Phase::Count); ++i)
+    {
+        auto phase = static_cast<Stats::Phase>(i);
+        auto stats = Stats::get(phase);
+        auto mean = stats.count ? stats.totalNs / 1e3 / stats.count : 0.0;
+        auto throughput = stats.totalNs ? stats.bytes * 1e3 / stats.totalNs : 0.0;
+        fmt::print("{:<10} {:>8} {:>12.3f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}\n",
+                   Stats::name(phase), stats.count, stats.totalNs / 1e6, mean,
+                   stats.quantileNs(0.5) / 1e3, stats.quantileNs(0.99) / 1e3, stats.maxNs / 1e3, throughput);
+    }
+}
+
+// Compiles `source` like the engine does, without running it, and prints
+// the code and how many bytes each kind of form takes
+void print_disasm(const std::string &source, const Globals &globals, const Foreign &foreign, bool compressed)
+{
+    auto node = Reader::read(std::string{source});
+    if (node->isError())
+    {
+        fmt::print(std::cerr, "Parse error!\n");
+        return;
+    }
+    Buffer buf;
+    buf._options.globals = globals.table();
+    buf._options.foreign = &foreign;
+    buf._options.compressed = compressed;
+    buf._options.recordNodes = true;
+    if (Compile::function(buf, node.get()) != 0)
+    {
+        fmt::print(std::cerr, "Compile error\n");
+        return;
+    }
+    fmt::print("{}\n", Disasm::listing(buf));
+    fmt::print("{:<16} {:>6} {:>8} {:>7}\n", "kind", "forms", "bytes", "share");
+    for (auto &size : Disasm::sizes(buf))
+    {
+        fmt::print("{:<16} {:>6} {:>8} {:>6.1f}%\n", size.kind, size.forms, size.bytes, 100.0 * size.bytes / buf.size());
+    }
+    fmt::print("{:<16} {:>6} {:>8}\n", "total", "", buf.size());
+}
+
+int repl(bool compressed)
 {
     using namespace std;
+    // One-shot lines are interpreted; lines that are run again get compiled
+    Engine::Policy policy;
+    policy.compressed = compressed;
+    Engine engine{policy};
+    // Functions defined with `define`, kept for the whole session
+    Globals globals{compressed};
+    engine.setGlobals(&globals);
+    Foreign foreign;
+    foreign.add("write-int", &write_int);
+    foreign.add("write-char", &write_char);
+    foreign.add("newline", &newline);
+    engine.setForeign(&foreign);
+    // Every line starts from the bottom of the heap, like the stack array
+    auto compressedHeap = compressed ? std::make_unique<CompressedHeap>(sizeof(uword[256])) : nullptr;
     do
     {
         fmt::print("lisp>");
@@ -46,31 +157,84 @@ int repl()
             fmt::print("Good bye\n");
             break;
         }
+        if (line == ",stats")
+        {
+            print_stats();
+            continue;
+        }
+        if (line == ",stats reset")
+        {
+            Stats::reset();
+            continue;
+        }
+        if (line.rfind(",disasm ", 0) == 0)
+        {
+            print_disasm(line.substr(8), globals, foreign, compressed);
+            continue;
+        }
         // parse the line
-        auto node = Reader::read(std::move(line));
+        auto node = Reader::read(std::string{line});
         if (node->isError())
         {
             fmt::print(cerr, "Parse error!\n");
             continue;
         }
-        // Compile the line
-        Buffer buf;
-        auto result = Compile::function(buf, node.get());
-        if (result != 0)
+        if (Globals::isDefine(node.get()))
         {
-            fmt::print(cerr, "Compile error\n");
+            if (globals.define(node.get()) != 0)
+            {
+                fmt::print(cerr, "Compile error\n");
+                continue;
+            }
+            fmt::print("Defined {}\n", node->asPair()->cdr->asPair()->car->asSymbol()->str);
             continue;
         }
-        auto code = buf.freeze();
+        // Interpret or compile and run the line
         uword heap[256];
-        auto executionResult = code.toFunc<ASTNode *(uword *)>()(heap);
-        fmt::print("Result = {}\n", format_node(executionResult));
+        auto executionResult = engine.run(line, node.get(), compressed ? compressedHeap->data() : heap);
+        if (!executionResult)
+        {
+            fmt::print(cerr, "Compile error\n");
+            continue;
+        }
+        fmt::print("Result = {}\n", format_node(*executionResult, compressed));
     } while (true);
     return 0;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     std::ios::sync_with_stdio(false);
-    return repl();
+    unsigned perfModes = 0;
+    auto compressed = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--perf-map")
+        {
+            perfModes |= PerfMap::Map;
+        }
+        else if (arg == "--jitdump")
+        {
+            perfModes |= PerfMap::JitDump;
+        }
+        else if (arg == "--gdb")
+        {
+            GdbJit::enable();
+        }
+        else if (arg == "--compressed")
+        {
+            compressed = true;
+        }
+        else
+        {
+            fmt::print(std::cerr, "Usage: alisp [--perf-map] [--jitdump] [--gdb] [--compressed]\n");
+            return 1;
+        }
+    }
+    if (perfModes && !PerfMap::enable(perfModes))
+    {
+        fmt::print(std::cerr, "Could not open perf map files\n");
+    }
+    return repl(compressed);
 }
\ No newline at end of file
@@ -0,0 +1,474 @@
+#include "optimize.h"
+#include "interp.h"
+
+#include <cassert>
+#include <climits>
+#include <vector>
+
+namespace Optimize
+{
+    // Labels bigger than this are called rather than inlined
+    constexpr int InlineNodeLimit = 32;
+
+    static const char *const foldable[] = {
+        "add1", "sub1", "integer->char", "char->integer", "nil?", "zero?", "not",
+        "integer?", "boolean?", "+", "-", "*", "=", "<", "quotient", "remainder", "modulo",
+    };
+
+    static bool isLiteral(ASTNode *node)
+    {
+        return node->isInteger() || node->isChar() || node->isBool() || node->isNil();
+    }
+
+    // A folded value is compiled as a literal, so it must decode back to the
+    // same bits. Emit::movRegImm loads any of them, however wide.
+    static bool isEncodableLiteral(ASTNode *node)
+    {
+        auto raw = reinterpret_cast<word>(node);
+        return (node->isInteger() && Objects::encodeInteger(node->getInteger()) == raw) ||
+               (node->isChar() && Objects::encodeChar(node->getChar()) == raw) ||
+               (node->isBool() && Objects::encodeBool(node->getBool()) == raw) ||
+               node->isNil();
+    }
+
+    static ASTNode *copy(ASTNode *node)
+    {
+        if (node->isPair())
+        {
+            return ASTNode::newPair(copy(node->asPair()->car), copy(node->asPair()->cdr));
+        }
+        if (node->isSymbol())
+        {
+            return ASTNode::newSymbol(node->asSymbol()->str);
+        }
+        if (node->isString())
+        {
+            return ASTNode::newString(node->asString()->view());
+        }
+        return node;
+    }
+
+    static ASTNode *list(const std::vector<ASTNode *> &items)
+    {
+        auto result = ASTNode::nil();
+        for (auto item = items.rbegin(); item != items.rend(); ++item)
+        {
+            result = ASTNode::newPair(*item, result);
+        }
+        return result;
+    }
+
+    static bool isCall(ASTNode *node, const char *name)
+    {
+        return node->isPair() && node->asPair()->car->isSymbol() && node->asPair()->car->asSymbol()->str == name;
+    }
+
+    static int countNodes(ASTNode *node)
+    {
+        if (!node->isPair())
+        {
+            return 1;
+        }
+        return countNodes(node->asPair()->car) + countNodes(node->asPair()->cdr);
+    }
+
+    static bool hasLabelcall(ASTNode *node)
+    {
+        if (!node->isPair())
+        {
+            return false;
+        }
+        return isCall(node, "labelcall") || hasLabelcall(node->asPair()->car) || hasLabelcall(node->asPair()->cdr);
+    }
+
+    // The variable a car or cdr reads, if its operand is one
+    static const std::string *projected(ASTNode *node)
+    {
+        if (!isCall(node, "car") && !isCall(node, "cdr"))
+        {
+            return nullptr;
+        }
+        auto args = node->asPair()->cdr;
+        if (!args->isPair())
+        {
+            return nullptr;
+        }
+        auto operand = args->asPair()->car;
+        return operand->isSymbol() ? &operand->asSymbol()->str : nullptr;
+    }
+
+    // True if `node` only reads `name` as the operand of car or cdr: a pair
+    // bound to it then never escapes, and its halves can be locals instead
+    static bool onlyProjected(ASTNode *node, const std::string &name)
+    {
+        if (node->isSymbol())
+        {
+            return node->asSymbol()->str != name;
+        }
+        if (!node->isPair())
+        {
+            return true;
+        }
+        if (auto variable = projected(node); variable && *variable == name)
+        {
+            return true;
+        }
+        if (isCall(node, "let"))
+        {
+            auto args = node->asPair()->cdr;
+            auto shadowed = false;
+            for (auto binding = args->asPair()->car; !binding->isNil(); binding = binding->asPair()->cdr)
+            {
+                auto pair = binding->asPair()->car->asPair();
+                if (!onlyProjected(pair->cdr->asPair()->car, name))
+                {
+                    return false;
+                }
+                shadowed = shadowed || pair->car->asSymbol()->str == name;
+            }
+            return shadowed || onlyProjected(args->asPair()->cdr->asPair()->car, name);
+        }
+        for (auto item = node; !item->isNil(); item = item->asPair()->cdr)
+        {
+            if (!onlyProjected(item->asPair()->car, name))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The local that holds one half of the pair bound to `name`. The reader
+    // never makes symbols with a '#', so it cannot clash with a user's.
+    static ASTNode *halfName(const std::string &name, bool car)
+    {
+        return ASTNode::newSymbol(name + (car ? "#car" : "#cdr"));
+    }
+
+    // A copy of `node` with (car name) and (cdr name) reading the locals
+    static ASTNode *project(ASTNode *node, const std::string &name)
+    {
+        if (!node->isPair())
+        {
+            return copy(node);
+        }
+        if (auto variable = projected(node); variable && *variable == name)
+        {
+            return halfName(name, isCall(node, "car"));
+        }
+        if (isCall(node, "let"))
+        {
+            auto args = node->asPair()->cdr;
+            auto shadowed = false;
+            std::vector<ASTNode *> bindings;
+            for (auto binding = args->asPair()->car; !binding->isNil(); binding = binding->asPair()->cdr)
+            {
+                auto pair = binding->asPair()->car->asPair();
+                bindings.push_back(list({copy(pair->car), project(pair->cdr->asPair()->car, name)}));
+                shadowed = shadowed || pair->car->asSymbol()->str == name;
+            }
+            auto body = args->asPair()->cdr->asPair()->car;
+            return list({ASTNode::newSymbol("let"), list(bindings), shadowed ? copy(body) : project(body, name)});
+        }
+        std::vector<ASTNode *> items;
+        for (auto item = node; !item->isNil(); item = item->asPair()->cdr)
+        {
+            items.push_back(project(item->asPair()->car, name));
+        }
+        return list(items);
+    }
+
+    // Escape analysis: finds a binding of `(let (bindings...) body)` to a
+    // cons that does not escape the body and returns the let's arguments
+    // with the pair replaced by a local for each half. Evaluation order is
+    // unchanged. Returns null if there is no such binding.
+    static ASTNode *scalarReplace(ASTNode *args)
+    {
+        auto bindings = args->asPair()->car;
+        auto body = args->asPair()->cdr->asPair()->car;
+        for (auto binding = bindings; !binding->isNil(); binding = binding->asPair()->cdr)
+        {
+            auto pair = binding->asPair()->car->asPair();
+            auto &name = pair->car->asSymbol()->str;
+            auto value = pair->cdr->asPair()->car;
+            if (!isCall(value, "cons") || !onlyProjected(body, name))
+            {
+                continue;
+            }
+            // The body sees the last of several bindings of the same name
+            auto rebound = false;
+            for (auto later = binding->asPair()->cdr; !later->isNil(); later = later->asPair()->cdr)
+            {
+                rebound = rebound || later->asPair()->car->asPair()->car->asSymbol()->str == name;
+            }
+            if (rebound)
+            {
+                continue;
+            }
+            std::vector<ASTNode *> replaced;
+            for (auto other = bindings; !other->isNil(); other = other->asPair()->cdr)
+            {
+                if (other != binding)
+                {
+                    replaced.push_back(copy(other->asPair()->car));
+                    continue;
+                }
+                auto halves = value->asPair()->cdr;
+                replaced.push_back(list({halfName(name, true), copy(halves->asPair()->car)}));
+                replaced.push_back(list({halfName(name, false), copy(halves->asPair()->cdr->asPair()->car)}));
+            }
+            return list({list(replaced), project(body, name)});
+        }
+        return nullptr;
+    }
+
+    // Variables in scope while rewriting. A variable without a value shadows
+    // an outer constant.
+    struct Scope
+    {
+        const std::string &name;
+        std::optional<ASTNode *> value;
+        const Scope *prev;
+
+        static const Scope *find(const Scope *scope, const std::string &name)
+        {
+            for (; scope; scope = scope->prev)
+            {
+                if (scope->name == name)
+                {
+                    return scope;
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    // True if every variable `node` reads is bound in `scope`. Inlining a body
+    // that reads anything else would let it see the caller's variables.
+    static bool isClosed(ASTNode *node, const Scope *scope)
+    {
+        if (node->isSymbol())
+        {
+            return Scope::find(scope, node->asSymbol()->str) != nullptr;
+        }
+        if (!node->isPair())
+        {
+            return true;
+        }
+        auto args = node->asPair()->cdr;
+        if (isCall(node, "let"))
+        {
+            std::vector<Scope> entries;
+            entries.reserve(countNodes(args));
+            auto bodyScope = scope;
+            for (auto binding = args->asPair()->car; !binding->isNil(); binding = binding->asPair()->cdr)
+            {
+                auto pair = binding->asPair()->car->asPair();
+                if (!isClosed(pair->cdr->asPair()->car, scope))
+                {
+                    return false;
+                }
+                entries.push_back(Scope{pair->car->asSymbol()->str, {}, bodyScope});
+                bodyScope = &entries.back();
+            }
+            return isClosed(args->asPair()->cdr->asPair()->car, bodyScope);
+        }
+        for (auto arg = args; !arg->isNil(); arg = arg->asPair()->cdr)
+        {
+            if (!isClosed(arg->asPair()->car, scope))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    struct Optimizer
+    {
+        // Integer 0 is a null ASTNode*, so "not folded" needs its own value
+        std::optional<ASTNode *> fold(const std::string &name, const std::vector<ASTNode *> &args)
+        {
+            for (auto op : foldable)
+            {
+                if (name != op)
+                {
+                    continue;
+                }
+                for (auto arg : args)
+                {
+                    if (!isLiteral(arg))
+                    {
+                        return {};
+                    }
+                }
+                // Evaluate it the way the generated code would
+                std::vector<ASTNode *> items{ASTNode::newSymbol(name)};
+                items.insert(items.end(), args.begin(), args.end());
+                auto call = list(items);
+                auto result = Interp::run(call, nullptr);
+                heapFree(call);
+                if (result && isEncodableLiteral(*result))
+                {
+                    return result;
+                }
+                return {};
+            }
+            return {};
+        }
+
+        ASTNode *let(ASTNode *args, const Scope *scope)
+        {
+            if (auto replaced = scalarReplace(args))
+            {
+                auto result = let(replaced, scope);
+                heapFree(replaced);
+                return result;
+            }
+            std::vector<Scope> entries;
+            entries.reserve(countNodes(args));
+            std::vector<ASTNode *> kept;
+            auto bodyScope = scope;
+            for (auto binding = args->asPair()->car; !binding->isNil(); binding = binding->asPair()->cdr)
+            {
+                auto pair = binding->asPair()->car->asPair();
+                auto &name = pair->car->asSymbol()->str;
+                // `let` is not `let*`: every binding sees the outer scope
+                auto value = rewrite(pair->cdr->asPair()->car, scope);
+                if (isLiteral(value))
+                {
+                    entries.push_back(Scope{name, value, bodyScope});
+                }
+                else
+                {
+                    kept.push_back(list({ASTNode::newSymbol(name), value}));
+                    entries.push_back(Scope{name, {}, bodyScope});
+                }
+                bodyScope = &entries.back();
+            }
+            auto body = rewrite(args->asPair()->cdr->asPair()->car, bodyScope);
+            if (kept.empty())
+            {
+                return body;
+            }
+            return list({ASTNode::newSymbol("let"), list(kept), body});
+        }
+
+        ASTNode *labelcall(ASTNode *args, const Scope *scope)
+        {
+            auto &name = args->asPair()->car->asSymbol()->str;
+            std::vector<ASTNode *> values;
+            for (auto arg = args->asPair()->cdr; !arg->isNil(); arg = arg->asPair()->cdr)
+            {
+                values.push_back(rewrite(arg->asPair()->car, scope));
+            }
+
+            auto found = labels.find(name);
+            if (found != labels.end())
+            {
+                auto codeArgs = found->second->asPair()->cdr;
+                auto formals = codeArgs->asPair()->car;
+                auto body = codeArgs->asPair()->cdr->asPair()->car;
+
+                std::vector<Scope> entries;
+                entries.reserve(countNodes(formals));
+                const Scope *formalScope = nullptr;
+                for (auto formal = formals; !formal->isNil(); formal = formal->asPair()->cdr)
+                {
+                    entries.push_back(Scope{formal->asPair()->car->asSymbol()->str, {}, formalScope});
+                    formalScope = &entries.back();
+                }
+
+                if (entries.size() == values.size() && !hasLabelcall(body) &&
+                    countNodes(body) <= InlineNodeLimit && isClosed(body, formalScope))
+                {
+                    // (labelcall f a b) => (let ((x a) (y b)) body)
+                    std::vector<ASTNode *> bindings;
+                    auto formal = formals;
+                    for (auto value : values)
+                    {
+                        bindings.push_back(list({copy(formal->asPair()->car), value}));
+                        formal = formal->asPair()->cdr;
+                    }
+                    auto inlined = list({ASTNode::newSymbol("let"), list(bindings), copy(body)});
+                    auto result = let(inlined->asPair()->cdr, nullptr);
+                    heapFree(inlined);
+                    return result;
+                }
+            }
+
+            values.insert(values.begin(), ASTNode::newSymbol(name));
+            values.insert(values.begin(), ASTNode::newSymbol("labelcall"));
+            return list(values);
+        }
+
+        ASTNode *rewrite(ASTNode *node, const Scope *scope)
+        {
+            if (node->isSymbol())
+            {
+                auto found = Scope::find(scope, node->asSymbol()->str);
+                if (found && found->value)
+                {
+                    return *found->value;
+                }
+                return copy(node);
+            }
+            if (!node->isPair())
+            {
+                return copy(node);
+            }
+            auto callable = node->asPair()->car;
+            auto args = node->asPair()->cdr;
+            assert(callable->isSymbol());
+            auto &name = callable->asSymbol()->str;
+
+            if (name == "let")
+            {
+                return let(args, scope);
+            }
+            if (name == "labelcall")
+            {
+                return labelcall(args, scope);
+            }
+            if (name == "if")
+            {
+                auto condition = rewrite(args->asPair()->car, scope);
+                auto onThen = args->asPair()->cdr->asPair()->car;
+                auto onElse = args->asPair()->cdr->asPair()->cdr->asPair()->car;
+                if (isEncodableLiteral(condition))
+                {
+                    auto taken = reinterpret_cast<word>(condition) != Objects::encodeBool(false);
+                    return rewrite(taken ? onThen : onElse, scope);
+                }
+                return list({ASTNode::newSymbol("if"), condition, rewrite(onThen, scope), rewrite(onElse, scope)});
+            }
+
+            std::vector<ASTNode *> values;
+            for (auto arg = args; !arg->isNil(); arg = arg->asPair()->cdr)
+            {
+                values.push_back(rewrite(arg->asPair()->car, scope));
+            }
+            if (auto folded = fold(name, values))
+            {
+                return *folded;
+            }
+            values.insert(values.begin(), ASTNode::newSymbol(name));
+            return list(values);
+        }
+
+        const Labels &labels;
+    };
+
+    ASTNode *expr(ASTNode *node, const Labels &labels)
+    {
+        return Optimizer{labels}.rewrite(node, nullptr);
+    }
+
+    ASTNode *code(ASTNode *code, const Labels &labels)
+    {
+        assert(isCall(code, "code"));
+        auto args = code->asPair()->cdr;
+        auto formals = args->asPair()->car;
+        auto body = args->asPair()->cdr->asPair()->car;
+        return list({ASTNode::newSymbol("code"), copy(formals), expr(body, labels)});
+    }
+} // namespace Optimize
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "alisp.h"
+
+#include <unordered_map>
+
+// Optimize: AST to AST rewrites that the template compiler does not do on
+// its own. The result is always a fresh tree owned by the caller; the input
+// is left untouched.
+namespace Optimize
+{
+    // `code` nodes of the labels in scope, by name
+    using Labels = std::unordered_map<std::string, ASTNode *>;
+
+    // Folds constant primitives and `if`s, propagates `let`-bound constants,
+    // inlines small labels that make no calls of their own and replaces
+    // `let`-bound pairs that are only taken apart with locals for their halves
+    ASTNode *expr(ASTNode *node, const Labels &labels);
+
+    // Optimizes the body of a `(code (formals...) body)` node
+    ASTNode *code(ASTNode *code, const Labels &labels);
+} // namespace Optimize
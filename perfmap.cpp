@@ -0,0 +1,198 @@
+#include "perfmap.h"
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+
+namespace PerfMap
+{
+    // See tools/perf/Documentation/jitdump-specification.txt in the Linux tree
+    constexpr uint32_t JitDumpMagic = 0x4A695444;
+    constexpr uint32_t JitDumpVersion = 1;
+    constexpr uint32_t ElfMachineX86_64 = 62;
+    constexpr uint32_t JitCodeLoad = 0;
+
+    struct JitDumpHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t totalSize;
+        uint32_t elfMach;
+        uint32_t pad1;
+        uint32_t pid;
+        uint64_t timestamp;
+        uint64_t flags;
+    };
+    static_assert(sizeof(JitDumpHeader) == 40, "jitdump header layout");
+
+    struct JitCodeLoadRecord
+    {
+        uint32_t id;
+        uint32_t totalSize;
+        uint64_t timestamp;
+        uint32_t pid;
+        uint32_t tid;
+        uint64_t vma;
+        uint64_t codeAddr;
+        uint64_t codeSize;
+        uint64_t codeIndex;
+    };
+    static_assert(sizeof(JitCodeLoadRecord) == 56, "jitdump record layout");
+
+    static std::mutex mutex;
+    static std::atomic<bool> on{false};
+    static FILE *mapFile = nullptr;
+    static FILE *dumpFile = nullptr;
+    static std::string mapPath;
+    static std::string dumpPath;
+    static uint64_t codeIndex = 0;
+
+    static uint64_t timestamp()
+    {
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    static std::string tempDirectory()
+    {
+        char path[MAX_PATH + 1];
+        auto length = GetTempPathA(sizeof(path), path);
+        return length ? std::string(path, length) : std::string{};
+    }
+
+    static void closeFiles()
+    {
+        if (mapFile)
+        {
+            fclose(mapFile);
+            mapFile = nullptr;
+        }
+        if (dumpFile)
+        {
+            fclose(dumpFile);
+            dumpFile = nullptr;
+        }
+        mapPath.clear();
+        dumpPath.clear();
+    }
+
+    bool enable(unsigned modes, const std::string &directory)
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        closeFiles();
+        auto dir = directory.empty() ? tempDirectory() : directory;
+        if (!dir.empty() && dir.back() != '/' && dir.back() != '\\')
+        {
+            dir += '/';
+        }
+        auto pid = GetCurrentProcessId();
+        if (modes & Map)
+        {
+            mapPath = dir + "perf-" + std::to_string(pid) + ".map";
+            mapFile = fopen(mapPath.c_str(), "wb");
+        }
+        if (modes & JitDump)
+        {
+            dumpPath = dir + "jit-" + std::to_string(pid) + ".dump";
+            dumpFile = fopen(dumpPath.c_str(), "wb");
+            if (dumpFile)
+            {
+                JitDumpHeader header{JitDumpMagic, JitDumpVersion, sizeof(JitDumpHeader), ElfMachineX86_64, 0,
+                                     static_cast<uint32_t>(pid), timestamp(), 0};
+                fwrite(&header, sizeof(header), 1, dumpFile);
+                fflush(dumpFile);
+            }
+        }
+        bool ok = (!(modes & Map) || mapFile) && (!(modes & JitDump) || dumpFile);
+        if (!ok)
+        {
+            closeFiles();
+        }
+        on = ok && modes;
+        return ok;
+    }
+
+    void disable()
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        on = false;
+        closeFiles();
+    }
+
+    bool enabled()
+    {
+        return on.load(std::memory_order_relaxed);
+    }
+
+    std::string filePath(Mode mode)
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        return mode == Map ? mapPath : dumpPath;
+    }
+
+    std::string symbolName(const std::string &label)
+    {
+        return "lisp:" + label;
+    }
+
+    static void writeRegion(const uint8_t *start, const uint8_t *bytes, size_t size, const std::string &name)
+    {
+        auto address = reinterpret_cast<uint64_t>(start);
+        if (mapFile)
+        {
+            fprintf(mapFile, "%llx %llx %s\n", static_cast<unsigned long long>(address),
+                    static_cast<unsigned long long>(size), name.c_str());
+        }
+        if (dumpFile)
+        {
+            JitCodeLoadRecord record{JitCodeLoad,
+                                     static_cast<uint32_t>(sizeof(record) + name.size() + 1 + size),
+                                     timestamp(),
+                                     static_cast<uint32_t>(GetCurrentProcessId()),
+                                     static_cast<uint32_t>(GetCurrentThreadId()),
+                                     address,
+                                     address,
+                                     size,
+                                     codeIndex++};
+            fwrite(&record, sizeof(record), 1, dumpFile);
+            fwrite(name.c_str(), name.size() + 1, 1, dumpFile);
+            fwrite(bytes, size, 1, dumpFile);
+        }
+    }
+
+    void registerCode(const Code &code, const Buffer &buf)
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (!on)
+        {
+            return;
+        }
+        // Code pages are execute-only, so the bytes come from the buffer
+        auto &labels = buf._labels;
+        if (labels.empty())
+        {
+            writeRegion(code.data(), buf._buf.data(), code.size(), symbolName("code"));
+        }
+        for (auto i = 0u; i < labels.size(); ++i)
+        {
+            auto start = labels[i].offset;
+            auto end = i + 1 < labels.size() ? labels[i + 1].offset : code.size();
+            if (end > start)
+            {
+                writeRegion(code.data() + start, buf._buf.data() + start, end - start, symbolName(labels[i].name));
+            }
+        }
+        if (mapFile)
+        {
+            fflush(mapFile);
+        }
+        if (dumpFile)
+        {
+            fflush(dumpFile);
+        }
+    }
+} // namespace PerfMap
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "alisp.h"
+
+// PerfMap: tells Linux `perf` about JIT code. When enabled, every frozen Code
+// appends one `perf-<pid>.map` line per label, and optionally a
+// JIT_CODE_LOAD record with the code bytes to `jit-<pid>.dump`. Both go to
+// the directory given to enable(), else to GetTempPath's (%TEMP%, or /tmp
+// when built for Linux). perf only reads the map from /tmp/perf-<pid>.map,
+// so under WSL pass "/tmp" or copy the file there, and use the pid perf sees.
+namespace PerfMap
+{
+    enum Mode : unsigned
+    {
+        Map = 1,
+        JitDump = 2,
+    };
+
+    // Opens the output files in `directory` (the temp directory by default)
+    bool enable(unsigned modes, const std::string &directory = {});
+    void disable();
+    bool enabled();
+
+    // Path of the file written for `mode`, empty when it is not enabled
+    std::string filePath(Mode mode);
+
+    // `buf` is the buffer `code` was frozen from
+    void registerCode(const Code &code, const Buffer &buf);
+
+    // Symbol name used for a label, e.g. `lisp:factorial`
+    std::string symbolName(const std::string &label);
+} // namespace PerfMap
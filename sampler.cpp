@@ -0,0 +1,51 @@
+#include "sampler.h"
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+Sampler::Sampler(std::chrono::microseconds interval)
+    : _target{::OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE,
+                           ::GetCurrentThreadId())},
+      _interval{interval}
+{
+    _thread = std::thread{&Sampler::loop, this};
+}
+
+Sampler::~Sampler()
+{
+    stop();
+    ::CloseHandle(_target);
+}
+
+std::vector<uint64_t> Sampler::stop()
+{
+    _stopping = true;
+    if (_thread.joinable())
+    {
+        _thread.join();
+    }
+    return _samples;
+}
+
+void Sampler::loop()
+{
+    while (!_stopping)
+    {
+        std::this_thread::sleep_for(_interval);
+        if (::SuspendThread(_target) == static_cast<DWORD>(-1))
+        {
+            continue;
+        }
+        // Nothing may allocate while the target is suspended: it could be
+        // holding the heap lock
+        alignas(16) CONTEXT context{};
+        context.ContextFlags = CONTEXT_CONTROL;
+        auto got = ::GetThreadContext(_target, &context);
+        ::ResumeThread(_target);
+        if (got)
+        {
+            _samples.push_back(context.Rip);
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Sampler: a sampling profiler for the thread that creates it. Another
+// thread suspends it every `interval`, reads its instruction pointer and
+// resumes it. SourceMap::annotate turns the samples into counts per line.
+class Sampler final
+{
+public:
+    explicit Sampler(std::chrono::microseconds interval = std::chrono::milliseconds{1});
+    Sampler(const Sampler &) = delete;
+    Sampler &operator=(const Sampler &) = delete;
+    ~Sampler();
+
+    // Stops sampling and returns the instruction pointers seen
+    std::vector<uint64_t> stop();
+
+private:
+    void loop();
+
+    void *_target;
+    std::chrono::microseconds _interval;
+    std::atomic<bool> _stopping{false};
+    std::vector<uint64_t> _samples;
+    std::thread _thread;
+};
@@ -0,0 +1,249 @@
+#include "scheduler.h"
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <algorithm>
+
+using Clock = std::chrono::steady_clock;
+
+struct Scheduler::Task
+{
+    TaskId id;
+    std::unique_ptr<Code> code;
+    std::vector<uword> heap;
+    SafepointControl control;
+    std::chrono::microseconds fuel;
+    std::atomic<bool> cancelRequested{};
+
+    // Owned by whichever thread runs the task
+    void *fiber{};
+    void *worker{};
+    // Where abandonTask starts after an overflow: near the top of the fiber's stack
+    uintptr_t resumeAt{};
+    Clock::time_point sliceStart;
+    Clock::duration used{};
+    // Set on the fiber when it will not run again
+    std::optional<Status> outcome;
+    ASTNode *value{};
+
+    // Guarded by the scheduler's mutex
+    Status status = Status::Running;
+};
+
+// Runs the program on the task's fiber. Nothing here may need a destructor:
+// a task that is stopped at a safepoint never returns to this frame.
+void Scheduler::runTask(void *param)
+{
+    auto task = static_cast<Task *>(param);
+    char top;
+    task->resumeAt = reinterpret_cast<uintptr_t>(&top);
+    auto entry = task->code->toFunc<ASTNode *(uword *, SafepointControl *)>();
+    task->value = entry(task->heap.data(), &task->control);
+    task->outcome = Status::Finished;
+    SwitchToFiber(task->worker);
+}
+
+thread_local Scheduler::Task *Scheduler::t_running = nullptr;
+
+Scheduler::Scheduler(Options options) : _options{options}
+{
+    // In front of handlers registered before, which may treat the overflow as fatal
+    _handler = AddVectoredExceptionHandler(1, &Scheduler::onException);
+    for (int i = 0; i < _options.threads; ++i)
+    {
+        _workers.emplace_back(&Scheduler::workerLoop, this);
+    }
+    _timer = std::thread{&Scheduler::preemptLoop, this};
+}
+
+Scheduler::~Scheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        for (auto &task : _tasks)
+        {
+            task->cancelRequested = true;
+            task->control.yieldRequested = 1;
+        }
+        _stopping = true;
+    }
+    _ready.notify_all();
+    for (auto &worker : _workers)
+    {
+        worker.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        _stopTimer = true;
+    }
+    _tick.notify_all();
+    _timer.join();
+    RemoveVectoredExceptionHandler(_handler);
+}
+
+Scheduler::TaskId Scheduler::spawn(const std::string &source, std::chrono::microseconds fuel)
+{
+    auto task = std::make_unique<Task>();
+    task->fuel = fuel;
+    task->control.stub = reinterpret_cast<uint64_t>(Compile::safepointStub().data());
+    task->control.handler = &Scheduler::onSafepoint;
+    task->control.context = task.get();
+
+    auto node = Reader::read(std::string{source});
+    Buffer buf;
+    buf._options.safepoints = true;
+    auto compiled = !node->isError() && Compile::function(buf, node.get()) == 0;
+    if (compiled)
+    {
+        task->code = std::make_unique<Code>(buf.freeze());
+        task->heap.resize(_options.heapWords);
+    }
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    task->id = _tasks.size();
+    if (!compiled)
+    {
+        task->status = Status::CompileError;
+    }
+    else
+    {
+        _queue.push_back(task.get());
+        _ready.notify_one();
+    }
+    _tasks.push_back(std::move(task));
+    return _tasks.back()->id;
+}
+
+void Scheduler::cancel(TaskId id)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    auto &task = _tasks.at(id);
+    task->cancelRequested = true;
+    task->control.yieldRequested = 1;
+}
+
+Scheduler::Result Scheduler::wait(TaskId id)
+{
+    std::unique_lock<std::mutex> lock{_mutex};
+    auto task = _tasks.at(id).get();
+    _finished.wait(lock, [task] { return task->status != Status::Running; });
+    return Result{task->status, task->status == Status::Finished ? task->value : nullptr};
+}
+
+void Scheduler::onSafepoint(SafepointControl *control)
+{
+    auto task = static_cast<Task *>(control->context);
+    control->yieldRequested = 0;
+    task->used += Clock::now() - task->sliceStart;
+    if (task->cancelRequested)
+    {
+        task->outcome = Status::Cancelled;
+    }
+    else if (task->used >= task->fuel)
+    {
+        task->outcome = Status::OutOfFuel;
+    }
+    // Back to the worker, which requeues the task unless it has an outcome
+    SwitchToFiber(task->worker);
+}
+
+long Scheduler::onException(_EXCEPTION_POINTERS *info)
+{
+    auto task = t_running;
+    if (info->ExceptionRecord->ExceptionCode != EXCEPTION_STACK_OVERFLOW || !task ||
+        GetCurrentFiber() != task->fiber)
+    {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+    // As in JitStack: enter abandonTask near the top of the fiber's stack as
+    // if it had been called, with rsp 8 off 16-byte alignment
+    auto context = info->ContextRecord;
+    context->Rsp = (task->resumeAt & ~uintptr_t{15}) - 8;
+    context->Rip = reinterpret_cast<DWORD64>(&Scheduler::abandonTask);
+    return EXCEPTION_CONTINUE_EXECUTION;
+}
+
+void Scheduler::abandonTask()
+{
+    auto task = t_running;
+    task->outcome = Status::StackOverflow;
+    SwitchToFiber(task->worker);
+}
+
+void Scheduler::finish(Task *task, Status status)
+{
+    // A task that was preempted and then cancelled still has its fiber
+    if (task->fiber)
+    {
+        DeleteFiber(task->fiber);
+        task->fiber = nullptr;
+    }
+    task->status = status;
+    task->code.reset();
+    _finished.notify_all();
+}
+
+void Scheduler::workerLoop()
+{
+    auto self = ConvertThreadToFiber(nullptr);
+    std::unique_lock<std::mutex> lock{_mutex};
+    for (;;)
+    {
+        _ready.wait(lock, [this] { return _stopping || !_queue.empty(); });
+        if (_queue.empty())
+        {
+            break;
+        }
+        auto task = _queue.front();
+        _queue.pop_front();
+        if (task->cancelRequested)
+        {
+            finish(task, Status::Cancelled);
+            continue;
+        }
+        if (!task->fiber)
+        {
+            task->fiber = CreateFiberEx(0, _options.stackSize, 0, &runTask, task);
+            if (!task->fiber)
+            {
+                finish(task, Status::OutOfMemory);
+                continue;
+            }
+        }
+        _running.push_back(task);
+        lock.unlock();
+
+        task->worker = self;
+        task->sliceStart = Clock::now();
+        t_running = task;
+        SwitchToFiber(task->fiber);
+        t_running = nullptr;
+
+        lock.lock();
+        _running.erase(std::find(_running.begin(), _running.end(), task));
+        if (task->outcome)
+        {
+            finish(task, *task->outcome);
+        }
+        else
+        {
+            _queue.push_back(task);
+            _ready.notify_one();
+        }
+    }
+    lock.unlock();
+    ConvertFiberToThread();
+}
+
+void Scheduler::preemptLoop()
+{
+    std::unique_lock<std::mutex> lock{_mutex};
+    while (!_tick.wait_for(lock, _options.quantum, [this] { return _stopTimer; }))
+    {
+        for (auto task : _running)
+        {
+            task->control.yieldRequested = 1;
+        }
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "alisp.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+struct _EXCEPTION_POINTERS;
+
+// Scheduler: runs many programs as green threads on a few OS threads. Each
+// program is compiled with safepoints and runs on its own fiber. A timer asks
+// the running programs to yield every quantum; at its next safepoint a
+// program goes back to the queue, or is dropped if it has used up its fuel or
+// has been cancelled. A program that overflows its fiber's stack is stopped
+// the way JitStack stops one, without taking the other programs down.
+class Scheduler final
+{
+public:
+    struct Options
+    {
+        int threads = 2;
+        std::chrono::microseconds quantum{1000};
+        size_t heapWords = 1 << 16;
+        size_t stackSize = 1 << 20;
+    };
+
+    using TaskId = uint64_t;
+
+    enum class Status
+    {
+        Running,
+        Finished,
+        OutOfFuel,
+        Cancelled,
+        CompileError,
+        StackOverflow,
+        // No fiber could be made to run it on
+        OutOfMemory,
+    };
+
+    struct Result
+    {
+        Status status;
+        // Only meaningful when the task finished; it may point into the task's heap
+        ASTNode *value;
+    };
+
+    explicit Scheduler(Options options);
+    Scheduler() : Scheduler(Options{}) {}
+    ~Scheduler();
+
+    // `fuel` is the run time the program may use before it is stopped
+    TaskId spawn(const std::string &source, std::chrono::microseconds fuel);
+    void cancel(TaskId id);
+    Result wait(TaskId id);
+
+private:
+    struct Task;
+
+    // A fiber's entry point
+    static void runTask(void *param);
+    // SafepointControl::Handler
+    static void onSafepoint(SafepointControl *control);
+    // A vectored exception handler: resumes an overflowing task in abandonTask
+    static long onException(_EXCEPTION_POINTERS *info);
+    // Runs near the top of the overflowed fiber's stack and never returns
+    static void abandonTask();
+    void workerLoop();
+    void preemptLoop();
+    void finish(Task *task, Status status);
+
+    // The task whose fiber this worker thread is running, if any
+    static thread_local Task *t_running;
+
+    Options _options;
+    void *_handler{};
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::condition_variable _finished;
+    std::condition_variable _tick;
+    bool _stopping = false;
+    bool _stopTimer = false;
+    std::deque<std::unique_ptr<Task>> _tasks;
+    std::deque<Task *> _queue;
+    std::vector<Task *> _running;
+    std::vector<std::thread> _workers;
+    std::thread _timer;
+};
@@ -0,0 +1,85 @@
+#include "sourcemap.h"
+
+#include <algorithm>
+#include <cstdio>
+
+SourceMap::SourceMap(std::string source, const SourceSpans &spans, const Buffer &buf)
+    : _source{std::move(source)}
+{
+    for (auto &range : buf._nodeRanges)
+    {
+        // Nodes made by the compiler or the optimizer have no span
+        auto span = spans.find(range.node);
+        if (span != spans.end() && range.begin < range.end)
+        {
+            _ranges.push_back({range.begin, range.end, span->second});
+        }
+    }
+    std::sort(_ranges.begin(), _ranges.end(), [](const Range &a, const Range &b) {
+        return a.begin != b.begin ? a.begin < b.begin : a.end > b.end;
+    });
+    _lines.push_back(0);
+    for (size_t i = 0; i < _source.size(); ++i)
+    {
+        if (_source[i] == '\n')
+        {
+            _lines.push_back(i + 1);
+        }
+    }
+}
+
+std::optional<SourceMap::Location> SourceMap::find(size_t offset) const
+{
+    // The innermost range that covers offset is the last of those that start at or before it
+    auto after = std::upper_bound(_ranges.begin(), _ranges.end(), offset,
+                                  [](size_t offset, const Range &range) { return offset < range.begin; });
+    for (auto range = std::make_reverse_iterator(after); range != _ranges.rend(); ++range)
+    {
+        if (offset < range->end)
+        {
+            auto line = std::upper_bound(_lines.begin(), _lines.end(), range->span.begin) - _lines.begin();
+            return Location{range->span, static_cast<size_t>(line), range->span.begin - _lines[line - 1] + 1};
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<SourceMap::Location> SourceMap::find(const Code &code, uint64_t address) const
+{
+    auto start = reinterpret_cast<uint64_t>(code.data());
+    if (address < start || address >= start + code.size())
+    {
+        return std::nullopt;
+    }
+    return find(static_cast<size_t>(address - start));
+}
+
+std::string SourceMap::annotate(const Code &code, const std::vector<uint64_t> &addresses) const
+{
+    std::vector<size_t> counts(_lines.size());
+    size_t found = 0;
+    for (auto address : addresses)
+    {
+        if (auto location = find(code, address))
+        {
+            ++counts[location->line - 1];
+            ++found;
+        }
+    }
+    char header[64];
+    std::snprintf(header, sizeof(header), "%zu of %zu samples in this code\n", found, addresses.size());
+    std::string result = header;
+    for (size_t line = 0; line < _lines.size(); ++line)
+    {
+        auto end = line + 1 < _lines.size() ? _lines[line + 1] - 1 : _source.size();
+        char prefix[32] = "               | ";
+        if (counts[line])
+        {
+            std::snprintf(prefix, sizeof(prefix), "%7zu %5.1f%% | ", counts[line], 100.0 * counts[line] / found);
+        }
+        result += prefix;
+        result.append(_source, _lines[line], end - _lines[line]);
+        result += '\n';
+    }
+    return result;
+}
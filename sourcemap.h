@@ -0,0 +1,43 @@
+#pragma once
+
+#include "alisp.h"
+
+// SourceMap: which source compiled code came from. Built from the spans
+// Reader::read recorded and the NodeRanges of a Buffer compiled with
+// Buffer::Options::recordNodes.
+class SourceMap final
+{
+public:
+    struct Location
+    {
+        SourceSpan span;
+        // Where the span starts, both counted from 1
+        size_t line;
+        size_t column;
+    };
+
+    SourceMap(std::string source, const SourceSpans &spans, const Buffer &buf);
+
+    // The innermost form whose code covers `offset` into the buffer
+    std::optional<Location> find(size_t offset) const;
+    // The same for an address inside `code`, which was frozen from the buffer
+    std::optional<Location> find(const Code &code, uint64_t address) const;
+
+    // The source with every line prefixed by how many of `addresses` fall
+    // in code of a form that starts on it, e.g. samples from a Sampler
+    std::string annotate(const Code &code, const std::vector<uint64_t> &addresses) const;
+
+private:
+    struct Range
+    {
+        size_t begin;
+        size_t end;
+        SourceSpan span;
+    };
+
+    std::string _source;
+    // Ordered by begin, and enclosing ranges before the ones they contain
+    std::vector<Range> _ranges;
+    // Offset of the first byte of every line
+    std::vector<size_t> _lines;
+};
@@ -2,6 +2,24 @@
 #include <catch2/catch.hpp>
 
 #include "alisp.h"
+#include "disasm.h"
+#include "foreign.h"
+#include "gdbjit.h"
+#include "globals.h"
+#include "interp.h"
+#include "jitstack.h"
+#include "optimize.h"
+#include "perfmap.h"
+#include "sampler.h"
+#include "scheduler.h"
+#include "sourcemap.h"
+#include "tiering.h"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
 
 TEST_CASE("Encode positive integer", "[objects]")
 {
@@ -59,7 +77,7 @@ TEST_CASE("Compile positive integer", "[compiler]")
 
     std::vector<uint8_t> expected = {
         0x48, 0x89, 0xce,                         // mov esi, rcx
-        0x48, 0xc7, 0xc0, 0xec, 0x01, 0x00, 0x00, // mov eax, 123
+        0xb8, 0xec, 0x01, 0x00, 0x00,             // mov eax, 123
         0xc3                                      // ret
     };
     REQUIRE(expected == buf._buf);
@@ -98,7 +116,7 @@ TEST_CASE("Compile char", "[compiler]")
 
     std::vector<uint8_t> expected{
         0x48, 0x89, 0xce, // mov esi, rcx
-        0x48, 0xc7, 0xc0, 0x0f, 0x61, 0x00, 0x00,
+        0xb8, 0x0f, 0x61, 0x00, 0x00,
         0xc3};
     REQUIRE(expected == buf._buf);
 
@@ -117,7 +135,7 @@ TEST_CASE("Compile true", "[compiler]")
 
     std::vector<uint8_t> expected{
         0x48, 0x89, 0xce, // mov esi, rcx
-        0x48, 0xc7, 0xc0, 0x9f, 0x0, 0x0, 0x0,
+        0xb8, 0x9f, 0x0, 0x0, 0x0,
         0xc3};
     REQUIRE(expected == buf._buf);
 
@@ -136,7 +154,7 @@ TEST_CASE("Compile false", "[compiler]")
 
     std::vector<uint8_t> expected{
         0x48, 0x89, 0xce, // mov esi, rcx
-        0x48, 0xc7, 0xc0, 0x1f, 0x00, 0x00, 0x00,
+        0xb8, 0x1f, 0x00, 0x00, 0x00,
         0xc3};
     REQUIRE(expected == buf._buf);
 
@@ -152,7 +170,7 @@ TEST_CASE("Compile nil", "[compiler]")
     REQUIRE(compileResult == 0);
     std::vector<uint8_t> expected = {
         0x48, 0x89, 0xce, // mov esi, rcx
-        0x48, 0xc7, 0xc0, 0x2f, 0x00, 0x00, 0x00,
+        0xb8, 0x2f, 0x00, 0x00, 0x00,
         0xc3};
 
     REQUIRE(expected == buf._buf);
@@ -172,6 +190,68 @@ static std::unique_ptr<ASTNode, decltype(&heapFree)> makeUnaryCall(const std::st
     return wrap(ASTNode::newUnaryCall(name, arg));
 }
 
+// Compiles a whole program, failing the test if it does not compile
+static Buffer compileSource(const std::string &source, const Buffer::Options &options = {})
+{
+    auto node = Reader::read(std::string{source});
+    REQUIRE(!node->isError());
+    Buffer buf;
+    buf._options = options;
+    REQUIRE(0 == Compile::function(buf, node.get()));
+    return buf;
+}
+
+// Where `bytes` first occur in `code`, or code.size()
+static size_t findBytes(const std::vector<uint8_t> &code, const std::vector<uint8_t> &bytes)
+{
+    return static_cast<size_t>(std::search(code.begin(), code.end(), bytes.begin(), bytes.end()) - code.begin());
+}
+
+static bool containsBytes(const std::vector<uint8_t> &code, const std::vector<uint8_t> &bytes)
+{
+    return findBytes(code, bytes) < code.size();
+}
+
+TEST_CASE("Compile literals in the shortest encoding", "[compiler]")
+{
+    auto compile = [](ASTNode *node) {
+        Buffer buf;
+        REQUIRE(0 == Compile::function(buf, node));
+        // Drop the prologue and the ret
+        std::vector<uint8_t> body(buf._buf.begin() + 3, buf._buf.end() - 1);
+        auto result = buf.freeze().toFunc<uword()>()();
+        return std::make_pair(body, result);
+    };
+    auto zero = compile(ASTNode::newInteger(0));
+    REQUIRE(zero.first == std::vector<uint8_t>{0x31, 0xc0}); // xor eax, eax
+    REQUIRE(zero.second == Objects::encodeInteger(0));
+
+    // Fits in 32 bits unsigned once tagged: zero extending mov eax
+    word unsignedValue = 0x30000000;
+    auto mid = compile(ASTNode::newInteger(unsignedValue));
+    REQUIRE(mid.first == std::vector<uint8_t>{0xb8, 0x00, 0x00, 0x00, 0xc0});
+    REQUIRE(mid.second == Objects::encodeInteger(unsignedValue));
+
+    auto negative = compile(ASTNode::newInteger(-1));
+    REQUIRE(negative.first == std::vector<uint8_t>{0x48, 0xc7, 0xc0, 0xfc, 0xff, 0xff, 0xff}); // mov rax, -4
+    REQUIRE(negative.second == Objects::encodeInteger(-1));
+
+    // Wider values take a movabs
+    for (word value : {word{1} << 40, Objects::IntegerMax - 1, -(Objects::IntegerMax - 1)})
+    {
+        auto wide = compile(ASTNode::newInteger(value));
+        REQUIRE(wide.first.size() == 10);
+        REQUIRE(wide.first[1] == 0xb8);
+        REQUIRE(wide.second == Objects::encodeInteger(value));
+    }
+    auto node = Reader::read("(let ((x 123456789012)) (add1 x))");
+    uword heap[8];
+    REQUIRE(123456789013 == Interp::run(node.get(), heap).value()->getInteger());
+    Buffer buf;
+    REQUIRE(0 == Compile::function(buf, node.get()));
+    REQUIRE(123456789013 == buf.freeze().toFunc<ASTNode *(uword *)>()(heap)->getInteger());
+}
+
 TEST_CASE("Compile unary add1", "[compiler]")
 {
     Buffer buf;
@@ -181,8 +261,8 @@ TEST_CASE("Compile unary add1", "[compiler]")
 
     std::vector<uint8_t> expected{
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0xec, 0x01, 0x00, 0x00, // mov rax, imm(123)
-        0x48, 0x05, 0x04, 0x00, 0x00, 0x00,       // add rax, imm(1)
+        0xb8, 0xec, 0x01, 0x00, 0x00,             // mov eax, imm(123)
+        0x48, 0x83, 0xc0, 0x04,                   // add rax, imm(1)
         0xc3                                      // ret
     };
     REQUIRE(expected == buf._buf);
@@ -199,9 +279,9 @@ TEST_CASE("Compile unary add1 nested", "[compiler]")
     REQUIRE(0 == Compile::function(buf, node.get()));
     std::vector<uint8_t> expected{
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0xec, 0x01, 0x00, 0x00, // mov rax, imm(123)
-        0x48, 0x05, 0x04, 0x00, 0x00, 0x00,       // add rax, imm(1)
-        0x48, 0x05, 0x04, 0x00, 0x00, 0x00,       // add rax, imm(1)
+        0xb8, 0xec, 0x01, 0x00, 0x00,             // mov eax, imm(123)
+        0x48, 0x83, 0xc0, 0x04,                   // add rax, imm(1)
+        0x48, 0x83, 0xc0, 0x04,                   // add rax, imm(1)
         0xc3};                                    // ret
     REQUIRE(expected == buf._buf);
 
@@ -216,13 +296,9 @@ TEST_CASE("compile boolean? with non-boolean returns false", "[compiler]")
     REQUIRE(0 == Compile::function(buf, node.get()));
     std::vector<uint8_t> expected{
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0x14, 0x00, 0x00, 0x00, // mov    rax,0x14
-        0x48, 0x83, 0xe0, 0x1f,                   // and    rax,0x3f // a typo?
-        0x48, 0x3d, 0x1f, 0x00, 0x00, 0x00,       // cmp    rax,0x0000001f
-        0x48, 0xc7, 0xc0, 0x00, 0x00, 0x00, 0x00, // mov    rax,0x0
-        0x0f, 0x94, 0xc0,                         // sete   al
-        0x48, 0xc1, 0xe0, 0x07,                   // shl    rax,0x7
-        0x48, 0x83, 0xc8, 0x1f,                   // or     rax,0x1f
+        0xb8, 0x14, 0x00, 0x00, 0x00,             // mov    eax,0x14
+        // The operand is known to be an integer
+        0xb8, 0x1f, 0x00, 0x00, 0x00,             // mov    eax,0x1f
         0xc3};
     REQUIRE(expected == buf._buf);
     auto code = buf.freeze();
@@ -236,13 +312,9 @@ TEST_CASE("compile boolean? with true returns true", "[compiler]")
     REQUIRE(0 == Compile::function(buf, node.get()));
     std::vector<uint8_t> expected{
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0x9f, 0x00, 0x00, 0x00, // mov    rax,0x9f
-        0x48, 0x83, 0xe0, 0x1f,                   // and    rax,0x1f
-        0x48, 0x3d, 0x1f, 0x00, 0x00, 0x00,       // cmp    rax,0x0000001f
-        0x48, 0xc7, 0xc0, 0x00, 0x00, 0x00, 0x00, // mov    rax,0x0
-        0x0f, 0x94, 0xc0,                         // sete   al
-        0x48, 0xc1, 0xe0, 0x07,                   // shl    rax,0x7
-        0x48, 0x83, 0xc8, 0x1f,                   //  or     rax,0x1f
+        0xb8, 0x9f, 0x00, 0x00, 0x00,             // mov    eax,0x9f
+        // The operand is known to be a boolean
+        0xb8, 0x9f, 0x00, 0x00, 0x00,             // mov    eax,0x9f
         0xc3};                                    // ret
     REQUIRE(expected == buf._buf);
     auto code = buf.freeze();
@@ -256,13 +328,9 @@ TEST_CASE("compile boolean? with false returns true", "[compiler]")
     REQUIRE(0 == Compile::function(buf, node.get()));
     std::vector<uint8_t> expected{
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0x1f, 0x00, 0x00, 0x00, // mov    rax,0x1f
-        0x48, 0x83, 0xe0, 0x1f,                   // and    rax,0x1f
-        0x48, 0x3d, 0x1f, 0x00, 0x00, 0x00,       // cmp    rax,0x0000001f
-        0x48, 0xc7, 0xc0, 0x00, 0x00, 0x00, 0x00, // mov    rax,0x0
-        0x0f, 0x94, 0xc0,                         // sete   al
-        0x48, 0xc1, 0xe0, 0x07,                   // shl    rax,0x7
-        0x48, 0x83, 0xc8, 0x1f,                   // or     rax,0x1f
+        0xb8, 0x1f, 0x00, 0x00, 0x00,             // mov    eax,0x1f
+        // The operand is known to be a boolean
+        0xb8, 0x9f, 0x00, 0x00, 0x00,             // mov    eax,0x9f
         0xc3};                                    // ret
     REQUIRE(expected == buf._buf);
     auto code = buf.freeze();
@@ -281,9 +349,9 @@ TEST_CASE("Compile binary +", "[compiler]")
     REQUIRE(0 == Compile::function(buf, node.get()));
     std::vector<uint8_t> expected{
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0x20, 0x00, 0x00, 0x00, // mov    rax,0x20
+        0xb8, 0x20, 0x00, 0x00, 0x00,             // mov    eax,0x20
         0x48, 0x89, 0x44, 0x24, 0xf8,             // mov    QWORD PTR [rsp-0x8],rax
-        0x48, 0xc7, 0xc0, 0x14, 0x00, 0x00, 0x00, // mov    rax,0x14
+        0xb8, 0x14, 0x00, 0x00, 0x00,             // mov    eax,0x14
         0x48, 0x03, 0x44, 0x24, 0xf8,             // add    rax,QWORD PTR [rsp-0x8]
         0xc3};
     REQUIRE(expected == buf._buf);
@@ -298,9 +366,9 @@ TEST_CASE("Compile binary -", "[compiler]")
     REQUIRE(0 == Compile::function(buf, node.get()));
     std::vector<uint8_t> expected{
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0x20, 0x00, 0x00, 0x00, // mov    rax,0x20
+        0xb8, 0x20, 0x00, 0x00, 0x00,             // mov    eax,0x20
         0x48, 0x89, 0x44, 0x24, 0xf8,             // mov    QWORD PTR [rsp-0x8],rax
-        0x48, 0xc7, 0xc0, 0x14, 0x00, 0x00, 0x00, // mov    rax,0x14
+        0xb8, 0x14, 0x00, 0x00, 0x00,             // mov    eax,0x14
         0x48, 0x2b, 0x44, 0x24, 0xf8,             // sub    QWORD PTR [rsp-0x8],rax
         0xc3};
     REQUIRE(expected == buf._buf);
@@ -405,13 +473,13 @@ TEST_CASE("if with true cond", "[compiler]")
 
     std::vector<uint8_t> expected = {
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0x9f, 0x00, 0x00, 0x00, // mov rax, 0x9f
-        0x48, 0x3d, 0x1f, 0x00, 0x00, 0x00,       // cmp rax, 0x1f
-        0x0f, 0x84, 0x0c, 0x00, 0x00, 0x00,       // je alternate
-        0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00, // mov rax, compile(1)
-        0xe9, 0x07, 0x00, 0x00, 0x00,             // jmp end
+        0xb8, 0x9f, 0x00, 0x00, 0x00,             // mov eax, 0x9f
+        0x48, 0x83, 0xf8, 0x1f,                   // cmp rax, 0x1f
+        0x0f, 0x84, 0x0a, 0x00, 0x00, 0x00,       // je alternate
+        0xb8, 0x04, 0x00, 0x00, 0x00,             // mov eax, compile(1)
+        0xe9, 0x05, 0x00, 0x00, 0x00,             // jmp end
         // alternate:
-        0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00, // mov rax, compile(2)
+        0xb8, 0x08, 0x00, 0x00, 0x00,             // mov eax, compile(2)
         0xc3};
     REQUIRE(expected == buf._buf);
     auto code = buf.freeze();
@@ -428,13 +496,13 @@ TEST_CASE("if with false cond", "[compiler]")
 
     std::vector<uint8_t> expected = {
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0x1f, 0x00, 0x00, 0x00, // mov rax, 0x1f
-        0x48, 0x3d, 0x1f, 0x00, 0x00, 0x00,       // cmp rax, 0x1f
-        0x0f, 0x84, 0x0c, 0x00, 0x00, 0x00,       // je alternate
-        0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00, // mov rax, compile(1)
-        0xe9, 0x07, 0x00, 0x00, 0x00,             // jmp end
+        0xb8, 0x1f, 0x00, 0x00, 0x00,             // mov eax, 0x1f
+        0x48, 0x83, 0xf8, 0x1f,                   // cmp rax, 0x1f
+        0x0f, 0x84, 0x0a, 0x00, 0x00, 0x00,       // je alternate
+        0xb8, 0x04, 0x00, 0x00, 0x00,             // mov eax, compile(1)
+        0xe9, 0x05, 0x00, 0x00, 0x00,             // jmp end
         // alternate:
-        0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00, // mov rax, compile(2)
+        0xb8, 0x08, 0x00, 0x00, 0x00,             // mov eax, compile(2)
         0xc3};
     REQUIRE(expected == buf._buf);
     auto code = buf.freeze();
@@ -451,13 +519,13 @@ TEST_CASE("compile cons", "[compiler]")
 
     std::vector<uint8_t> expected = {
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00, // mov rax, 0x2
-        0x48, 0x89, 0x46, 0x00,                   // mov [rsi+Car], rax
-        0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00, // mov rax, 0x4
+        0xb8, 0x04, 0x00, 0x00, 0x00,             // mov eax, 0x2
+        0x48, 0x89, 0x06,                         // mov [rsi+Car], rax
+        0xb8, 0x08, 0x00, 0x00, 0x00,             // mov eax, 0x4
         0x48, 0x89, 0x46, 0x08,                   // mov [rsi+Cdr], rax
         0x48, 0x89, 0xf0,                         // mov rax, rsi
         0x48, 0x83, 0xc8, 0x01,                   // or rax, kPairTag
-        0x48, 0x81, 0xc6, 0x10, 0x00, 0x00, 0x00, // add rsi, 2*kWordSize
+        0x48, 0x83, 0xc6, 0x10,                   // add rsi, 2*kWordSize
         0xc3};
     REQUIRE(expected == buf._buf);
     auto code = buf.freeze();
@@ -483,6 +551,22 @@ TEST_CASE("Compile two cons", "[compiler]")
     REQUIRE(4 == result->asPair()->cdr->getInteger());
 }
 
+TEST_CASE("Compile cons with allocating cdr", "[compiler]")
+{
+    Buffer buf;
+    auto node = Reader::read("(cons 1 (cons 2 3))");
+    REQUIRE(0 == Compile::function(buf, node.get()));
+    auto code = buf.freeze();
+    uword heap[64];
+    auto result = code.toFunc<ASTNode *(uword *)>()(heap);
+    REQUIRE(result->isPair());
+    REQUIRE(1 == result->asPair()->car->getInteger());
+    auto cdr = result->asPair()->cdr;
+    REQUIRE(cdr->isPair());
+    REQUIRE(2 == cdr->asPair()->car->getInteger());
+    REQUIRE(3 == cdr->asPair()->cdr->getInteger());
+}
+
 TEST_CASE("Compile car", "[compiler]")
 {
     Buffer buf;
@@ -491,13 +575,13 @@ TEST_CASE("Compile car", "[compiler]")
     REQUIRE(0 == compileResult);
     std::vector<uint8_t> expected = {
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00, // mov rax, 0x2
-        0x48, 0x89, 0x46, 0x00,                   // mov [rsi], rax
-        0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00, // mov rax, 0x4
+        0xb8, 0x04, 0x00, 0x00, 0x00,             // mov eax, 0x2
+        0x48, 0x89, 0x06,                         // mov [rsi], rax
+        0xb8, 0x08, 0x00, 0x00, 0x00,             // mov eax, 0x4
         0x48, 0x89, 0x46, 0x08,                   // mov [rsi+Cdr], rax
         0x48, 0x89, 0xf0,                         // mov rax, rsi
         0x48, 0x83, 0xc8, 0x01,                   // or rax, kPairTag
-        0x48, 0x81, 0xc6, 0x10, 0x00, 0x00, 0x00, // add rsi, 2*kWordSize
+        0x48, 0x83, 0xc6, 0x10,                   // add rsi, 2*kWordSize
         0x48, 0x8b, 0x40, 0xff,                   // mov rax, [rax-1]
         0xc3};
     REQUIRE(expected == buf._buf);
@@ -518,13 +602,13 @@ TEST_CASE("Compile cdr", "[compiler]")
     REQUIRE(0 == compileResult);
     std::vector<uint8_t> expected = {
         0x48, 0x89, 0xce,
-        0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00, // mov rax, 0x2
-        0x48, 0x89, 0x46, 0x00,                   // mov [rsi], rax
-        0x48, 0xc7, 0xc0, 0x08, 0x00, 0x00, 0x00, // mov rax, 0x4
+        0xb8, 0x04, 0x00, 0x00, 0x00,             // mov eax, 0x2
+        0x48, 0x89, 0x06,                         // mov [rsi], rax
+        0xb8, 0x08, 0x00, 0x00, 0x00,             // mov eax, 0x4
         0x48, 0x89, 0x46, 0x08,                   // mov [rsi+Cdr], rax
         0x48, 0x89, 0xf0,                         // mov rax, rsi
         0x48, 0x83, 0xc8, 0x01,                   // or rax, kPairTag
-        0x48, 0x81, 0xc6, 0x10, 0x00, 0x00, 0x00, // add rsi, 2*kWordSize
+        0x48, 0x83, 0xc6, 0x10,                   // add rsi, 2*kWordSize
         0x48, 0x8b, 0x40, 0x07,                   // mov rax, [rax+7]
         0xc3};
     REQUIRE(expected == buf._buf);
@@ -543,8 +627,8 @@ TEST_CASE("Compile code with one param", "[compiler]")
     auto node = Reader::read("(code (x) x)");
     REQUIRE(0 == Compile::code(buf, node.get(), nullptr));
     std::vector<uint8_t> expected{
-        0x48, 0x8b, 0x44, 0x24, 0xf8, // mov rax, [rsp-8]
-        0xc3                          // ret
+        0x4c, 0x89, 0xc0, // mov rax, r8
+        0xc3              // ret
     };
     REQUIRE(expected == buf._buf);
 }
@@ -555,15 +639,94 @@ TEST_CASE("Compile code with two params", "[compiler]")
     auto node = Reader::read("(code (x y) (+ x y))");
     REQUIRE(0 == Compile::code(buf, node.get(), nullptr));
     std::vector<uint8_t> expected{
-        0x48, 0x8b, 0x44, 0x24, 0xf0, // mov rax, [rsp-16]
+        0x4c, 0x89, 0xc8,             // mov rax, r9
         0x48, 0x89, 0x44, 0x24, 0xe8, // mov [rsp-24], rax
-        0x48, 0x8b, 0x44, 0x24, 0xf8, // mov rax, [rsp-8]
+        0x4c, 0x89, 0xc0,             // mov rax, r8
         0x48, 0x03, 0x44, 0x24, 0xe8, // add rax, [rsp-24]
         0xc3,                         // ret
     };
     REQUIRE(expected == buf._buf);
 }
 
+TEST_CASE("Compile expressions nested deeper than the native stack", "[compiler]")
+{
+    constexpr int Depth = 200000;
+    auto nest = [](const std::string &open, const std::string &leaf, const std::string &close, int depth) {
+        std::string source;
+        for (int i = 0; i < depth; ++i)
+        {
+            source += open;
+        }
+        source += leaf;
+        for (int i = 0; i < depth; ++i)
+        {
+            source += close;
+        }
+        return source;
+    };
+    std::pair<std::string, word> programs[] = {
+        {nest("(add1 ", "0", ")", Depth), Depth},
+        {nest("(+ 2 ", "1", ")", Depth), 2 * Depth + 1},
+        {nest("(if #t ", "7", " 0)", Depth), 7},
+        {nest("(car (cons ", "3", " ()))", Depth), 3},
+    };
+    for (auto &[source, expected] : programs)
+    {
+        auto node = Reader::read(std::string{source});
+        REQUIRE(!node->isError());
+        Buffer buf;
+        REQUIRE(0 == Compile::function(buf, node.get()));
+        auto code = buf.freeze();
+        std::vector<uword> heap(2 * Depth);
+        REQUIRE(expected == code.toFunc<ASTNode *(uword *)>()(heap.data())->getInteger());
+    }
+
+    REQUIRE(Reader::read(nest("(add1 ", "0", "", Depth)).get()->isError());
+
+    // A one-shot line at the REPL goes through an Engine, which must not
+    // hand it to the recursive interpreter
+    Engine engine;
+    std::vector<uword> heap(2 * Depth);
+    for (auto &[source, expected] : programs)
+    {
+        auto node = Reader::read(std::string{source});
+        REQUIRE(Engine::Tier::Compiler == engine.choose(source, node.get()));
+        REQUIRE(expected == (*engine.run(source, node.get(), heap.data()))->getInteger());
+    }
+    std::string shallow = "0";
+    for (size_t i = 0; i < Interp::MaxDepth; ++i)
+    {
+        shallow = "(add1 " + shallow + ")";
+    }
+    auto node = Reader::read(std::string{shallow});
+    REQUIRE(Engine::Tier::Interpreter == engine.choose(shallow, node.get()));
+
+    // These take a stack slot per level, far past what a disp8 reaches
+    constexpr int Slots = 4000;
+    std::string wide = "(let (";
+    for (int i = 0; i < Slots; ++i)
+    {
+        wide += "(a" + std::to_string(i) + " " + std::to_string(i) + ")";
+    }
+    wide += ") (+ a0 (- a" + std::to_string(Slots - 1) + " a1)))";
+    std::pair<std::string, word> framed[] = {
+        {nest("(+ ", "(add1 0)", " (add1 0))", Slots), Slots + 1},
+        {"(labels ((id (code (x) x))) " + nest("(+ ", "(labelcall id 1)", " 1)", Slots) + ")", Slots + 1},
+        {wide, Slots - 2},
+    };
+    for (auto &[source, expected] : framed)
+    {
+        auto node = Reader::read(std::string{source});
+        REQUIRE(!node->isError());
+        Buffer buf;
+        REQUIRE(0 == Compile::function(buf, node.get()));
+        auto code = buf.freeze();
+        std::vector<uword> heap(16);
+        REQUIRE(expected == code.toFunc<ASTNode *(uword *)>()(heap.data())->getInteger());
+        REQUIRE(expected == (*engine.run(source, node.get(), heap.data()))->getInteger());
+    }
+}
+
 TEST_CASE("Compile labels with one label", "[compiler]")
 {
     Buffer buf;
@@ -572,10 +735,10 @@ TEST_CASE("Compile labels with one label", "[compiler]")
 
     std::vector<uint8_t> expected = {
         0x48, 0x89, 0xce,
-        0xe9, 0x08, 0x00, 0x00, 0x00,             // jmp 0x08
-        0x48, 0xc7, 0xc0, 0x14, 0x00, 0x00, 0x00, // mov rax, compile(5)
+        0xe9, 0x06, 0x00, 0x00, 0x00,             // jmp 0x06
+        0xb8, 0x14, 0x00, 0x00, 0x00,             // mov eax, compile(5)
         0xc3,                                     // ret
-        0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00, // mov rax, 0x2
+        0xb8, 0x04, 0x00, 0x00, 0x00,             // mov eax, 0x2
         0xc3,                                     // ret
     };
     REQUIRE(expected == buf._buf);
@@ -595,7 +758,7 @@ TEST_CASE("Compile labelcall with one param", "[compiler]")
         0xe9, 0x06, 0x00, 0x00, 0x00,             // jmp 0x06
         0x48, 0x8b, 0x44, 0x24, 0xf8,             // mov rax, [rsp-8]
         0xc3,                                     // ret
-        0x48, 0xc7, 0xc0, 0x14, 0x00, 0x00, 0x00, // mov rax, compile(5)
+        0xb8, 0x14, 0x00, 0x00, 0x00,             // mov eax, compile(5)
         0x48, 0x89, 0x44, 0x24, 0xf0,             // mov [rsp-16], rax
         0xe8, 0xe9, 0xff, 0xff, 0xff,             // call `id`
         0xc3,                                     // ret
@@ -613,16 +776,16 @@ TEST_CASE("Compile labelcall with one param and locals", "[compiler]")
     REQUIRE(0 == Compile::function(buf, node.get()));
     std::vector<uint8_t> expected = {
         0x48, 0x89, 0xce,
-        0xe9, 0x06, 0x00, 0x00, 0x00,             // jmp 0x06
-        0x48, 0x8b, 0x44, 0x24, 0xf8,             // mov rax, [rsp-8]
+        0xe9, 0x04, 0x00, 0x00, 0x00,             // jmp 0x04
+        0x4c, 0x89, 0xc0,                         // mov rax, r8
         0xc3,                                     // ret
-        0x48, 0xc7, 0xc0, 0x04, 0x00, 0x00, 0x00, // mov rax, compile(1)
+        0xb8, 0x04, 0x00, 0x00, 0x00,             // mov eax, compile(1)
         0x48, 0x89, 0x44, 0x24, 0xf8,             // mov [rsp-8], rax
-        0x48, 0xc7, 0xc0, 0x14, 0x00, 0x00, 0x00, // mov rax, compile(5)
-        0x48, 0x89, 0x44, 0x24, 0xe8,             // mov [rsp-24], rax
-        0x48, 0x81, 0xec, 0x08, 0x00, 0x00, 0x00, // sub rsp, 8
-        0xe8, 0xd6, 0xff, 0xff, 0xff,             // call `id`
-        0x48, 0x81, 0xc4, 0x08, 0x00, 0x00, 0x00, // add rsp, 8
+        0xb8, 0x14, 0x00, 0x00, 0x00,             // mov eax, compile(5)
+        0x49, 0x89, 0xc0,                         // mov r8, rax
+        0x48, 0x83, 0xec, 0x08,                   // sub rsp, 8
+        0xe8, 0xe1, 0xff, 0xff, 0xff,             // call `id`
+        0x48, 0x83, 0xc4, 0x08,                   // add rsp, 8
         0xc3,                                     // ret
     };
     REQUIRE(expected == buf._buf);
@@ -632,6 +795,166 @@ TEST_CASE("Compile labelcall with one param and locals", "[compiler]")
     REQUIRE(5 == result->getInteger());
 }
 
+TEST_CASE("Compile labelcall with register and stack arguments", "[compiler]")
+{
+    // The first four arguments travel in registers; a later argument that
+    // calls a label makes the earlier ones wait on the stack
+    auto node = Reader::read("(labels ((id (code (x) x))"
+                             "         (weigh (code (a b c d e f) (+ a (+ (* 2 b) (+ (* 3 c) (+ (* 4 d) (+ (* 5 e) (* 6 f))))))))"
+                             "         (spill (code (a b c d e f) (labelcall weigh f e d c b a))))"
+                             "    (+ (labelcall weigh 1 2 3 4 5 6)"
+                             "       (labelcall spill 1 (labelcall id 2) 3 (labelcall id 4) 5 (labelcall id 6))))");
+    Buffer buf;
+    REQUIRE(0 == Compile::function(buf, node.get()));
+    auto code = buf.freeze();
+    uword heap[64];
+    REQUIRE((91 + 56) == code.toFunc<ASTNode *(uword *)>()(heap)->getInteger());
+}
+
+TEST_CASE("Compile recursive label keeping its formal in a register", "[compiler]")
+{
+    // n is only read before the call, so it is never spilled
+    Buffer buf;
+    auto node = Reader::read("(labels ((depth (code (n) (if (zero? n) 0 (add1 (labelcall depth (sub1 n)))))))"
+                             "    (labelcall depth 3))");
+    REQUIRE(0 == Compile::function(buf, node.get()));
+    std::vector<uint8_t> expected = {
+        0x48, 0x89, 0xce,
+        0xe9, 0x30, 0x00, 0x00, 0x00,       // jmp 0x30
+        0x4c, 0x89, 0xc0,                   // mov rax, r8
+        0x48, 0x83, 0xf8, 0x00,             // cmp rax, 0
+        0x0f, 0x85, 0x07, 0x00, 0x00, 0x00, // jne 0x07
+        0x31, 0xc0,                         // xor eax, eax
+        0xe9, 0x1b, 0x00, 0x00, 0x00,       // jmp 0x1b
+        0x4c, 0x89, 0xc0,                   // mov rax, r8
+        0x48, 0x83, 0xc0, 0xfc,             // add rax, -4
+        0x49, 0x89, 0xc0,                   // mov r8, rax
+        0x48, 0x83, 0xec, 0x08,             // sub rsp, 8
+        0xe8, 0xd9, 0xff, 0xff, 0xff,       // call `depth`
+        0x48, 0x83, 0xc4, 0x08,             // add rsp, 8
+        0x48, 0x83, 0xc0, 0x04,             // add rax, 4
+        0xc3,                               // ret
+        0xb8, 0x0c, 0x00, 0x00, 0x00,       // mov eax, compile(3)
+        0x49, 0x89, 0xc0,                   // mov r8, rax
+        0xe8, 0xc3, 0xff, 0xff, 0xff,       // call `depth`
+        0xc3,                               // ret
+    };
+    REQUIRE(expected == buf._buf);
+    auto code = buf.freeze();
+    uword heap[64];
+    REQUIRE(3 == code.toFunc<ASTNode *(uword *)>()(heap)->getInteger());
+}
+
+TEST_CASE("Compile label spilling only the formals read after a call", "[compiler]")
+{
+    // acc is read before anything overwrites r9; n is read after its
+    // register has been loaded with the first argument
+    auto buf = compileSource("(labels ((count (code (n acc) (if (zero? n) acc (labelcall count (sub1 n) (+ acc n))))))"
+                             "    (labelcall count 10 0))");
+    REQUIRE(containsBytes(buf._buf, {0x4c, 0x89, 0x44, 0x24, 0xf8}));  // mov [rsp-8], r8
+    REQUIRE(!containsBytes(buf._buf, {0x4c, 0x89, 0x4c, 0x24, 0xf0})); // mov [rsp-16], r9
+    auto code = buf.freeze();
+    uword heap[64];
+    REQUIRE(55 == code.toFunc<ASTNode *(uword *)>()(heap)->getInteger());
+}
+
+static word nativeWeigh(word a, word b, word c, word d)
+{
+    return a + 2 * b + 3 * c + 4 * d;
+}
+
+static char nativeUpper(char c)
+{
+    return static_cast<char>(std::toupper(c));
+}
+
+static bool nativeLess(word a, word b)
+{
+    return a < b;
+}
+
+static ASTNode *nativeCar(ASTNode *pair)
+{
+    return pair->asPair()->car;
+}
+
+static word nativeCalls = 0;
+
+static void nativeCount()
+{
+    ++nativeCalls;
+}
+
+TEST_CASE("Compile foreign-call", "[compiler]")
+{
+    Foreign foreign;
+    REQUIRE(0 == foreign.add("weigh", &nativeWeigh));
+    REQUIRE(0 == foreign.add("upper", &nativeUpper));
+    REQUIRE(0 == foreign.add("less", &nativeLess));
+    REQUIRE(0 == foreign.add("car", &nativeCar));
+    REQUIRE(0 == foreign.add("count", &nativeCount));
+    REQUIRE(-1 == foreign.add("count", &nativeCount));
+
+    auto run = [&](const std::string &source) {
+        Buffer::Options options;
+        options.foreign = &foreign;
+        auto code = compileSource(source, options).freeze();
+        static uword heap[64];
+        return code.toFunc<ASTNode *(uword *)>()(heap);
+    };
+    REQUIRE(-30 == run("(foreign-call weigh -1 -2 -3 -4)")->getInteger());
+    REQUIRE('Q' == run("(foreign-call upper 'q')")->getChar());
+    REQUIRE(true == run("(foreign-call less 1 2)")->getBool());
+    REQUIRE(false == run("(foreign-call less 2 1)")->getBool());
+    REQUIRE(7 == run("(foreign-call car (cons 7 8))")->getInteger());
+
+    nativeCalls = 0;
+    REQUIRE(run("(foreign-call count)")->isNil());
+    REQUIRE(1 == nativeCalls);
+
+    // Arguments waiting in registers survive a foreign call in a later argument,
+    // and a label's register formals survive one in its body
+    REQUIRE((1 + 2 * 2 + 3 * 3 + 4 * 36) == run("(foreign-call weigh 1 2 3 (foreign-call weigh 4 5 6 1))")->getInteger());
+    REQUIRE((10 + 20 + 3) == run("(labels ((f (code (a b c) (+ (foreign-call weigh c 0 0 0) (+ a b)))))"
+                                 "    (labelcall f 10 20 3))")
+                                ->getInteger());
+}
+
+TEST_CASE("Compile foreign-call errors", "[compiler]")
+{
+    Foreign foreign;
+    REQUIRE(0 == foreign.add("less", &nativeLess));
+    REQUIRE(-1 == foreign.add("wide", nullptr, ForeignType::Integer, std::vector<ForeignType>(5, ForeignType::Integer)));
+
+    for (auto source : {"(foreign-call less 1)", "(foreign-call missing 1 2)"})
+    {
+        auto node = Reader::read(source);
+        Buffer buf;
+        buf._options.foreign = &foreign;
+        REQUIRE(-1 == Compile::function(buf, node.get()));
+    }
+    // Without a Foreign table every foreign-call fails to compile
+    auto node = Reader::read("(foreign-call less 1 2)");
+    Buffer buf;
+    REQUIRE(-1 == Compile::function(buf, node.get()));
+}
+
+TEST_CASE("Engine compiles foreign-call", "[interp]")
+{
+    Foreign foreign;
+    REQUIRE(0 == foreign.add("weigh", &nativeWeigh));
+    auto node = Reader::read("(+ 1 (foreign-call weigh 1 1 1 1))");
+    uword heap[64];
+    REQUIRE(!Interp::run(node.get(), heap));
+
+    Engine engine;
+    engine.setForeign(&foreign);
+    REQUIRE(Engine::Tier::Compiler == engine.choose("foreign", node.get()));
+    auto result = engine.run("foreign", node.get(), heap);
+    REQUIRE(result);
+    REQUIRE(11 == (*result)->getInteger());
+}
+
 TEST_CASE("Compile multilevel labelcall", "[compiler]")
 {
     Buffer buf;
@@ -658,6 +981,40 @@ TEST_CASE("Compile factorial labelcall", "[compiler]")
     REQUIRE(120 == result->getInteger());
 }
 
+TEST_CASE("Compile mutually recursive labels", "[compiler]")
+{
+    auto node = Reader::read("(labels ((even (code (n) (if (zero? n) #t (labelcall odd (sub1 n)))))"
+                             "         (odd (code (n) (if (zero? n) #f (labelcall even (sub1 n))))))"
+                             "    (labelcall odd 7))");
+    Buffer buf;
+    REQUIRE(0 == Compile::function(buf, node.get()));
+    auto code = buf.freeze();
+    uword heap[8];
+    REQUIRE(code.toFunc<ASTNode *(uword *)>()(heap)->getBool());
+}
+
+TEST_CASE("Compile rejects duplicate labels", "[compiler]")
+{
+    auto node = Reader::read("(labels ((f (code (x) x)) (f (code (x) x))) (labelcall f 1))");
+    Buffer buf;
+    REQUIRE(-1 == Compile::function(buf, node.get()));
+}
+
+TEST_CASE("Compile labels in reverse order", "[compiler]")
+{
+    // Every label calls the one after it
+    constexpr int count = 2000;
+    std::string source = "(labels (";
+    for (int i = 0; i < count - 1; ++i)
+    {
+        source += "(f" + std::to_string(i) + " (code (x) (labelcall f" + std::to_string(i + 1) + " (add1 x))))";
+    }
+    source += "(f" + std::to_string(count - 1) + " (code (x) x))) (labelcall f0 0))";
+    auto code = compileSource(source).freeze();
+    uword heap[8];
+    REQUIRE(count - 1 == code.toFunc<ASTNode *(uword *)>()(heap)->getInteger());
+}
+
 TEST_CASE("Read with unsigned integer returns integer", "[reader]")
 {
     auto node = Reader::read("1234");
@@ -720,3 +1077,1170 @@ TEST_CASE("Read with symbol with trailing spaces", "[reader]")
     REQUIRE(node->isSymbol());
     REQUIRE(node->asSymbol()->str == "add1");
 }
+
+TEST_CASE("Read string literals", "[reader]")
+{
+    auto node = Reader::read(R"("say \"hi\"\n\\")");
+    REQUIRE(node->isString());
+    REQUIRE(node->asString()->view() == "say \"hi\"\n\\");
+    REQUIRE(Reader::read(R"("unterminated)")->isError());
+    REQUIRE(Reader::read(R"("bad \q escape")")->isError());
+}
+
+TEST_CASE("Read records source spans", "[reader]")
+{
+    SourceSpans spans;
+    std::string source = "(+ 1\n   (* x \"ab\"))";
+    auto node = Reader::read(std::string{source}, &spans);
+    REQUIRE(!node->isError());
+    auto text = [&](const ASTNode *node) {
+        auto span = spans.at(node);
+        return source.substr(span.begin, span.end - span.begin);
+    };
+    REQUIRE(text(node.get()) == source);
+    auto args = node->asPair()->cdr;
+    REQUIRE(text(args->asPair()->cdr->asPair()->car) == "(* x \"ab\")");
+    auto inner = args->asPair()->cdr->asPair()->car->asPair();
+    REQUIRE(text(inner->car) == "*");
+    REQUIRE(text(inner->cdr->asPair()->car) == "x");
+    REQUIRE(text(inner->cdr->asPair()->cdr->asPair()->car) == "\"ab\"");
+    // Immediates have no span of their own
+    REQUIRE(spans.count(args->asPair()->car) == 0);
+}
+
+TEST_CASE("Stats count each phase", "[stats]")
+{
+    if (!Stats::enabled())
+    {
+        return;
+    }
+    Stats::reset();
+    auto node = Reader::read("(+ 1 2)");
+    Buffer buf;
+    REQUIRE(0 == Compile::function(buf, node.get()));
+    auto code = buf.freeze();
+    auto result = code.call<ASTNode *(uword *)>(nullptr);
+    REQUIRE(3 == result->getInteger());
+
+    REQUIRE(1 == Stats::get(Stats::Phase::Read).count);
+    REQUIRE(7 == Stats::get(Stats::Phase::Read).bytes);
+    REQUIRE(1 == Stats::get(Stats::Phase::Compile).count);
+    REQUIRE(buf.size() == Stats::get(Stats::Phase::Compile).bytes);
+    REQUIRE(1 == Stats::get(Stats::Phase::Freeze).count);
+    REQUIRE(1 == Stats::get(Stats::Phase::Execute).count);
+
+    Stats::reset();
+    REQUIRE(0 == Stats::get(Stats::Phase::Execute).count);
+}
+
+TEST_CASE("PerfMap writes a line per label", "[perfmap]")
+{
+    auto dir = std::filesystem::temp_directory_path().string();
+    REQUIRE(PerfMap::enable(PerfMap::Map | PerfMap::JitDump, dir));
+    auto mapPath = PerfMap::filePath(PerfMap::Map);
+    auto dumpPath = PerfMap::filePath(PerfMap::JitDump);
+    {
+        Buffer buf;
+        auto node = Reader::read("(labels ((id (code (x) x)) (twice (code (x) (+ x x)))) (labelcall id 5))");
+        REQUIRE(0 == Compile::function(buf, node.get()));
+        auto code = buf.freeze();
+        PerfMap::disable();
+
+        std::ifstream map{mapPath};
+        std::stringstream contents;
+        contents << map.rdbuf();
+        auto text = contents.str();
+        REQUIRE(text.find(" lisp:id\n") != std::string::npos);
+        REQUIRE(text.find(" lisp:twice\n") != std::string::npos);
+        REQUIRE(text.find(" lisp:main\n") != std::string::npos);
+
+        std::ifstream dump{dumpPath, std::ios::binary};
+        uint32_t magic = 0;
+        dump.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+        REQUIRE(0x4A695444 == magic);
+    }
+    std::filesystem::remove(mapPath);
+    std::filesystem::remove(dumpPath);
+}
+
+TEST_CASE("GdbJit describes labels in an ELF image", "[gdbjit]")
+{
+    Buffer buf;
+    auto node = Reader::read("(labels ((id (code (x) x))) (let ((a 1)) (labelcall id 5)))");
+    REQUIRE(0 == Compile::function(buf, node.get()));
+    // sub rsp, 8 before the call and add rsp, 8 after it
+    REQUIRE(2 == buf._frameChanges.size());
+    REQUIRE(16 == buf._frameChanges[0].cfaOffset);
+    REQUIRE(8 == buf._frameChanges[1].cfaOffset);
+
+    auto code = buf.freeze();
+    auto elf = GdbJit::buildElf(code, buf);
+    REQUIRE(elf.size() > 64);
+    REQUIRE(std::vector<uint8_t>{0x7f, 'E', 'L', 'F'} == std::vector<uint8_t>(elf.begin(), elf.begin() + 4));
+    std::string image(elf.begin(), elf.end());
+    REQUIRE(image.find(std::string("lisp:id") + '\0') != std::string::npos);
+    REQUIRE(image.find(".debug_frame") != std::string::npos);
+
+    GdbJit::enable();
+    {
+        auto registered = buf.freeze();
+        REQUIRE(5 == registered.toFunc<ASTNode *(uword *)>()(nullptr)->getInteger());
+    }
+    GdbJit::enable(false);
+}
+
+// Programs from the compiler tests above, plus a few longer ones
+TEST_CASE("SourceMap finds the source of code", "[profiling]")
+{
+    std::string source = "(let ((x 5))\n"
+                         "  (+ x\n"
+                         "     (* x 3)))";
+    SourceSpans spans;
+    auto node = Reader::read(std::string{source}, &spans);
+    Buffer buf;
+    buf._options.recordNodes = true;
+    REQUIRE(0 == Compile::function(buf, node.get()));
+    SourceMap map{source, spans, buf};
+
+    // lea rax, [rax + rax * 2]
+    auto offset = findBytes(buf._buf, {0x48, 0x8d, 0x04, 0x40});
+    REQUIRE(offset < buf.size());
+    auto location = map.find(offset);
+    REQUIRE(location);
+    REQUIRE(location->line == 3);
+    REQUIRE(location->column == 6);
+    REQUIRE(source.substr(location->span.begin, location->span.end - location->span.begin) == "(* x 3)");
+    // The prologue belongs to no form, the ret to the whole program
+    REQUIRE(!map.find(0));
+    auto code = buf.freeze();
+    REQUIRE(map.find(code, reinterpret_cast<uint64_t>(code.data()) + offset)->line == 3);
+    REQUIRE(!map.find(code, reinterpret_cast<uint64_t>(code.data()) + code.size()));
+    REQUIRE(20 == code.toFunc<ASTNode *(uword *)>()(nullptr)->getInteger());
+}
+
+TEST_CASE("Sampler attributes samples to lines", "[profiling]")
+{
+    std::string source = "(labels ((go (code (n v) (if (zero? n) 0\n"
+                         "  (+ (vector-sum v)\n"
+                         "     (labelcall go (sub1 n) v))))))\n"
+                         "  (let ((v (make-vector 50000 1))) (labelcall go 2000 v)))";
+    SourceSpans spans;
+    auto node = Reader::read(std::string{source}, &spans);
+    Buffer buf;
+    buf._options.recordNodes = true;
+    REQUIRE(0 == Compile::function(buf, node.get()));
+    SourceMap map{source, spans, buf};
+    auto code = buf.freeze();
+    std::vector<uword> heap(60000);
+
+    // A run takes tens of milliseconds, which can be only a tick or two of
+    // the system timer, so run it until enough samples land in the code
+    constexpr size_t MinSamples = 20;
+    std::vector<uint64_t> samples;
+    size_t found = 0, sums = 0;
+    for (auto start = std::chrono::steady_clock::now(); found < MinSamples;)
+    {
+        REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds{30});
+        Sampler sampler{std::chrono::microseconds{200}};
+        REQUIRE(100000000 == code.toFunc<ASTNode *(uword *)>()(heap.data())->getInteger());
+        for (auto sample : sampler.stop())
+        {
+            samples.push_back(sample);
+            if (auto location = map.find(code, sample))
+            {
+                ++found;
+                sums += location->line == 2;
+            }
+        }
+    }
+    REQUIRE(sums * 2 > found);
+    auto annotated = map.annotate(code, samples);
+    REQUIRE(annotated.find("samples in this code\n") != std::string::npos);
+    REQUIRE(annotated.find("% |   (+ (vector-sum v)\n") != std::string::npos);
+}
+
+TEST_CASE("Disassembler decodes what Emit writes", "[disasm]")
+{
+    auto text = [](std::vector<uint8_t> code) {
+        auto instruction = Disasm::decode(code.data(), code.size(), 0);
+        REQUIRE(instruction.size == code.size());
+        return instruction.text;
+    };
+    REQUIRE(text({0x48, 0x89, 0x06}) == "mov [rsi], rax");
+    REQUIRE(text({0x4c, 0x89, 0x44, 0x24, 0xf8}) == "mov [rsp-8], r8");
+    REQUIRE(text({0x48, 0x8d, 0x04, 0x40}) == "lea rax, [rax+rax*2]");
+    REQUIRE(text({0x31, 0xc0}) == "xor eax, eax");
+    REQUIRE(text({0x48, 0xb8, 0x25, 0x49, 0x92, 0x24, 0x49, 0x92, 0x24, 0x49}) == "movabs rax, 0x4924924924924925");
+    REQUIRE(text({0x48, 0x83, 0xe1, 0xf0}) == "and rcx, -16");
+    REQUIRE(text({0x80, 0x3f, 0x00}) == "cmp byte [rdi], 0");
+    REQUIRE(text({0x0f, 0x94, 0xc0}) == "sete al");
+    REQUIRE(text({0x48, 0xf7, 0xf9}) == "idiv rcx");
+    REQUIRE(text({0xc4, 0xe1, 0x7d, 0xd4, 0x04, 0x22}) == "vpaddq ymm0, ymm0, [rdx]");
+    REQUIRE(text({0xc5, 0xf8, 0x77}) == "vzeroupper");
+
+    const std::vector<uint8_t> loop{0x48, 0x83, 0xc2, 0x08, 0x0f, 0x82, 0xf6, 0xff, 0xff, 0xff, 0x06};
+    auto instructions = Disasm::decode(loop);
+    REQUIRE(instructions.size() == 3);
+    REQUIRE(instructions[1].text == "jb 0x0");
+    REQUIRE(instructions[1].target == size_t{0});
+    // Not something Emit writes
+    REQUIRE(instructions[2].text == "(bad) 0x06");
+    REQUIRE(instructions[2].size == 1);
+}
+
+TEST_CASE("Disassembly shows labels, jumps and sizes by kind", "[disasm]")
+{
+    auto node = Reader::read("(labels ((go (code (n) (if (zero? n) 0 (+ n (labelcall go (sub1 n)))))))"
+                             "  (labelcall go 10))");
+    Buffer buf;
+    buf._options.recordNodes = true;
+    REQUIRE(0 == Compile::function(buf, node.get()));
+
+    auto listing = Disasm::listing(buf);
+    REQUIRE(listing.find("(bad)") == std::string::npos);
+    REQUIRE(listing.find("\ngo:\n") != std::string::npos);
+    REQUIRE(listing.find("call go\n") != std::string::npos);
+    REQUIRE(listing.find("jmp main\n") != std::string::npos);
+    // The jump to the else arm
+    REQUIRE(listing.find("jne .L1\n") != std::string::npos);
+    REQUIRE(listing.find("\n.L1:\n") != std::string::npos);
+
+    auto sizes = Disasm::sizes(buf);
+    size_t total = 0;
+    for (auto &size : sizes)
+    {
+        total += size.bytes;
+        if (size.kind == "labelcall")
+        {
+            REQUIRE(size.forms == 2);
+        }
+    }
+    REQUIRE(total == buf.size());
+    REQUIRE(std::is_sorted(sizes.begin(), sizes.end(), [](auto &a, auto &b) { return a.bytes > b.bytes; }));
+    REQUIRE(std::find_if(sizes.begin(), sizes.end(), [](auto &size) { return size.kind == "(other)"; })->bytes > 0);
+}
+
+static const char *differentialPrograms[] = {
+    "123",
+    "-123",
+    "'a'",
+    "#t",
+    "#f",
+    "()",
+    "(add1 123)",
+    "(add1 (add1 123))",
+    "(sub1 0)",
+    "(boolean? 5)",
+    "(boolean? #t)",
+    "(boolean? #f)",
+    "(integer? 5)",
+    "(integer? 'a')",
+    "(char->integer (integer->char 65))",
+    "(not #f)",
+    "(zero? 0)",
+    "(nil? ())",
+    "(+ 5 8)",
+    "(- 5 8)",
+    "(* -3 8)",
+    "(= 5 5)",
+    "(= 6 5)",
+    "(< 5 6)",
+    "(< 6 5)",
+    "(let () (+ 1 2))",
+    "(let ((a 1)) (+ a 2))",
+    "(let ((a 1) (b 2)) (+ a b))",
+    "(let ((a 1)) (let ((b 2)) (+ a b)))",
+    "(let ((a 1) (b a)) (+ a b))",
+    "(if #t 1 2)",
+    "(if #f 1 2)",
+    "(cons 1 2)",
+    "(let ((a (cons 1 2)) (b (cons 3 4))) (cons (cdr a) (cdr b)))",
+    "(cons 1 (cons 2 3))",
+    "(+ (car (cons 1 2)) (cdr (cons 3 4)))",
+    "(car (cons 1 2))",
+    "(cdr (cons 1 2))",
+    "(labels ((const (code () 5))) 1)",
+    "(labels ((id (code (x) x))) (labelcall id 5))",
+    "(labels ((id (code (x) x))) (let ((a 1)) (labelcall id 5)))",
+    "(labels ((add (code (x y) (+ x y))) (add2 (code (x y) (labelcall add x y)))) (labelcall add2 1 2))",
+    "(labels ((factorial (code (x) (if (< x 2) 1 (* x (labelcall factorial (- x 1))))))) (labelcall factorial 5))",
+    "(labels ((fib (code (n) (if (< n 2) n (+ (labelcall fib (- n 1)) (labelcall fib (- n 2))))))) (labelcall fib 15))",
+    "(labels ((build (code (n) (if (zero? n) () (cons n (labelcall build (sub1 n)))))))"
+    "  (labelcall build 10))",
+    "(labels ((f (code (x) (labelcall g x))) (g (code (x) x))) (labelcall f 1))",
+    "(labels ((even (code (n) (if (zero? n) #t (labelcall odd (sub1 n)))))"
+    "         (odd (code (n) (if (zero? n) #f (labelcall even (sub1 n))))))"
+    "  (cons (labelcall even 10) (labelcall odd 7)))",
+    "(labels ((f (code (x) x)) (f (code (x) (add1 x)))) (labelcall f 1))",
+    "(labels ((f (code (x) (labelcall missing x)))) (labelcall f 1))",
+    // Formals read after their register has been overwritten
+    "(labels ((swap (code (a b) (if (zero? b) a (labelcall swap b a))))) (labelcall swap 3 0))",
+    "(labels ((count (code (n acc) (if (zero? n) acc (labelcall count (sub1 n) (+ acc n)))))) (labelcall count 10 0))",
+    "(labels ((id (code (x) x)) (f (code (a b) (cons (labelcall id b) a)))) (labelcall f 1 2))",
+    "(labels ((id (code (x) x)) (f (code (a b) (let ((c (labelcall id a)) (d b)) (- c d))))) (labelcall f 5 2))",
+    "(labels ((id (code (x) x)) (f (code (a) (if (labelcall id #f) 0 a)))) (labelcall f 4))",
+    "(make-vector 5 7)",
+    "(cons (make-vector -3 1) (cons 5 6))",
+    "(cons (vector-map + (make-vector -2 1) (make-vector 2 3)) (cons 5 6))",
+    "(cons (make-vector 3 1) (cons 2 3))",
+    "(vector-length (make-vector 9 1))",
+    "(let ((v (make-vector 6 0))) (vector-ref (vector-set! v 2 (cons 1 2)) 2))",
+    "(vector-sum (vector-fill! (make-vector 11 0) 3))",
+    "(let ((v (make-vector 7 3)) (w (make-vector 7 -5))) (vector-map * v w))",
+    "(vector-map + (make-vector 10 2) (make-vector 10 40))",
+    "(vector-map - (make-vector 1 1) (make-vector 1 1))",
+    "\"hello\"",
+    "(cons \"a\" (cons \"0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz0123456789\" 1))",
+    "(cons 1 \"text\")",
+    "(* 'a' 3)",
+    "(* 'a' -3)",
+    "(* -3 'a')",
+    "(let ((n -7)) (* -3 (add1 n)))",
+    "(let ((n 7)) (* (* n 5) (- n 9)))",
+    "(let ((c 'z')) (integer->char (char->integer c)))",
+    "(integer->char (char->integer 5))",
+    "(let ((x (if (< 1 2) 3 #t))) (integer? x))",
+    "(let ((x (if (< 1 2) 3 4))) (integer? x))",
+    "(if (< 3 2) 1 (if (= 2 2) (if (zero? 0) (if (nil? ()) (if (not #f) 5 6) 7) 8) 9))",
+    "(if (< -3 2) (if (not 0) 1 2) 3)",
+    "(boolean? (car (cons (zero? 0) 1)))",
+    "(quotient -17 5)",
+    "(remainder -17 5)",
+    "(modulo -17 5)",
+    "(modulo 17 -5)",
+    "(let ((d -5)) (cons (quotient 17 d) (cons (remainder 17 d) (modulo 17 d))))",
+    "(let ((d 0)) (modulo 17 d))",
+    "(quotient 'a' 3)",
+    "(modulo 'a' (add1 2))",
+    "(string-length \"hello, world\")",
+    "(string-ref \"hello\" 4)",
+    "(string=? \"hello\" \"hello\")",
+    "(string-index \"error: disk full\" ':')",
+    // Failures: the compiler rejects these whether the bad part runs or not
+    "x",
+    "(if #t 1 x)",
+    "(if #f x 2)",
+    "(let ((a 1)) (if (zero? a) b a))",
+    "(let ((a 1)) (let ((b 2)) c))",
+    "(labels ((f (code (x) y))) 1)",
+    "(labels ((f (code (x) x))) (if #t 1 (labelcall g 1)))",
+    "(labels ((f (code (x) x))) (let ((y 1)) (labelcall f x)))",
+    "(if #t 1 (vector-map - (make-vector 1 1) (make-vector 1 1)))",
+    "(if #t 1 (string=? \"a\"))",
+    // Error objects are values, not failures
+    "(quotient 7 0)",
+    "(cons (remainder 7 (sub1 1)) (modulo 1 0))",
+    "(if (nil? (quotient 1 0)) 1 (quotient 2 0))",
+};
+
+TEST_CASE("Interpreter matches compiled code", "[interp]")
+{
+    std::vector<uword> heap(1024);
+    for (auto source : differentialPrograms)
+    {
+        CAPTURE(source);
+        auto node = Reader::read(source);
+        REQUIRE(!node->isError());
+
+        Buffer buf;
+        auto compiled = Compile::function(buf, node.get()) == 0;
+        std::fill(heap.begin(), heap.end(), 0);
+        auto interpreted = Interp::run(node.get(), heap.data());
+        REQUIRE(compiled == interpreted.has_value());
+        if (!compiled)
+        {
+            continue;
+        }
+        auto interpretedHeap = heap;
+
+        auto code = buf.freeze();
+        std::fill(heap.begin(), heap.end(), 0);
+        auto result = code.toFunc<ASTNode *(uword *)>()(heap.data());
+        REQUIRE(reinterpret_cast<uword>(result) == reinterpret_cast<uword>(*interpreted));
+        REQUIRE(interpretedHeap == heap);
+    }
+}
+
+TEST_CASE("Compile with known tags", "[compiler]")
+{
+    auto contains = [](const Buffer &buf, const std::vector<uint8_t> &bytes) { return containsBytes(buf._buf, bytes); };
+    uword heap[8];
+    auto run = [&](const Buffer &buf) { return buf.freeze().toFunc<ASTNode *(uword *)>()(heap); };
+    const std::vector<uint8_t> untag{0x48, 0xc1, 0xe8, 0x02}; // shr rax, 2
+    const std::vector<uint8_t> setBool{0x0f, 0x94, 0xc0};      // sete al
+
+    // A literal factor is multiplied in directly
+    auto times = compileSource("(let ((n 7)) (* -3 (add1 n)))");
+    REQUIRE(contains(times, {0x48, 0x6b, 0xc0, 0xfd})); // imul rax, rax, -3
+    REQUIRE(!contains(times, untag));
+    REQUIRE(-24 == run(times)->getInteger());
+    // Unless the other operand may not be an integer
+    auto unknown = compileSource("(* -3 'a')");
+    REQUIRE(contains(unknown, untag));
+
+    // Branches use the comparison's flags
+    auto branch = compileSource("(let ((n 4)) (if (< n 5) (if (zero? n) 1 2) 3))");
+    REQUIRE(contains(branch, {0x0f, 0x8d})); // jge
+    REQUIRE(!contains(branch, setBool));
+    REQUIRE(2 == run(branch)->getInteger());
+
+    auto roundTrip = compileSource("(let ((c 'q')) (integer->char (char->integer c)))");
+    REQUIRE(!contains(roundTrip, {0x48, 0xc1, 0xe8, 0x06})); // shr rax, 6
+    REQUIRE('q' == run(roundTrip)->getChar());
+
+    auto generic = compileSource("(boolean? (car (cons (zero? 0) 1)))");
+    REQUIRE(contains(generic, setBool));
+    REQUIRE(run(generic)->getBool());
+}
+
+TEST_CASE("Compile arithmetic by constants", "[compiler]")
+{
+    uword heap[8];
+    auto run = [&](const std::string &source) {
+        CAPTURE(source);
+        auto buf = compileSource(source);
+        auto node = Reader::read(std::string{source});
+        auto interpreted = Interp::run(node.get(), heap);
+        REQUIRE(interpreted);
+        auto result = buf.freeze().toFunc<ASTNode *(uword *)>()(heap);
+        REQUIRE(reinterpret_cast<uword>(*interpreted) == reinterpret_cast<uword>(result));
+        return std::make_pair(result, buf._buf);
+    };
+    const std::vector<uint8_t> idiv{0x48, 0xf7, 0xf9}; // idiv rcx
+
+    const word big = Objects::IntegerMax - 1;
+    const std::vector<word> dividends{0, 1, -1, 2, -2, 7, -7, 99, -99, 1 << 20, 123456789012, -123456789012, big, -big};
+    const std::vector<word> divisors{1, -1, 2, -2, 3, -3, 5, 7, -7, 8, 10, 16, -16, 25, 100, 641, 1 << 20, INT32_MAX, INT32_MIN};
+    for (auto divisor : divisors)
+    {
+        for (auto dividend : dividends)
+        {
+            auto quotient = dividend / divisor;
+            auto remainder = dividend % divisor;
+            auto modulo = remainder != 0 && (remainder < 0) != (divisor < 0) ? remainder + divisor : remainder;
+            for (auto op : {"quotient", "remainder", "modulo"})
+            {
+                auto expected = std::string{op} == "quotient" ? quotient : std::string{op} == "remainder" ? remainder : modulo;
+                auto constant = run("(let ((x " + std::to_string(dividend) + ")) (" + op + " x " + std::to_string(divisor) + "))");
+                REQUIRE(expected == constant.first->getInteger());
+                REQUIRE(!containsBytes(constant.second, idiv));
+                auto generic = run("(let ((x " + std::to_string(dividend) + ") (d " + std::to_string(divisor) + ")) (" + op + " x d))");
+                REQUIRE(expected == generic.first->getInteger());
+            }
+        }
+    }
+    REQUIRE(run("(let ((d 0)) (quotient 5 d))").first->isError());
+    REQUIRE(run("(modulo 5 0)").first->isError());
+
+    const std::vector<word> factors{0, 1, -1, 2, 3, 5, 6, 9, 10, 12, 18, 24, 40, 72, 7, -8, 1 << 30, INT32_MAX, INT32_MIN};
+    for (auto factor : factors)
+    {
+        for (auto value : {word{0}, word{1}, word{-3}, word{1000003}, word{-77777777}})
+        {
+            auto product = run("(let ((x " + std::to_string(value) + ")) (* x " + std::to_string(factor) + "))");
+            REQUIRE(static_cast<word>(static_cast<uword>(value) * static_cast<uword>(factor)) << 2 >> 2 == product.first->getInteger());
+        }
+    }
+    auto shifted = run("(let ((x 5)) (* x 8))").second;
+    REQUIRE(containsBytes(shifted, {0x48, 0xc1, 0xe0, 0x03})); // shl rax, 3
+    REQUIRE(!containsBytes(shifted, {0x48, 0x6b}));             // imul rax, rax, imm8
+}
+
+TEST_CASE("Compressed pairs", "[compiler]")
+{
+    CompressedHeap heap(64 * 1024);
+    REQUIRE(Objects::compressedBase(heap.data()) == reinterpret_cast<uword>(heap.data()));
+    auto words = heap.size() / WordSize;
+
+    SECTION("car sign extends immediates and rebases heap references")
+    {
+        Buffer buf;
+        buf._options.compressed = true;
+        auto node = Reader::read("(car (cons 1 2))");
+        REQUIRE(0 == Compile::function(buf, node.get()));
+        std::vector<uint8_t> car{
+            0x48, 0x63, 0x40, 0xff, // movsxd rax, dword [rax-1]
+            0x89, 0xc1,             // mov ecx, eax
+            0x4c, 0x09, 0xf9,       // or rcx, r15
+            0xa8, 0x03,             // test al, 3
+            0x48, 0x0f, 0x4b, 0xc1, // cmovnp rax, rcx
+        };
+        REQUIRE(containsBytes(buf._buf, car));
+    }
+
+    SECTION("the interpreter matches compiled code")
+    {
+        for (auto source : differentialPrograms)
+        {
+            CAPTURE(source);
+            auto node = Reader::read(source);
+            Buffer buf;
+            buf._options.compressed = true;
+            if (Compile::function(buf, node.get()) != 0)
+            {
+                continue;
+            }
+            std::fill(heap.data(), heap.data() + words, 0);
+            auto interpreted = Interp::run(node.get(), heap.data(), true);
+            REQUIRE(interpreted);
+            std::vector<uword> interpretedHeap(heap.data(), heap.data() + words);
+
+            auto code = buf.freeze();
+            std::fill(heap.data(), heap.data() + words, 0);
+            auto result = code.toFunc<ASTNode *(uword *)>()(heap.data());
+            REQUIRE(reinterpret_cast<uword>(result) == reinterpret_cast<uword>(*interpreted));
+            REQUIRE(interpretedHeap == std::vector<uword>(heap.data(), heap.data() + words));
+        }
+    }
+
+    SECTION("values round trip through pairs")
+    {
+        auto node = Reader::read(
+            "(labels ((build (code (n) (if (zero? n) () (cons (* n -1000) (labelcall build (sub1 n)))))))"
+            "  (let ((list (labelcall build 3)) (v (make-vector 2 536870911)))"
+            "    (cons (cons 'a' (cons (zero? 0) \"text\")) (cons v (cons (car (cdr list)) list)))))");
+        REQUIRE(!node->isError());
+        Buffer buf;
+        buf._options.compressed = true;
+        REQUIRE(0 == Compile::function(buf, node.get()));
+        auto code = buf.freeze();
+        std::fill(heap.data(), heap.data() + words, 0);
+        auto result = code.toFunc<ASTNode *(uword *)>()(heap.data());
+        REQUIRE(result->isPair());
+
+        auto outer = result->asCompressedPair();
+        auto first = outer->getCar()->asCompressedPair();
+        REQUIRE('a' == first->getCar()->getChar());
+        REQUIRE(first->getCdr()->asCompressedPair()->getCar()->getBool());
+        REQUIRE("text" == first->getCdr()->asCompressedPair()->getCdr()->asString()->view());
+        auto rest = outer->getCdr()->asCompressedPair();
+        REQUIRE(536870911 == rest->getCar()->asVector()->elements()[1]->getInteger());
+        rest = rest->getCdr()->asCompressedPair();
+        REQUIRE(-2000 == rest->getCar()->getInteger());
+        auto list = rest->getCdr();
+        for (word n = 3; n > 0; --n)
+        {
+            REQUIRE(n * -1000 == list->asCompressedPair()->getCar()->getInteger());
+            list = list->asCompressedPair()->getCdr();
+        }
+        REQUIRE(list->isNil());
+    }
+
+    SECTION("pairs take eight bytes")
+    {
+        auto node = Reader::read("(cons 1 (cons 2 ()))");
+        Buffer buf;
+        buf._options.compressed = true;
+        REQUIRE(0 == Compile::function(buf, node.get()));
+        auto code = buf.freeze();
+        std::fill(heap.data(), heap.data() + words, 0);
+        auto result = code.toFunc<ASTNode *(uword *)>()(heap.data());
+        REQUIRE(reinterpret_cast<uword>(result) == (reinterpret_cast<uword>(heap.data()) + Objects::CompressedPairSize | Objects::PairTag));
+        auto inner = reinterpret_cast<CompressedPair *>(heap.data());
+        REQUIRE(Objects::encodeInteger(2) == inner->car);
+        REQUIRE(Objects::nil() == inner->cdr);
+        REQUIRE(0 == heap.data()[2]);
+    }
+}
+
+TEST_CASE("Profile guides the layout", "[compiler]")
+{
+    std::vector<uword> heap(1024);
+    auto compile = [](const std::string &source, Profile *profile, bool instrument) {
+        Buffer::Options options;
+        options.profile = profile;
+        options.instrument = instrument;
+        return compileSource(source, options);
+    };
+    auto run = [&](const Buffer &buf) {
+        std::fill(heap.begin(), heap.end(), 0);
+        return buf.freeze().toFunc<ASTNode *(uword *)>()(heap.data());
+    };
+
+    SECTION("counts arms and labels")
+    {
+        std::string source = "(labels ((cold (code (x) (add1 x)))"
+                             "         (loop (code (n acc) (if (zero? n) acc (labelcall loop (sub1 n) (if (< n 0) (labelcall cold n) (+ acc n))))))) "
+                             "  (labelcall loop 100 0))";
+        Profile profile;
+        REQUIRE(5050 == run(compile(source, &profile, true))->getInteger());
+        REQUIRE(profile.branches.size() == 2);
+        REQUIRE(profile.branches[0].then == 1);
+        REQUIRE(profile.branches[0].otherwise == 100);
+        REQUIRE(profile.branches[1].then == 0);
+        REQUIRE(profile.branches[1].otherwise == 100);
+        REQUIRE(profile.labelCalls == std::vector<uint64_t>{0, 101});
+
+        // loop is emitted first, on a 16 byte boundary
+        auto laid = compile(source, &profile, false);
+        REQUIRE(5050 == run(laid)->getInteger());
+        std::vector<std::string> names;
+        for (auto &label : laid._labels)
+        {
+            names.push_back(label.name);
+            if (label.name == "loop")
+            {
+                REQUIRE(label.offset % 16 == 0);
+            }
+        }
+        REQUIRE(names == std::vector<std::string>{"main", "loop", "cold", "main"});
+    }
+    SECTION("moves arms that never ran past the ret")
+    {
+        std::string source = "(let ((x 5)) (if (< x 0) 111 222))";
+        Profile profile;
+        run(compile(source, &profile, true));
+        auto laid = compile(source, &profile, false);
+        REQUIRE(222 == run(laid)->getInteger());
+        auto hot = findBytes(laid._buf, {0xb8, 0x78, 0x03, 0x00, 0x00}); // mov eax, 222
+        auto cold = findBytes(laid._buf, {0xb8, 0xbc, 0x01, 0x00, 0x00}); // mov eax, 111
+        auto ret = std::find(laid._buf.begin() + hot, laid._buf.end(), 0xc3) - laid._buf.begin();
+        REQUIRE(hot < ret);
+        REQUIRE(ret < cold);
+
+        // A cold arm still runs, and jumps back to where the `if` ends
+        std::string other = "(labels ((f (code (x) (add1 (if (< x 0) (labelcall f (- 0 x)) x))))) (labelcall f -7))";
+        Profile wrong;
+        wrong.branches = {{0, 3}};
+        wrong.labelCalls = {3};
+        REQUIRE(9 == run(compile(other, &wrong, false))->getInteger());
+    }
+    SECTION("puts the arm that ran more often first")
+    {
+        std::string source = "(labels ((f (code (n) (if (= n 0) 111 222))))"
+                             "  (cons (labelcall f 0) (cons (labelcall f 1) (labelcall f 2))))";
+        Profile profile;
+        run(compile(source, &profile, true));
+        REQUIRE(profile.branches[0].then == 1);
+        REQUIRE(profile.branches[0].otherwise == 2);
+        auto laid = compile(source, &profile, false);
+        REQUIRE(findBytes(laid._buf, {0xb8, 0x78, 0x03, 0x00, 0x00}) < findBytes(laid._buf, {0xb8, 0xbc, 0x01, 0x00, 0x00}));
+        auto pair = run(laid)->asPair();
+        REQUIRE(111 == pair->car->getInteger());
+        REQUIRE(222 == pair->cdr->asPair()->car->getInteger());
+        REQUIRE(222 == pair->cdr->asPair()->cdr->getInteger());
+    }
+    SECTION("leaves results alone")
+    {
+        for (auto source : differentialPrograms)
+        {
+            CAPTURE(source);
+            auto node = Reader::read(source);
+            Buffer plain;
+            if (Compile::function(plain, node.get()) != 0)
+            {
+                continue;
+            }
+            auto expected = reinterpret_cast<uword>(run(plain));
+            auto expectedHeap = heap;
+            Profile profile;
+            REQUIRE(expected == reinterpret_cast<uword>(run(compile(source, &profile, true))));
+            REQUIRE(expectedHeap == heap);
+            REQUIRE(expected == reinterpret_cast<uword>(run(compile(source, &profile, false))));
+            REQUIRE(expectedHeap == heap);
+        }
+    }
+    SECTION("ignores a profile of another program")
+    {
+        Profile profile;
+        profile.branches.resize(3, {0, 5});
+        auto laid = compile("(if #t 1 2)", &profile, false);
+        REQUIRE(compileSource("(if #t 1 2)")._buf == laid._buf);
+    }
+}
+
+TEST_CASE("Compile vector primitives", "[compiler]")
+{
+    // Lengths on both sides of the four element AVX2 blocks
+    std::vector<bool> modes{false};
+    if (Cpu::hasAvx2())
+    {
+        modes.push_back(true);
+    }
+    std::vector<uword> heap(256);
+    for (auto avx2 : modes)
+    {
+        for (word n = 0; n <= 13; ++n)
+        {
+            CAPTURE(avx2, n);
+            auto source = "(labels ((init (code (v i) (if (= i (vector-length v)) v"
+                          "                 (labelcall init (vector-set! v i (* (- i 5) (+ i 3))) (add1 i))))))"
+                          "  (let ((a (labelcall init (make-vector " + std::to_string(n) + " 0) 0)) (b (make-vector " + std::to_string(n) + " -3)))"
+                          "    (cons (vector-sum a) (cons (vector-map + a b) (vector-map * a (vector-fill! b 7))))))";
+            auto node = Reader::read(std::move(source));
+            Buffer buf;
+            buf._options.avx2 = avx2;
+            REQUIRE(0 == Compile::function(buf, node.get()));
+            std::fill(heap.begin(), heap.end(), 0);
+            auto interpreted = Interp::run(node.get(), heap.data());
+            REQUIRE(interpreted);
+            auto interpretedHeap = heap;
+
+            auto code = buf.freeze();
+            std::fill(heap.begin(), heap.end(), 0);
+            auto result = code.toFunc<ASTNode *(uword *)>()(heap.data());
+            REQUIRE(reinterpret_cast<uword>(result) == reinterpret_cast<uword>(*interpreted));
+            REQUIRE(interpretedHeap == heap);
+
+            word sum = 0;
+            for (word i = 0; i < n; ++i)
+            {
+                sum += (i - 5) * (i + 3);
+            }
+            REQUIRE(sum == result->asPair()->car->getInteger());
+            auto products = result->asPair()->cdr->asPair()->cdr->asVector();
+            REQUIRE(static_cast<size_t>(n) == products->size());
+            for (word i = 0; i < n; ++i)
+            {
+                REQUIRE((i - 5) * (i + 3) * 7 == products->elements()[i]->getInteger());
+            }
+        }
+    }
+}
+
+TEST_CASE("Compile string primitives", "[compiler]")
+{
+    std::vector<uword> heap(256);
+    auto run = [&](const std::string &source) {
+        auto code = compileSource(source).freeze();
+        return code.toFunc<ASTNode *(uword *)>()(heap.data());
+    };
+    // Lengths on both sides of the 16 byte blocks
+    std::string text = "GET /index.html 200 1432 0.003s";
+    for (size_t size = 0; size <= text.size(); ++size)
+    {
+        auto prefix = text.substr(0, size);
+        CAPTURE(prefix);
+        auto literal = "\"" + prefix + "\"";
+        REQUIRE(static_cast<word>(size) == run("(string-length " + literal + ")")->getInteger());
+        REQUIRE(run("(string=? " + literal + " " + literal + ")")->getBool());
+        for (auto c : {'G', '/', '2', '0', 's', 'x'})
+        {
+            auto found = prefix.find(c);
+            auto expected = found == std::string::npos ? -1 : static_cast<word>(found);
+            REQUIRE(expected == run("(string-index " + literal + " '" + c + "')")->getInteger());
+        }
+        if (size > 0)
+        {
+            auto changed = prefix;
+            changed.back() = '#';
+            REQUIRE(!run("(string=? " + literal + " \"" + changed + "\")")->getBool());
+            REQUIRE(!run("(string=? " + literal + " \"" + prefix.substr(1) + "\")")->getBool());
+            REQUIRE(prefix.back() == run("(string-ref " + literal + " " + std::to_string(size - 1) + ")")->getChar());
+        }
+    }
+    // The routines are calls: a label's register formals survive them
+    REQUIRE(11 == run("(labels ((f (code (a b) (+ (string-index \"key=value\" '=') (+ a b)))))"
+                      "  (labelcall f 3 5))")
+                      ->getInteger());
+    auto node = Reader::read("(string=? \"a\")");
+    Buffer buf;
+    REQUIRE(-1 == Compile::function(buf, node.get()));
+}
+
+TEST_CASE("Engine compiles hot programs", "[interp]")
+{
+    Engine engine;
+    uword heap[64];
+    std::string source = "(+ 1 2)";
+    auto node = Reader::read(std::string{source});
+    REQUIRE(Engine::Tier::Interpreter == engine.choose(source, node.get()));
+    REQUIRE(Engine::Tier::Compiler == engine.choose(source, node.get()));
+    REQUIRE(3 == (*engine.run(source, node.get(), heap))->getInteger());
+
+    std::string recursive = "(labels ((id (code (x) x))) (labelcall id 5))";
+    auto recursiveNode = Reader::read(std::string{recursive});
+    REQUIRE(Engine::Tier::Compiler == engine.choose(recursive, recursiveNode.get()));
+    REQUIRE(5 == (*engine.run(recursive, recursiveNode.get(), heap))->getInteger());
+
+    // Both tiers fail on an unbound name in an arm that never runs
+    std::string unbound = "(if #t 1 x)";
+    auto unboundNode = Reader::read(std::string{unbound});
+    REQUIRE(!engine.run(unbound, unboundNode.get(), heap));
+    REQUIRE(!engine.run(unbound, unboundNode.get(), heap));
+}
+
+TEST_CASE("Engine forgets the coldest programs", "[interp]")
+{
+    Engine::Policy policy;
+    policy.maxEntries = 2;
+    Engine engine{policy};
+    uword heap[64];
+    std::string a = "(+ 1 2)", b = "(+ 3 4)", c = "(+ 5 6)";
+    auto nodeA = Reader::read(std::string{a});
+    auto nodeB = Reader::read(std::string{b});
+    auto nodeC = Reader::read(std::string{c});
+    REQUIRE(Engine::Tier::Interpreter == engine.choose(a, nodeA.get()));
+    REQUIRE(Engine::Tier::Interpreter == engine.choose(b, nodeB.get()));
+    // a runs again, so b is now the coldest, and c takes its place
+    REQUIRE(3 == (*engine.run(a, nodeA.get(), heap))->getInteger());
+    REQUIRE(Engine::Tier::Interpreter == engine.choose(c, nodeC.get()));
+    REQUIRE(Engine::Tier::Compiler == engine.choose(a, nodeA.get()));
+    REQUIRE(Engine::Tier::Interpreter == engine.choose(b, nodeB.get()));
+    // Which pushed out c, so its count starts over, and a goes in turn
+    REQUIRE(Engine::Tier::Interpreter == engine.choose(c, nodeC.get()));
+    REQUIRE(11 == (*engine.run(c, nodeC.get(), heap))->getInteger());
+    // a had been compiled, but is interpreted and compiled anew
+    REQUIRE(Engine::Tier::Interpreter == engine.choose(a, nodeA.get()));
+    REQUIRE(3 == (*engine.run(a, nodeA.get(), heap))->getInteger());
+}
+
+TEST_CASE("Labels enter through their slots", "[tiering]")
+{
+    auto node = Reader::read("(labels ((id (code (x) x)) (twice (code (x) (labelcall id (labelcall id x))))) "
+                             "(labelcall twice 5))");
+    LabelSlot slots[2];
+    Buffer buf;
+    buf._options.labelSlots = slots;
+    REQUIRE(Compile::function(buf, node.get()) == 0);
+    auto code = buf.freeze();
+    auto base = reinterpret_cast<uword>(code.data());
+    slots[0].target = base + buf._labels[1].offset + Compile::LabelStubSize;
+    slots[1].target = base + buf._labels[2].offset + Compile::LabelStubSize;
+
+    uword heap[8];
+    REQUIRE(5 == code.toFunc<ASTNode *(uword *)>()(heap)->getInteger());
+    REQUIRE(2 == slots[0].calls);
+    REQUIRE(1 == slots[1].calls);
+}
+
+TEST_CASE("Optimize folds constants", "[optimize]")
+{
+    auto fold = [](const char *source) {
+        auto node = Reader::read(source);
+        return Optimize::expr(node.get(), {});
+    };
+    REQUIRE(14 == fold("(let ((x 2)) (+ x (* 3 4)))")->getInteger());
+    REQUIRE(1 == fold("(if (< 1 2) 1 (labelcall f))")->getInteger());
+    REQUIRE(fold("(zero? (sub1 1))")->getBool());
+    REQUIRE(1 == fold("(let ((x 0)) (add1 x))")->getInteger());
+    // Wider than an imm32
+    REQUIRE(10000000000 == fold("(* 100000 100000)")->getInteger());
+    // `let` is not `let*`, and inner bindings shadow outer constants
+    REQUIRE(3 == fold("(let ((a 1)) (let ((a 2) (b a)) (+ a b)))")->getInteger());
+
+    std::unique_ptr<ASTNode, decltype(&heapFree)> string{fold("(let ((x 1)) \"text\")"), &heapFree};
+    REQUIRE(string->asString()->view() == "text");
+
+    std::unique_ptr<ASTNode, decltype(&heapFree)> kept{fold("(let ((a (cons 1 2))) (cons (car a) a))"), &heapFree};
+    REQUIRE(kept->isPair());
+    REQUIRE(kept->asPair()->car->asSymbol()->str == "let");
+}
+
+TEST_CASE("Optimize replaces pairs that do not escape", "[optimize]")
+{
+    auto optimize = [](const char *source) {
+        auto node = Reader::read(source);
+        return std::unique_ptr<ASTNode, decltype(&heapFree)>{Optimize::expr(node.get(), {}), &heapFree};
+    };
+    auto hasCons = [](ASTNode *node) {
+        auto search = [](auto &self, ASTNode *node) -> bool {
+            if (!node->isPair())
+            {
+                return node->isSymbol() && node->asSymbol()->str == "cons";
+            }
+            return self(self, node->asPair()->car) || self(self, node->asPair()->cdr);
+        };
+        return search(search, node);
+    };
+    auto run = [](ASTNode *node) {
+        Buffer buf;
+        REQUIRE(0 == Compile::function(buf, node));
+        auto code = buf.freeze();
+        uword heap[8] = {};
+        auto result = code.toFunc<ASTNode *(uword *)>()(heap);
+        REQUIRE(heap[0] == 0);
+        return result->getInteger();
+    };
+
+    REQUIRE(3 == optimize("(let ((p (cons 1 2))) (+ (car p) (cdr p)))")->getInteger());
+    REQUIRE(20 == optimize("(let ((n 4)) (let ((p (cons (add1 n) n))) (let ((q (cons (car p) n))) (* (car q) (cdr p)))))")->getInteger());
+    REQUIRE(6 == optimize("(let ((a 6)) (let ((p (cons a (* a 2)))) (let ((q (cons (cdr p) (car p)))) (- (car q) (cdr q)))))")->getInteger());
+
+    // The halves stay in the binding's place, so they still see the outer x
+    auto ordered = optimize("(let ((x (car y))) (let ((p (cons x 5)) (x 2)) (- (cdr p) (car p))))");
+    REQUIRE(!hasCons(ordered.get()));
+    auto nested = optimize("(let ((p (cons y 1))) (car (car p)))");
+    REQUIRE(!hasCons(nested.get()));
+    // An inner `let` that rebinds the name reads its own variable
+    auto shadowed = optimize("(let ((p (cons y 2))) (let ((p (car y))) (+ p (cdr y))))");
+    REQUIRE(!hasCons(shadowed.get()));
+
+    auto values = optimize("(let ((a (car y)) (b (cdr y))) (let ((p (cons (* a b) (+ a b)))) (- (car p) (cdr p))))");
+    REQUIRE(!hasCons(values.get()));
+    auto stackOnly = optimize("(let ((a 6) (b 8)) (let ((p (cons (* a b) (+ a b)))) (- (car p) (cdr p))))");
+    REQUIRE(34 == run(stackOnly.get()));
+
+    // Escapes: stored, returned, passed on or aliased
+    REQUIRE(hasCons(optimize("(let ((p (cons 1 2))) (cons (car p) p))").get()));
+    REQUIRE(hasCons(optimize("(let ((p (cons 1 2))) p)").get()));
+    REQUIRE(hasCons(optimize("(let ((p (cons 1 2))) (labelcall f p))").get()));
+    REQUIRE(hasCons(optimize("(let ((p (cons 1 2))) (let ((q p)) (car q)))").get()));
+}
+
+TEST_CASE("Optimize inlines leaf labels", "[optimize]")
+{
+    auto square = Reader::read("(code (x) (* x x))");
+    auto recursive = Reader::read("(code (x) (labelcall f x))");
+    auto open = Reader::read("(code (x) (+ x y))");
+    Optimize::Labels labels{{"sq", square.get()}, {"f", recursive.get()}, {"open", open.get()}};
+    auto optimize = [&](const char *source) {
+        auto node = Reader::read(source);
+        return std::unique_ptr<ASTNode, decltype(&heapFree)>{Optimize::expr(node.get(), labels), &heapFree};
+    };
+
+    REQUIRE(9 == optimize("(labelcall sq 3)")->getInteger());
+    auto inlined = optimize("(labelcall sq (car y))");
+    REQUIRE(inlined->asPair()->car->asSymbol()->str == "let");
+    auto called = optimize("(labelcall f 1)");
+    REQUIRE(called->asPair()->car->asSymbol()->str == "labelcall");
+    auto notClosed = optimize("(let ((y 1)) (labelcall open (car z)))");
+    REQUIRE(notClosed->asPair()->car->asSymbol()->str == "labelcall");
+}
+
+TEST_CASE("TieredProgram recompiles hot labels", "[tiering]")
+{
+    TieredProgram::Options options;
+    options.hotThreshold = 50;
+    options.pollInterval = std::chrono::milliseconds(1);
+    auto program = TieredProgram::create(
+        "(labels ((sq (code (x) (* x x)))"
+        "         (sumsq (code (n) (if (zero? n) 0 (+ (labelcall sq n) (labelcall sumsq (sub1 n)))))))"
+        "    (labelcall sumsq 10))",
+        options);
+    REQUIRE(program);
+    REQUIRE(2 == program->labelCount());
+    REQUIRE("sumsq" == program->labelName(1));
+
+    uword heap[8];
+    REQUIRE(385 == program->run(heap)->getInteger());
+    REQUIRE(11 == program->calls(1));
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!(program->isOptimized(0) && program->isOptimized(1)) && std::chrono::steady_clock::now() < deadline)
+    {
+        REQUIRE(385 == program->run(heap)->getInteger());
+    }
+    REQUIRE(program->isOptimized(0));
+    REQUIRE(program->isOptimized(1));
+    auto sqCalls = program->calls(0);
+    REQUIRE(385 == program->run(heap)->getInteger());
+    // The optimized sumsq has sq inlined
+    REQUIRE(sqCalls == program->calls(0));
+
+    TieredProgram::Options eager;
+    eager.lazy = false;
+    REQUIRE(!TieredProgram::create("(labels ((f (code (x) (labelcall g x)))) 1)", eager));
+}
+
+TEST_CASE("TieredProgram compiles labels on their first call", "[tiering]")
+{
+    auto program = TieredProgram::create(
+        "(labels ((unused (code (x) (labelcall missing x)))"
+        "         (id (code (x) x))"
+        "         (pick (code (a b c) (if (< a b) (labelcall id c) b))))"
+        "    (let ((l (cons 1 2))) (+ (car l) (labelcall pick 1 2 (cdr l)))))");
+    REQUIRE(program);
+    for (size_t i = 0; i < program->labelCount(); ++i)
+    {
+        REQUIRE(!program->isCompiled(i));
+    }
+
+    uword heap[8];
+    REQUIRE(3 == program->run(heap)->getInteger());
+    REQUIRE(!program->isCompiled(0));
+    REQUIRE(program->isCompiled(1));
+    REQUIRE(program->isCompiled(2));
+    REQUIRE(3 == program->run(heap)->getInteger());
+    REQUIRE(!program->compileFailed());
+
+    auto broken = TieredProgram::create("(labels ((f (code (x) (labelcall g x)))) (labelcall f 1))");
+    REQUIRE(broken);
+    REQUIRE(broken->run(heap)->isError());
+    REQUIRE(broken->compileFailed());
+    REQUIRE(broken->run(heap)->isError());
+}
+
+TEST_CASE("CodeArena packs code into shared chunks", "[globals]")
+{
+    CodeArena arena;
+    auto one = Reader::read("(+ 1 2)");
+    auto two = Reader::read("(cons 1 2)");
+    Buffer buf1, buf2;
+    REQUIRE(0 == Compile::function(buf1, one.get()));
+    REQUIRE(0 == Compile::function(buf2, two.get()));
+    auto code1 = buf1.freeze(arena);
+    auto code2 = buf2.freeze(arena);
+    REQUIRE(1 == arena.chunkCount());
+    REQUIRE(code2.data() > code1.data());
+    REQUIRE(0 == reinterpret_cast<uword>(code2.data()) % 16);
+
+    uword heap[8];
+    REQUIRE(3 == code1.toFunc<ASTNode *(uword *)>()(heap)->getInteger());
+    REQUIRE(code2.toFunc<ASTNode *(uword *)>()(heap)->isPair());
+}
+
+TEST_CASE("Globals are called through their slots", "[globals]")
+{
+    Globals globals;
+    auto define = [&](const char *source) {
+        auto node = Reader::read(source);
+        REQUIRE(Globals::isDefine(node.get()));
+        return globals.define(node.get());
+    };
+    auto compile = [&](const char *source) {
+        auto node = Reader::read(source);
+        Buffer buf;
+        buf._options.globals = globals.table();
+        REQUIRE(0 == Compile::function(buf, node.get()));
+        return buf.freeze();
+    };
+    uword heap[8];
+
+    REQUIRE(0 == define("(define sq (code (x) (* x x)))"));
+    REQUIRE(0 == define("(define fact (code (n) (if (< n 2) 1 (* n (labelcall fact (sub1 n))))))"));
+    REQUIRE(0 == define("(define sqfact (code (n) (labelcall sq (labelcall fact n))))"));
+    auto program = compile("(labelcall sqfact 3)");
+    REQUIRE(36 == program.toFunc<ASTNode *(uword *)>()(heap)->getInteger());
+
+    // Code compiled earlier sees the new definition
+    REQUIRE(0 == define("(define sq (code (x) (+ x x)))"));
+    REQUIRE(12 == program.toFunc<ASTNode *(uword *)>()(heap)->getInteger());
+
+    // Labels of the program shadow globals
+    auto shadowed = compile("(labels ((sq (code (x) x))) (labelcall sq 5))");
+    REQUIRE(5 == shadowed.toFunc<ASTNode *(uword *)>()(heap)->getInteger());
+
+    REQUIRE(-1 == define("(define broken (code (x) (labelcall missing x)))"));
+    REQUIRE(!globals.contains("broken"));
+    REQUIRE(-1 == define("(define sq 5)"));
+    REQUIRE(1 == globals.arena().chunkCount());
+}
+
+TEST_CASE("Engine compiles programs that call globals", "[globals]")
+{
+    Globals globals;
+    auto definition = Reader::read("(define twice (code (x) (+ x x)))");
+    REQUIRE(0 == globals.define(definition.get()));
+
+    Engine engine{Engine::Policy{100, false}};
+    engine.setGlobals(&globals);
+    std::string source = "(labelcall twice 21)";
+    auto node = Reader::read(std::string{source});
+    uword heap[8];
+    REQUIRE(Engine::Tier::Compiler == engine.choose(source, node.get()));
+    REQUIRE(42 == (*engine.run(source, node.get(), heap))->getInteger());
+}
+
+TEST_CASE("Compile safepoint polls", "[scheduler]")
+{
+    auto node = Reader::read("(labels ((id (code (x) x))) (labelcall id 5))");
+    Buffer buf;
+    buf._options.safepoints = true;
+    REQUIRE(0 == Compile::function(buf, node.get()));
+    auto code = buf.freeze();
+
+    // Nothing asks for a yield, so the handler is never needed
+    SafepointControl control;
+    uword heap[8];
+    REQUIRE(5 == code.toFunc<ASTNode *(uword *, SafepointControl *)>()(heap, &control)->getInteger());
+}
+
+static const char *fib(int n)
+{
+    static std::string sources[64];
+    sources[n] = "(labels ((fib (code (n) (if (< n 2) n (+ (labelcall fib (- n 1)) (labelcall fib (- n 2)))))))"
+                 "    (labelcall fib " + std::to_string(n) + "))";
+    return sources[n].c_str();
+}
+
+TEST_CASE("Scheduler runs tasks to completion", "[scheduler]")
+{
+    Scheduler::Options options;
+    options.threads = 2;
+    options.quantum = std::chrono::microseconds(200);
+    Scheduler scheduler{options};
+
+    std::vector<Scheduler::TaskId> ids;
+    for (int i = 0; i < 8; ++i)
+    {
+        ids.push_back(scheduler.spawn(fib(20 + i % 3), std::chrono::seconds(60)));
+    }
+    const word expected[] = {6765, 10946, 17711};
+    for (int i = 0; i < 8; ++i)
+    {
+        auto result = scheduler.wait(ids[i]);
+        REQUIRE(Scheduler::Status::Finished == result.status);
+        REQUIRE(expected[i % 3] == result.value->getInteger());
+    }
+
+    auto broken = scheduler.spawn("(labelcall missing 1)", std::chrono::seconds(1));
+    REQUIRE(Scheduler::Status::CompileError == scheduler.wait(broken).status);
+}
+
+TEST_CASE("Scheduler stops runaway tasks", "[scheduler]")
+{
+    Scheduler::Options options;
+    options.threads = 1;
+    options.quantum = std::chrono::microseconds(500);
+    Scheduler scheduler{options};
+
+    auto runaway = scheduler.spawn(fib(45), std::chrono::milliseconds(20));
+    auto cancelled = scheduler.spawn(fib(45), std::chrono::seconds(60));
+    // Both share one thread with the runaway tasks
+    auto quick = scheduler.spawn(fib(15), std::chrono::seconds(60));
+
+    REQUIRE(Scheduler::Status::OutOfFuel == scheduler.wait(runaway).status);
+    auto result = scheduler.wait(quick);
+    REQUIRE(Scheduler::Status::Finished == result.status);
+    REQUIRE(610 == result.value->getInteger());
+    scheduler.cancel(cancelled);
+    REQUIRE(Scheduler::Status::Cancelled == scheduler.wait(cancelled).status);
+}
+
+TEST_CASE("Scheduler stops tasks that overflow their stack", "[scheduler]")
+{
+    Scheduler::Options options;
+    options.threads = 1;
+    options.stackSize = 1 << 16;
+    Scheduler scheduler{options};
+
+    auto deep = scheduler.spawn("(labels ((down (code (n) (+ 1 (labelcall down n))))) (labelcall down 0))",
+                                std::chrono::seconds(60));
+    auto quick = scheduler.spawn(fib(15), std::chrono::seconds(60));
+    REQUIRE(Scheduler::Status::StackOverflow == scheduler.wait(deep).status);
+    auto result = scheduler.wait(quick);
+    REQUIRE(Scheduler::Status::Finished == result.status);
+    REQUIRE(610 == result.value->getInteger());
+    // The worker thread is still good for more
+    REQUIRE(610 == scheduler.wait(scheduler.spawn(fib(15), std::chrono::seconds(60))).value->getInteger());
+}
+
+TEST_CASE("JitStack runs deep recursion", "[jitstack]")
+{
+    auto compile = [](const char *source) {
+        auto node = Reader::read(source);
+        Buffer buf;
+        REQUIRE(0 == Compile::function(buf, node.get()));
+        return buf.freeze();
+    };
+    auto sum = compile("(labels ((sum (code (n) (if (= n 0) 0 (+ n (labelcall sum (- n 1)))))))"
+                       "    (labelcall sum 1000000))");
+    auto forever = compile("(labels ((down (code (n) (+ 1 (labelcall down n))))) (labelcall down 0))");
+
+    JitStack stack;
+    uword heap[8];
+    REQUIRE(500000500000 == stack.run(sum, heap)->getInteger());
+    REQUIRE(!stack.overflowed());
+
+    REQUIRE(stack.run(forever, heap)->isError());
+    REQUIRE(stack.overflowed());
+    // A fresh stack replaces the one that overflowed
+    REQUIRE(500000500000 == stack.run(sum, heap)->getInteger());
+    REQUIRE(!stack.overflowed());
+
+    // More address space than there is
+    JitStack huge{size_t{1} << 60};
+    REQUIRE(huge.run(sum, heap)->isError());
+    REQUIRE(!huge.overflowed());
+}
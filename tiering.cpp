@@ -0,0 +1,181 @@
+#include "tiering.h"
+#include "optimize.h"
+
+#include <cassert>
+
+std::unique_ptr<TieredProgram> TieredProgram::create(const std::string &source, Options options)
+{
+    auto node = Reader::read(std::string{source});
+    if (node->isError())
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<TieredProgram> program{new TieredProgram};
+    program->_options = options;
+    auto root = node.get();
+    if (root->isPair() && root->asPair()->car->isSymbol() && root->asPair()->car->asSymbol()->str == "labels")
+    {
+        auto bindings = root->asPair()->cdr->asPair()->car;
+        for (auto binding = bindings; !binding->isNil(); binding = binding->asPair()->cdr)
+        {
+            auto pair = binding->asPair()->car->asPair();
+            program->_names.push_back(pair->car->asSymbol()->str);
+            program->_codes.push_back(pair->cdr->asPair()->car);
+        }
+    }
+    auto count = program->_names.size();
+    program->_slots = std::make_unique<LabelSlot[]>(count);
+
+    Buffer buf;
+    buf._options.labelSlots = program->_slots.get();
+    if (options.lazy)
+    {
+        buf._options.lazyCompile = &TieredProgram::compileOnFirstCall;
+        buf._options.lazyContext = program.get();
+    }
+    if (Compile::function(buf, root) != 0)
+    {
+        return nullptr;
+    }
+    // The first entry is the function itself, then one per label. A label's
+    // stub is followed by either its body or its trampoline.
+    assert(buf._labels.size() >= count + 1);
+    for (size_t i = 0; i < count; ++i)
+    {
+        program->_stubs.push_back(buf._labels[i + 1].offset);
+    }
+
+    program->_baseline = std::make_unique<Code>(buf.freeze());
+    auto base = reinterpret_cast<uword>(program->_baseline->data());
+    for (size_t i = 0; i < count; ++i)
+    {
+        program->_stubs[i] += base;
+        program->_slots[i].target.store(program->_stubs[i] + Compile::LabelStubSize, std::memory_order_release);
+    }
+
+    Buffer error;
+    Emit::movRegImm32(error, Emit::Rax, static_cast<int32_t>(Objects::error()));
+    Emit::ret(error);
+    program->_errorStub = std::make_unique<Code>(error.freeze());
+
+    program->_node = std::move(node);
+    program->_states.assign(count, options.lazy ? State::Uncompiled : State::Baseline);
+    if (count)
+    {
+        program->_thread = std::thread{&TieredProgram::backgroundLoop, program.get()};
+    }
+    return program;
+}
+
+TieredProgram::~TieredProgram()
+{
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        _stopping = true;
+    }
+    _wake.notify_all();
+    if (_thread.joinable())
+    {
+        _thread.join();
+    }
+}
+
+ASTNode *TieredProgram::run(uword *heap) const
+{
+    return _baseline->call<ASTNode *(uword *)>(heap);
+}
+
+uint64_t TieredProgram::calls(size_t label) const
+{
+    return _slots[label].calls.load(std::memory_order_relaxed);
+}
+
+bool TieredProgram::isCompiled(size_t label) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _states[label] != State::Uncompiled;
+}
+
+bool TieredProgram::isOptimized(size_t label) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _states[label] == State::Optimized;
+}
+
+bool TieredProgram::compileFailed() const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _compileFailed;
+}
+
+uint64_t TieredProgram::compileOnFirstCall(void *context, uint64_t label)
+{
+    auto program = static_cast<TieredProgram *>(context);
+    std::lock_guard<std::mutex> lock{program->_mutex};
+    // Another thread may have compiled it in the meantime
+    if (program->_states[label] == State::Uncompiled)
+    {
+        if (program->compile(label, /*optimize=*/false))
+        {
+            program->_states[label] = State::Baseline;
+        }
+        else
+        {
+            program->_compileFailed = true;
+            program->_states[label] = State::Failed;
+            program->_slots[label].target.store(reinterpret_cast<uint64_t>(program->_errorStub->data()),
+                                                std::memory_order_release);
+        }
+    }
+    return program->_slots[label].target.load(std::memory_order_acquire);
+}
+
+bool TieredProgram::compile(size_t label, bool optimize)
+{
+    Stats::Timer timer{Stats::Phase::Compile};
+
+    // Calls go through the stubs so they reach whichever version is current
+    Optimize::Labels visible;
+    LabelTable labels;
+    for (size_t i = 0; i < _names.size(); ++i)
+    {
+        visible[_names[i]] = _codes[i];
+        labels.add(_names[i], static_cast<word>(_stubs[i]));
+    }
+
+    auto optimized = optimize ? Optimize::code(_codes[label], visible) : _codes[label];
+    Buffer buf;
+    buf._options.absoluteLabels = true;
+    buf._labels.push_back({optimize ? _names[label] + ".opt" : _names[label], 0});
+    auto result = Compile::code(buf, optimized, &labels);
+    if (optimize)
+    {
+        heapFree(optimized);
+    }
+    if (result != 0)
+    {
+        return false;
+    }
+    timer.setBytes(buf.size());
+
+    auto code = std::make_unique<Code>(buf.freeze());
+    _slots[label].target.store(reinterpret_cast<uword>(code->data()), std::memory_order_release);
+    _versions.push_back(std::move(code));
+    return true;
+}
+
+void TieredProgram::backgroundLoop()
+{
+    std::unique_lock<std::mutex> lock{_mutex};
+    while (!_wake.wait_for(lock, _options.pollInterval, [this] { return _stopping; }))
+    {
+        for (size_t i = 0; i < _names.size(); ++i)
+        {
+            if (_states[i] == State::Baseline && calls(i) >= _options.hotThreshold)
+            {
+                _states[i] = compile(i, /*optimize=*/true) ? State::Optimized : State::Failed;
+            }
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "alisp.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// TieredProgram: a `labels` program whose labels are compiled on their first
+// call and recompiled with Optimize on a background thread once they are hot.
+// Every label is entered through a LabelSlot, so switching to a new version
+// is a single store that calls already in flight never notice.
+class TieredProgram final
+{
+public:
+    struct Options
+    {
+        // Calls to a label before it is recompiled
+        uint64_t hotThreshold = 1000;
+        // How often the background thread looks at the call counters
+        std::chrono::milliseconds pollInterval{10};
+        // Compile each label on its first call rather than up front
+        bool lazy = true;
+    };
+
+    // Returns nullptr if the program does not compile. A lazy program only
+    // compiles its body up front: a label that does not compile returns
+    // Objects::error() when it is called, and compileFailed() becomes true.
+    static std::unique_ptr<TieredProgram> create(const std::string &source, Options options);
+    static std::unique_ptr<TieredProgram> create(const std::string &source) { return create(source, Options{}); }
+    ~TieredProgram();
+
+    ASTNode *run(uword *heap) const;
+
+    size_t labelCount() const { return _names.size(); }
+    const std::string &labelName(size_t label) const { return _names[label]; }
+    uint64_t calls(size_t label) const;
+    bool isCompiled(size_t label) const;
+    bool isOptimized(size_t label) const;
+    bool compileFailed() const;
+
+private:
+    TieredProgram() = default;
+    // Buffer::Options::LazyCompile, called from the label trampolines
+    static uint64_t compileOnFirstCall(void *context, uint64_t label);
+    bool compile(size_t label, bool optimize);
+    void backgroundLoop();
+
+    std::unique_ptr<ASTNode, void (*)(ASTNode *)> _node{nullptr, &heapFree};
+    std::vector<std::string> _names;
+    std::vector<ASTNode *> _codes;
+    std::unique_ptr<LabelSlot[]> _slots;
+    std::unique_ptr<Code> _baseline;
+    // Where each label's stub starts in the baseline code
+    std::vector<uword> _stubs;
+    Options _options;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _stopping = false;
+    enum class State
+    {
+        Uncompiled,
+        Baseline,
+        Optimized,
+        // The optimized version did not compile; the label stays on the baseline
+        Failed,
+    };
+    std::vector<State> _states;
+    bool _compileFailed = false;
+    // Every version compiled after the baseline, plus the stub that reports errors
+    std::vector<std::unique_ptr<Code>> _versions;
+    std::unique_ptr<Code> _errorStub;
+    std::thread _thread;
+};